@@ -45,6 +45,27 @@ AC_DEFUN(PA_SIGSETJMP,
  AC_MSG_RESULT([no])
  $2)])
 
+dnl --------------------------------------------------------------------------
+dnl PA_ATOMIC_BUILTINS
+dnl
+dnl Does the compiler have the __atomic builtins (gcc 4.7+, clang)?  Used
+dnl for state shared between the server processes.
+dnl --------------------------------------------------------------------------
+AH_TEMPLATE([HAVE_ATOMIC_BUILTINS],
+[Define if the compiler supports the __atomic builtins.])
+
+AC_DEFUN(PA_ATOMIC_BUILTINS,
+[AC_MSG_CHECKING([for __atomic builtins])
+ AC_TRY_LINK([],
+ [unsigned long x = 0, y = 0;
+  __atomic_fetch_or(&x, 1UL, __ATOMIC_ACQ_REL);
+  __atomic_compare_exchange_n(&x, &y, 2UL, 0,
+                              __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+  return (int)__atomic_load_n(&x, __ATOMIC_ACQUIRE);],
+ AC_MSG_RESULT([yes])
+ AC_DEFINE(HAVE_ATOMIC_BUILTINS),
+ AC_MSG_RESULT([no]))])
+
 dnl --------------------------------------------------------------------------
 dnl PA_MSGHDR_MSG_CONTROL
 dnl
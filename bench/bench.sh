@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Run tftp-bench through a few workloads against a tftpd of our own,
+# serving a scratch directory on a loopback port.  Starting tftpd
+# needs root, since it switches to an unprivileged user; to benchmark
+# a server that is already running instead, set BENCH_SERVER to
+# "host port" and BENCH_DIR to a directory of the same files it
+# serves (see below).  Extra arguments for every run can be given in
+# BENCH_ARGS, for instance a minimum throughput with -m.  To run
+# everything over an impaired link, give BENCH_RELAY the options for
+# relay/tftp-relay, say "-l 1 -d 10 -s 1"; it listens on the port
+# after BENCH_PORT.
+#
+# Exits non-zero if any transfer fails.
+
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+bench="$here/tftp-bench"
+tftpd="$here/../tftpd/tftpd"
+relay="$here/../relay/tftp-relay"
+port=${BENCH_PORT:-16969}
+pid=
+relay_pid=
+
+cleanup() {
+    [ -n "$relay_pid" ] && kill "$relay_pid" 2>/dev/null
+    [ -n "$pid" ] && kill "$pid" 2>/dev/null
+    [ -n "$scratch" ] && rm -rf "$scratch"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+if [ -n "$BENCH_SERVER" ]; then
+    server=$BENCH_SERVER
+    dir=${BENCH_DIR:?BENCH_DIR must name the files the server has}
+else
+    if [ "$(id -u)" != 0 ]; then
+        echo "bench: starting tftpd needs root; set BENCH_SERVER to use a running one" >&2
+        exit 1
+    fi
+    scratch=$(mktemp -d "${TMPDIR:-/tmp}/tftp-bench.XXXXXX")
+    dir=$scratch
+    chmod 777 "$dir"
+fi
+
+# The files fetched, and uploaded under new names
+if [ ! -f "$dir/64k.bin" ]; then
+    dd if=/dev/urandom of="$dir/64k.bin" bs=1024 count=64 2>/dev/null
+    dd if=/dev/urandom of="$dir/1m.bin" bs=1024 count=1024 2>/dev/null
+    dd if=/dev/urandom of="$dir/16m.bin" bs=1048576 count=16 2>/dev/null
+    chmod 644 "$dir"/*.bin
+fi
+
+if [ -z "$BENCH_SERVER" ]; then
+    "$tftpd" -L -a "127.0.0.1:$port" -s -c "$dir" &
+    pid=$!
+    sleep 1
+    server="127.0.0.1 $port"
+fi
+
+if [ -n "$BENCH_RELAY" ]; then
+    "$relay" $BENCH_RELAY "127.0.0.1:$((port + 1))" $server &
+    relay_pid=$!
+    sleep 1
+    server="127.0.0.1 $((port + 1))"
+fi
+
+run() {
+    echo
+    echo "== $1"
+    shift
+    "$bench" $BENCH_ARGS "$@" $server
+}
+
+run "small files, default options" \
+    -c 16 -n 200 -g 64k.bin
+run "small files, blksize 1428" \
+    -c 16 -n 200 -B 1428 -g 64k.bin
+run "bulk download, windowsize 16" \
+    -c 4 -n 32 -B 1428 -w 16 -g 16m.bin
+run "bulk upload, windowsize 8" \
+    -c 4 -n 32 -B 1428 -w 8 -u up -p "$dir/1m.bin"
+run "mixed" \
+    -c 32 -n 400 -B 1428 -w 4 -g 64k.bin:8 -g 1m.bin:2 -u mix \
+    -p "$dir/64k.bin"
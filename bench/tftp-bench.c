@@ -0,0 +1,775 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * tftp-bench.c
+ *
+ * Load generator for tftpd.  Keeps a number of transfers going at once
+ * against one server, each on its own socket, all run by the transfer
+ * engine from one poll() loop, and reports the throughput, transfers
+ * per second, completion times and the CPU time spent per gigabyte.
+ *
+ * Downloads go to /dev/null and are checked against the size the
+ * server gave in tsize.  Uploads are sent under a name of their own
+ * each, so the server must allow creating files.
+ *
+ * With -r, the requests come from a trace written by tftpd --trace
+ * instead, each started as long after the first as it was in the
+ * trace (or that divided by -x), and each result is compared with the
+ * one the trace recorded.
+ */
+
+#include "../common/tftpsubs.h"
+#include "../common/xfer.h"
+#include "../tftpd/trace.h"
+
+#include <poll.h>
+#include <sys/resource.h>
+
+#define MAX_MIX         64
+#define REQ_MAX         512
+
+struct job {
+    int op;                     /* RRQ or WRQ */
+    const char *name;           /* File to get, or local file to put */
+    unsigned long size;         /* WRQ: size of the local file */
+    int weight;
+    int blksize, windowsize;
+    /* From a trace */
+    long at;                    /* us after the first request */
+    int orig_ok;
+    long orig_us;               /* How long it took then */
+};
+
+enum cstate { C_FREE, C_REQUEST, C_XFER, C_DALLY };
+
+struct client {
+    enum cstate state;
+    int fd;
+    const struct job *job;
+    FILE *fp;
+    long started;               /* xfer_now_us() */
+    long deadline;              /* C_REQUEST: when to repeat the request */
+    int tries;
+    size_t reqlen;
+    char req[REQ_MAX];
+    unsigned long tsize;        /* RRQ: size the server announced */
+    int have_tsize;
+    struct tftp_xfer x;
+};
+
+static const char *progname;
+static union sock_addr server;
+static struct job mix[MAX_MIX];
+static int nmix, total_weight;
+static struct client *clients;
+static int nslots;
+
+static int blksize = SEGSIZE;
+static int windowsize = 1;
+static int timeout = TIMEOUT;
+static const char *prefix = "bench";
+static int verbose;
+
+static unsigned long started, finished, failed, sequence;
+static unsigned long long bytes;
+static long *times;             /* Completion times, us */
+
+static struct job *trace;       /* -r: the requests to replay, in order */
+static double speed = 1;        /* -x; 0 for as fast as possible */
+static unsigned long matched;   /* Same result as in the trace */
+static long *late;              /* How late each request started, us */
+
+static char rxbuf[PKTSIZE];
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: %s [-c clients] [-n count] [-B blksize] [-w windowsize]\n"
+            "       [-t timeout_ms] [-s seed] [-u prefix] [-m min_MB/s] [-v]\n"
+            "       {-g file[:weight] | -p localfile[:weight]}... host [port]\n"
+            "       %s [-c clients] [-n count] [-t timeout_ms] [-u prefix]\n"
+            "       [-x speed] [-v] -r tracefile host [port]\n",
+            progname, progname);
+    exit(EX_USAGE);
+}
+
+static void add_job(int op, char *arg)
+{
+    struct job *j;
+    struct stat st;
+    char *p, *end;
+
+    if (nmix >= MAX_MIX) {
+        fprintf(stderr, "%s: too many files\n", progname);
+        exit(EX_USAGE);
+    }
+    j = &mix[nmix++];
+    j->op = op;
+    j->weight = 1;
+    p = strrchr(arg, ':');
+    if (p) {
+        j->weight = strtol(p + 1, &end, 10);
+        if (*end || j->weight < 1)
+            usage();
+        *p = '\0';
+    }
+    j->name = arg;
+
+    if (op == WRQ) {
+        if (stat(arg, &st)) {
+            fprintf(stderr, "%s: %s: %s\n", progname, arg, strerror(errno));
+            exit(EX_NOINPUT);
+        }
+        j->size = st.st_size;
+    }
+    total_weight += j->weight;
+}
+
+static int cmp_at(const void *a, const void *b)
+{
+    const struct job *x = a, *y = b;
+
+    return x->at < y->at ? -1 : x->at > y->at;
+}
+
+/* Read a trace written by tftpd --trace; returns the number of requests */
+static unsigned long load_trace(const char *path)
+{
+    struct trace_rec t;
+    struct job *j;
+    unsigned long n = 0, room = 0, len, i, first;
+    unsigned long *secs = NULL;
+    char name[TRACE_NAMEMAX + 1];
+    char *buf;
+    size_t got;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+        exit(EX_NOINPUT);
+    }
+
+    for (;;) {
+        buf = (char *)&t;
+        got = fread(buf, 1, TRACE_MAGICLEN, f);
+        if (!got && feof(f))
+            break;              /* The end, between records */
+        if (got != TRACE_MAGICLEN)
+            goto bad;
+        if (!memcmp(buf, TRACE_MAGIC, TRACE_MAGICLEN))
+            continue;
+        if (fread(buf + TRACE_MAGICLEN, 1, sizeof t - TRACE_MAGICLEN, f) !=
+            sizeof t - TRACE_MAGICLEN)
+            goto bad;
+        len = ntohs(t.length);
+        if (len < sizeof t || len > sizeof t + TRACE_NAMEMAX ||
+            fread(name, 1, len - sizeof t, f) != len - sizeof t)
+            goto bad;
+        name[len - sizeof t] = '\0';
+
+        if (n == room) {
+            room = room ? room * 2 : 1024;
+            trace = xrealloc(trace, room * sizeof *trace);
+            secs = xrealloc(secs, room * sizeof *secs);
+        }
+        secs[n] = ntohl(t.sec);
+        j = &trace[n++];
+        memset(j, 0, sizeof *j);
+        j->op = t.op == WRQ ? WRQ : RRQ;
+        j->name = xstrdup(name);
+        j->size = (unsigned long)ntohl(t.bytes_hi) << 16 << 16 |
+            ntohl(t.bytes_lo);
+        j->blksize = ntohs(t.blksize) ? ntohs(t.blksize) : SEGSIZE;
+        j->windowsize = ntohs(t.windowsize) ? ntohs(t.windowsize) : 1;
+        j->at = ntohl(t.usec);
+        j->orig_ok = t.result == TRACE_OK;
+        j->orig_us = ntohl(t.duration_us);
+    }
+    fclose(f);
+
+    if (!n) {
+        fprintf(stderr, "%s: %s: no requests\n", progname, path);
+        exit(EX_DATAERR);
+    }
+
+    /* Times from the first second in the trace */
+    first = secs[0];
+    for (i = 1; i < n; i++)
+        if (secs[i] < first)
+            first = secs[i];
+    for (i = 0; i < n; i++)
+        trace[i].at += (long)(secs[i] - first) * 1000000;
+    free(secs);
+
+    qsort(trace, n, sizeof *trace, cmp_at);
+    return n;
+
+bad:
+    fprintf(stderr, "%s: %s: not a trace, or cut short\n", progname, path);
+    exit(EX_DATAERR);
+}
+
+static const struct job *pick_job(void)
+{
+    int r;
+    int i;
+
+    if (trace)
+        return &trace[started];
+
+    r = rand() % total_weight;
+    for (i = 0; i < nmix - 1; i++) {
+        r -= mix[i].weight;
+        if (r < 0)
+            break;
+    }
+    return &mix[i];
+}
+
+static size_t put_opt(char *p, size_t left, const char *opt, unsigned long v)
+{
+    int n = snprintf(p, left, "%s%c%lu", opt, '\0', v);
+
+    if (n < 0 || (size_t)n + 1 > left)
+        return 0;
+    return n + 1;
+}
+
+static void build_request(struct client *c)
+{
+    struct tftphdr *tp = (struct tftphdr *)c->req;
+    char *p = (char *)&tp->th_stuff;
+    size_t left = sizeof c->req - 2;
+    int n;
+
+    tp->th_opcode = htons(c->job->op);
+    if (c->job->op == RRQ)
+        n = snprintf(p, left, "%s%coctet", c->job->name, '\0');
+    else
+        n = snprintf(p, left, "%s.%lu%coctet", prefix, sequence, '\0');
+    if (n < 0 || (size_t)n + 1 > left) {
+        fprintf(stderr, "%s: %s: name too long\n", progname, c->job->name);
+        exit(EX_USAGE);
+    }
+    p += n + 1;
+    left -= n + 1;
+
+    n = put_opt(p, left, "tsize", c->job->op == RRQ ? 0 : c->job->size);
+    p += n;
+    left -= n;
+    if (c->job->blksize != SEGSIZE) {
+        n = put_opt(p, left, "blksize", c->job->blksize);
+        p += n;
+        left -= n;
+    }
+    if (c->job->windowsize != 1) {
+        n = put_opt(p, left, "windowsize", c->job->windowsize);
+        p += n;
+    }
+    c->reqlen = p - c->req;
+}
+
+static void finish(struct client *c, int ok, const char *why)
+{
+    long us = xfer_now_us() - c->started;
+    int news = !trace || c->job->orig_ok;
+
+    if (trace && ok == c->job->orig_ok)
+        matched++;
+    if (!ok) {
+        failed++;
+        /* Requests which failed in the trace as well are no news */
+        if (verbose || (failed <= 10 && news))
+            fprintf(stderr, "%s: %s %s: %s\n", progname,
+                    c->job->op == RRQ ? "get" : "put", c->job->name, why);
+    } else {
+        times[finished - failed] = us;
+        bytes += c->x.amount;
+    }
+    finished++;
+
+    if (c->fp)
+        fclose(c->fp);
+    c->fp = NULL;
+    if (ok && xfer_dallying(&c->x, xfer_now())) {
+        c->state = C_DALLY;     /* In case our last ACK is lost */
+        return;
+    }
+    if (c->x.mem)
+        xfer_free(&c->x);
+    close(c->fd);
+    c->state = C_FREE;
+}
+
+static void start(struct client *c, long now)
+{
+    memset(c, 0, sizeof *c);
+    c->job = pick_job();
+    build_request(c);
+
+    c->fd = socket(server.sa.sa_family, SOCK_DGRAM, 0);
+    if (c->fd < 0) {
+        fprintf(stderr, "%s: socket: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    if (trace && c->job->op == WRQ) {
+        /* As much as was uploaded then, of nothing in particular */
+        c->fp = tmpfile();
+        if (c->fp && ftruncate(fileno(c->fp), c->job->size)) {
+            fclose(c->fp);
+            c->fp = NULL;
+        }
+    } else {
+        c->fp = fopen(c->job->op == RRQ ? "/dev/null" : c->job->name,
+                      c->job->op == RRQ ? "w" : "r");
+    }
+    if (!c->fp) {
+        fprintf(stderr, "%s: %s: %s\n", progname, c->job->name,
+                strerror(errno));
+        exit(EX_NOINPUT);
+    }
+
+    c->state = C_REQUEST;
+    c->started = xfer_now_us();
+    c->tries = RETRIES;
+    c->deadline = now + timeout;
+    sequence++;
+    started++;
+    sendto(c->fd, c->req, c->reqlen, 0, &server.sa, SOCKLEN(&server));
+}
+
+/* The first packet from the server: OACK, or DATA 1 or ACK 0 if it
+   did not take up any of our options */
+static void first_reply(struct client *c, size_t n, union sock_addr *from,
+                        long now)
+{
+    struct tftphdr *tp = (struct tftphdr *)rxbuf;
+    size_t bs = SEGSIZE;
+    int ws = 1;
+    char *p, *end, *val;
+    char error[ERROR_MAXLEN];
+    unsigned short op;
+
+    if (n < 4)
+        return;
+    op = ntohs(tp->th_opcode);
+
+    if (op == ERROR) {
+        format_error(tp, error);
+        finish(c, 0, error);
+        return;
+    }
+
+    if (op == OACK) {
+        p = (char *)&tp->th_stuff;
+        end = rxbuf + n;
+        while (p < end) {
+            val = memchr(p, '\0', end - p);
+            if (!val || ++val >= end)
+                break;
+            if (!strcasecmp(p, "blksize"))
+                bs = strtoul(val, NULL, 10);
+            else if (!strcasecmp(p, "windowsize"))
+                ws = strtoul(val, NULL, 10);
+            else if (!strcasecmp(p, "tsize")) {
+                c->tsize = strtoul(val, NULL, 10);
+                c->have_tsize = 1;
+            }
+            p = memchr(val, '\0', end - val);
+            if (!p)
+                break;
+            p++;
+        }
+    } else if (!(op == DATA && c->job->op == RRQ) &&
+               !(op == ACK && c->job->op == WRQ && !ntohs(tp->th_block))) {
+        return;
+    }
+
+    /* Everything else comes from the port the server replied from */
+    if (connect(c->fd, &from->sa, SOCKLEN(from))) {
+        finish(c, 0, strerror(errno));
+        return;
+    }
+
+    if (xfer_init(&c->x, c->job->op == RRQ ? XFER_RECV : XFER_SEND, c->fp,
+                  bs, ws, timeout, 0, now)) {
+        finish(c, 0, "Out of memory");
+        return;
+    }
+    c->state = C_XFER;
+
+    if (op == DATA)
+        xfer_feed(&c->x, rxbuf, n, now);
+    else if (op == OACK && c->job->op == RRQ)
+        send(c->fd, "\0\4\0\0", 4, 0);      /* ACK 0 */
+}
+
+/* Read whatever has arrived, and send whatever is due */
+static void service(struct client *c, long now)
+{
+    union sock_addr from;
+    socklen_t fromlen;
+    const void *pkt;
+    ssize_t n;
+    size_t len;
+
+    for (;;) {
+        if (c->state == C_REQUEST) {
+            fromlen = sizeof from;
+            n = recvfrom(c->fd, rxbuf, sizeof rxbuf - 1, MSG_DONTWAIT,
+                         &from.sa, &fromlen);
+            if (n < 0)
+                break;
+            rxbuf[n] = '\0';   /* For an ERROR without its NUL */
+            first_reply(c, n, &from, now);
+            if (c->state == C_FREE)
+                return;
+        } else {
+            n = recv(c->fd, c->x.rxbuf, c->x.blocksize + 4, MSG_DONTWAIT);
+            if (n < 0)
+                break;
+            xfer_feed(&c->x, c->x.rxbuf, n, now);
+        }
+    }
+
+    if (c->state == C_REQUEST) {
+        if (now - c->deadline < 0)
+            return;
+        if (--c->tries <= 0) {
+            finish(c, 0, "Timeout");
+            return;
+        }
+        c->deadline = now + timeout;
+        sendto(c->fd, c->req, c->reqlen, 0, &server.sa, SOCKLEN(&server));
+        return;
+    }
+
+    xfer_poll(&c->x, now);
+    while ((len = xfer_produce(&c->x, &pkt)) > 0)
+        send(c->fd, pkt, len, 0);
+
+    if (c->state == C_DALLY) {
+        if (!xfer_dallying(&c->x, now)) {
+            xfer_free(&c->x);
+            close(c->fd);
+            c->state = C_FREE;
+        }
+    } else if (xfer_finished(&c->x)) {
+        if (c->x.state == XFER_FAILED)
+            finish(c, 0, c->x.errmsg);
+        else if (c->job->op == RRQ && c->have_tsize &&
+                 c->x.amount != c->tsize)
+            finish(c, 0, "Size differs from tsize");
+        else
+            finish(c, 1, NULL);
+    }
+}
+
+static long next_wakeup(const struct client *c, long now)
+{
+    long w;
+
+    if (c->state == C_REQUEST)
+        w = c->deadline - now;
+    else if (c->state == C_DALLY)
+        w = c->x.dally_until - now;
+    else
+        w = c->x.deadline - now;
+    return w < 0 ? 0 : w;
+}
+
+/* Non-idle time of all CPUs, in seconds, from /proc/stat */
+static double system_cpu(void)
+{
+    unsigned long long v[8] = { 0 };
+    FILE *f = fopen("/proc/stat", "r");
+    int n;
+
+    if (!f)
+        return -1;
+    n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+    fclose(f);
+    if (n < 4)
+        return -1;
+
+    /* Everything but idle (3) and iowait (4) */
+    return (double)(v[0] + v[1] + v[2] + v[5] + v[6] + v[7]) /
+        sysconf(_SC_CLK_TCK);
+}
+
+static double self_cpu(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Of n sorted times in us, in ms */
+static double percentile(const long *v, unsigned long n, int pct)
+{
+    unsigned long i;
+
+    if (!n)
+        return 0;
+    i = (n * pct + 99) / 100;
+    return v[i ? i - 1 : 0] / 1000.0;
+}
+
+/* How long from the start until the next request in the trace is due */
+static long due_in(long elapsed_us)
+{
+    long at = speed > 0 ? (long)(trace[started].at / speed) : 0;
+
+    return at - elapsed_us;
+}
+
+int main(int argc, char **argv)
+{
+    int nclients = 0, active, i, c, n;
+    unsigned long count = 0, ntrace = 0;
+    unsigned int seed = 1;
+    double min_rate = 0, secs, rate, gb, cpu_self, cpu_sys;
+    long now, wait, t0, w;
+    struct pollfd *pfd;
+    struct client **pcl;
+    char *port = NULL, *end;
+    const char *trace_file = NULL;
+    unsigned long ok, norig = 0;
+    long *orig;
+
+    progname = argv[0];
+
+    while ((c = getopt(argc, argv, "c:n:B:w:t:s:u:m:g:p:r:x:v")) != -1) {
+        switch (c) {
+        case 'c':
+            nclients = strtol(optarg, &end, 10);
+            if (*end || nclients < 1)
+                usage();
+            break;
+        case 'n':
+            count = strtoul(optarg, &end, 10);
+            if (*end || !count)
+                usage();
+            break;
+        case 'B':
+            blksize = strtol(optarg, &end, 10);
+            if (*end || blksize < 8 || blksize > MAX_SEGSIZE)
+                usage();
+            break;
+        case 'w':
+            windowsize = strtol(optarg, &end, 10);
+            if (*end || windowsize < 1 || windowsize > 65535)
+                usage();
+            break;
+        case 't':
+            timeout = strtol(optarg, &end, 10);
+            if (*end || timeout < 1)
+                usage();
+            break;
+        case 's':
+            seed = strtoul(optarg, &end, 10);
+            if (*end)
+                usage();
+            break;
+        case 'u':
+            prefix = optarg;
+            break;
+        case 'm':
+            min_rate = strtod(optarg, &end);
+            if (*end)
+                usage();
+            break;
+        case 'g':
+            add_job(RRQ, optarg);
+            break;
+        case 'p':
+            add_job(WRQ, optarg);
+            break;
+        case 'r':
+            trace_file = optarg;
+            break;
+        case 'x':
+            speed = strtod(optarg, &end);
+            if (*end || speed < 0)
+                usage();
+            break;
+        case 'v':
+            verbose++;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (!nmix == !trace_file || argc - optind < 1 || argc - optind > 2)
+        usage();
+    if (argc - optind == 2)
+        port = argv[optind + 1];
+
+    memset(&server, 0, sizeof server);
+    n = set_sock_addr(argv[optind], &server, NULL);
+    if (n) {
+        fprintf(stderr, "%s: %s: %s\n", progname, argv[optind],
+                gai_strerror(n));
+        exit(EX_NOHOST);
+    }
+    n = port ? strtol(port, &end, 10) : IPPORT_TFTP;
+    if ((port && *end) || n < 1 || n > 65535)
+        usage();
+    sa_set_port(&server, htons(n));
+
+    srand(seed);
+
+    for (i = 0; i < nmix; i++) {
+        mix[i].blksize = blksize;
+        mix[i].windowsize = windowsize;
+    }
+    if (trace_file) {
+        ntrace = load_trace(trace_file);
+        if (!count || count > ntrace)
+            count = ntrace;
+        late = xmalloc(count * sizeof *late);
+    }
+    if (!count)
+        count = 100;
+    /* A trace can have many requests at once, which a few would hold up */
+    if (!nclients)
+        nclients = trace ? 64 : 8;
+
+    /* Room for as many again finishing their dally */
+    nslots = nclients * 2;
+    clients = xmalloc(nslots * sizeof *clients);
+    for (i = 0; i < nslots; i++)
+        clients[i].state = C_FREE;
+    pfd = xmalloc(nslots * sizeof *pfd);
+    pcl = xmalloc(nslots * sizeof *pcl);
+    times = xmalloc(count * sizeof *times);
+
+    cpu_self = self_cpu();
+    cpu_sys = system_cpu();
+    t0 = xfer_now_us();
+
+    for (;;) {
+        now = xfer_now();
+
+        active = 0;
+        for (i = 0; i < nslots; i++)
+            if (clients[i].state == C_REQUEST || clients[i].state == C_XFER)
+                active++;
+        wait = -1;
+        for (i = 0; i < nslots && active < nclients && started < count; i++) {
+            if (clients[i].state != C_FREE)
+                continue;
+            if (trace) {
+                w = due_in(xfer_now_us() - t0);
+                if (w > 0) {
+                    wait = (w + 999) / 1000;    /* Until it is */
+                    break;
+                }
+                late[started] = -w;
+            }
+            start(&clients[i], now);
+            active++;
+        }
+
+        n = 0;
+        for (i = 0; i < nslots; i++) {
+            if (clients[i].state == C_FREE)
+                continue;
+            pfd[n].fd = clients[i].fd;
+            pfd[n].events = POLLIN;
+            pcl[n++] = &clients[i];
+            if (wait < 0 || next_wakeup(&clients[i], now) < wait)
+                wait = next_wakeup(&clients[i], now);
+        }
+        if (!n && started == count)
+            break;              /* All done */
+
+        if (poll(pfd, n, wait) < 0 && errno != EINTR) {
+            fprintf(stderr, "%s: poll: %s\n", progname, strerror(errno));
+            exit(EX_OSERR);
+        }
+
+        now = xfer_now();
+        for (i = 0; i < n; i++)
+            service(pcl[i], now);
+    }
+
+    secs = (xfer_now_us() - t0) / 1e6;
+    cpu_self = self_cpu() - cpu_self;
+    if (cpu_sys >= 0)
+        cpu_sys = system_cpu() - cpu_sys;
+
+    ok = finished - failed;
+    qsort(times, ok, sizeof *times, cmp_long);
+    rate = secs > 0 ? bytes / secs / 1e6 : 0;
+    gb = bytes / 1e9;
+
+    if (trace)
+        printf("%lu requests from %s, at %gx, up to %d at once\n",
+               count, trace_file, speed, nclients);
+    else
+        printf("%lu transfers, %d at once, blksize %d, windowsize %d\n",
+               count, nclients, blksize, windowsize);
+    printf("  completed   %lu (%lu failed) in %.3f s, %.1f/s\n",
+           ok, failed, secs, secs > 0 ? ok / secs : 0);
+    printf("  throughput  %.2f MB/s (%llu bytes)\n", rate, bytes);
+    printf("  completion  p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           percentile(times, ok, 50), percentile(times, ok, 99),
+           percentile(times, ok, 100));
+    if (trace) {
+        /* The same, as the trace has it */
+        orig = xmalloc(count * sizeof *orig);
+        for (i = 0; (unsigned long)i < count; i++)
+            if (trace[i].orig_ok)
+                orig[norig++] = trace[i].orig_us;
+        qsort(orig, norig, sizeof *orig, cmp_long);
+        printf("  originally  p50 %.2f ms, p99 %.2f ms, max %.2f ms"
+               " (%lu completed)\n",
+               percentile(orig, norig, 50), percentile(orig, norig, 99),
+               percentile(orig, norig, 100), norig);
+        qsort(late, count, sizeof *late, cmp_long);
+        printf("  started     p50 %.2f ms, p99 %.2f ms, max %.2f ms late\n",
+               percentile(late, count, 50), percentile(late, count, 99),
+               percentile(late, count, 100));
+        printf("  results     %lu of %lu as in the trace\n", matched, count);
+    }
+    printf("  cpu         bench %.3f s", cpu_self);
+    if (gb > 0)
+        printf(" (%.2f s/GB)", cpu_self / gb);
+    if (cpu_sys >= 0) {
+        printf(", all others %.3f s", cpu_sys - cpu_self);
+        if (gb > 0)
+            printf(" (%.2f s/GB)", (cpu_sys - cpu_self) / gb);
+    }
+    printf("\n");
+
+    if (trace ? matched != count : failed != 0)
+        return 1;
+    if (min_rate > 0 && rate < min_rate) {
+        fprintf(stderr, "%s: %.2f MB/s is below the minimum of %.2f\n",
+                progname, rate, min_rate);
+        return 1;
+    }
+    return 0;
+}
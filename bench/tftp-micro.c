@@ -0,0 +1,348 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * tftp-micro.c
+ *
+ * Microbenchmarks for the building blocks every request and every
+ * block goes through: the transfer engine reading and sending blocks
+ * from a file, and receiving and writing them, at several block and
+ * window sizes; building a request; and filename remapping with the
+ * rules in pxe.rules and tftpd/sample.rules.
+ *
+ * Each benchmark runs for a set time, as many times as asked, and
+ * prints one line per run in the format of Go's testing package, which
+ * is easy to compare between two builds by eye or with benchstat:
+ *
+ *   BenchmarkSend/blksize=1428/window=1   1048576   98.3 ns/op   14527.11 MB/s
+ */
+
+#include "../common/tftpsubs.h"
+#include "../common/xfer.h"
+#ifdef WITH_REGEX
+#include "../tftpd/remap.h"
+#endif
+
+#define FILE_SIZE       (8 * 1024 * 1024)
+
+int verbosity;                  /* For remap.c */
+
+struct benchmark {
+    const char *name;
+    /* Do n operations; returns the bytes moved by one, or 0 */
+    size_t (*run)(const struct benchmark *, unsigned long n);
+    size_t blksize;
+    int windowsize;
+    const char *rules;
+};
+
+static const char *progname;
+static FILE *src, *sink;
+static volatile size_t request_len;     /* Keeps the result wanted */
+
+/* Read and send blocks, acknowledging each window as it goes out */
+static size_t run_send(const struct benchmark *b, unsigned long n)
+{
+    struct tftp_xfer x;
+    unsigned char ack[4] = { 0, ACK, 0, 0 };
+    unsigned short block;
+    const void *pkt;
+    unsigned long done = 0;
+
+    while (done < n) {
+        rewind(src);
+        if (xfer_init(&x, XFER_SEND, src, b->blksize, b->windowsize,
+                      TIMEOUT, 0, 0))
+            return 0;
+        while (done < n && !xfer_finished(&x)) {
+            while (xfer_produce(&x, &pkt))
+                done++;
+            block = xfer_block(&x, x.next - 1);
+            ack[2] = block >> 8;
+            ack[3] = block;
+            xfer_feed(&x, ack, sizeof ack, 0);
+        }
+        xfer_free(&x);
+    }
+    return b->blksize;
+}
+
+/* Take in blocks and write them out, sending an ACK every window */
+static size_t run_recv(const struct benchmark *b, unsigned long n)
+{
+    struct tftp_xfer x;
+    struct tftphdr *tp;
+    unsigned long done = 0, blocks = FILE_SIZE / b->blksize;
+    char *pkt = xmalloc(b->blksize + 4);
+    const void *out;
+
+    tp = (struct tftphdr *)pkt;
+    tp->th_opcode = htons(DATA);
+    memset(tp->th_data, 'x', b->blksize);
+
+    while (done < n) {
+        rewind(sink);
+        if (xfer_init(&x, XFER_RECV, sink, b->blksize, b->windowsize,
+                      TIMEOUT, 0, 0)) {
+            free(pkt);
+            return 0;
+        }
+        while (done < n && !xfer_finished(&x)) {
+            tp->th_block = htons(xfer_block(&x, x.base));
+            /* The last block is short, and ends the transfer */
+            xfer_feed(&x, pkt, x.base < blocks ? b->blksize + 4 : 4, 0);
+            while (xfer_produce(&x, &out))
+                ;
+            done++;
+        }
+        xfer_free(&x);
+    }
+    free(pkt);
+    return b->blksize;
+}
+
+static size_t run_request(const struct benchmark *b, unsigned long n)
+{
+    static const char *names[] = {
+        "pxelinux.0",
+        "pxelinux.cfg/01-52-54-00-12-34-56",
+        "boot/x64/images/boot.wim",
+        "SEP0023AB45CD67.cnf.xml",
+    };
+    char buf[PKTSIZE];
+    unsigned long i;
+
+    for (i = 0; i < n; i++)
+        request_len = make_request(RRQ, names[i & 3], "octet", b->blksize,
+                                   b->windowsize, i, -1, 0,
+                                   (struct tftphdr *)buf, sizeof buf);
+    return 0;
+}
+
+#ifdef WITH_REGEX
+
+/* What a mixed population of network boot clients asks for */
+static const char *const requests[] = {
+    "pxelinux.0",
+    "pxelinux.cfg/01-52-54-00-12-34-56",
+    "pxelinux.cfg/C0A80A2F",
+    "pxelinux.cfg/C0A80A2",
+    "pxelinux.cfg/C0A80A",
+    "pxelinux.cfg/default",
+    "ldlinux.c32",
+    "vesamenu.c32",
+    "\\Boot\\x64\\wdsnbp.com",
+    "\\Boot\\x64\\pxeboot.n12",
+    "\\Boot\\BCD",
+    "\\boot\\fonts\\wgl4_boot.ttf",
+    "Boot/x64/Images/boot.wim",
+    "bootmgfw.efi",
+    "grubx64.efi",
+    "grub/grub.cfg-01-52-54-00-12-34-56",
+    "grub/x86_64-efi/normal.mod",
+    "ipxe/undionly.kpxe",
+    "boot.ipxe",
+    "SEP0023AB45CD67.cnf.xml",
+    "spa525.cfg",
+    "0023ab45cd67.cfg",
+    "network-confg",
+    "router-confg",
+    "../../etc/passwd",
+    "C:\\secrets\\server.key",
+};
+
+static int macros(char macro, char *output)
+{
+    static const char addr[] = "192.0.2.47";
+
+    if (macro != 'i')
+        return -1;
+    if (output)
+        strcpy(output, addr);
+    return sizeof addr - 1;
+}
+
+static struct rule *load_rules(const char *path)
+{
+    struct rule *rules;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+        exit(EX_NOINPUT);
+    }
+    rules = parserulefile(f);
+    fclose(f);
+    return rules;
+}
+
+static size_t run_remap(const struct benchmark *b, unsigned long n)
+{
+    static const char *loaded;
+    static struct rule *rules;
+    const int nreq = sizeof requests / sizeof *requests;
+    const char *msg;
+    unsigned long i;
+    char *out;
+
+    if (loaded != b->rules) {
+        if (rules)
+            freerules(rules);
+        rules = load_rules(b->rules);
+        loaded = b->rules;
+    }
+
+    for (i = 0; i < n; i++) {
+        out = rewrite_string(requests[i % nreq], rules, i & 8 ? 'P' : 'G',
+                             AF_INET, macros, &msg);
+        free(out);
+    }
+    return 0;
+}
+
+static size_t run_parse(const struct benchmark *b, unsigned long n)
+{
+    unsigned long i;
+
+    for (i = 0; i < n; i++)
+        freerules(load_rules(b->rules));
+    return 0;
+}
+
+#endif
+
+static const struct benchmark benchmarks[] = {
+    { "Send/blksize=512/window=1",      run_send, 512, 1, NULL },
+    { "Send/blksize=1428/window=1",     run_send, 1428, 1, NULL },
+    { "Send/blksize=1428/window=16",    run_send, 1428, 16, NULL },
+    { "Send/blksize=8192/window=4",     run_send, 8192, 4, NULL },
+    { "Send/blksize=65464/window=1",    run_send, 65464, 1, NULL },
+    { "Recv/blksize=512/window=1",      run_recv, 512, 1, NULL },
+    { "Recv/blksize=1428/window=1",     run_recv, 1428, 1, NULL },
+    { "Recv/blksize=1428/window=16",    run_recv, 1428, 16, NULL },
+    { "Recv/blksize=8192/window=4",     run_recv, 8192, 4, NULL },
+    { "Recv/blksize=65464/window=1",    run_recv, 65464, 1, NULL },
+    { "MakeRequest/default",            run_request, SEGSIZE, 0, NULL },
+    { "MakeRequest/options",            run_request, 1428, 16, NULL },
+#ifdef WITH_REGEX
+    { "Remap/sample",                   run_remap, 0, 0, "../tftpd/sample.rules" },
+    { "Remap/pxe",                      run_remap, 0, 0, "pxe.rules" },
+    { "ParseRules/pxe",                 run_parse, 0, 0, "pxe.rules" },
+#endif
+    { NULL, NULL, 0, 0, NULL }
+};
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: %s [-t seconds] [-c count] [-l] [name...]\n"
+            "Runs the benchmarks whose names contain any of the names\n"
+            "given, or all of them.  Run it from the bench directory.\n",
+            progname);
+    exit(EX_USAGE);
+}
+
+/* Enough operations to take about "target" us, then "count" runs */
+static void measure(const struct benchmark *b, long target, int count)
+{
+    unsigned long n = 1;
+    long start, took;
+    size_t bytes;
+    int i;
+
+    for (;;) {
+        start = xfer_now_us();
+        b->run(b, n);
+        took = xfer_now_us() - start;
+        if (took >= target / 10 || n >= 1UL << 40)
+            break;
+        n *= 10;
+    }
+    if (took < 1)
+        took = 1;
+    n = (unsigned long)((double)n * target / took) + 1;
+
+    for (i = 0; i < count; i++) {
+        start = xfer_now_us();
+        bytes = b->run(b, n);
+        took = xfer_now_us() - start;
+
+        printf("Benchmark%s\t%lu\t%.1f ns/op", b->name, n,
+               took * 1000.0 / n);
+        if (bytes)
+            printf("\t%.2f MB/s", (double)bytes * n / took);
+        putchar('\n');
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const struct benchmark *b;
+    long target = 500000;
+    int count = 1, list = 0, c, i, match;
+    char *end, *buf;
+    double secs;
+
+    progname = argv[0];
+
+    while ((c = getopt(argc, argv, "t:c:l")) != -1) {
+        switch (c) {
+        case 't':
+            secs = strtod(optarg, &end);
+            if (*end || secs <= 0)
+                usage();
+            target = secs * 1000000;
+            break;
+        case 'c':
+            count = strtol(optarg, &end, 10);
+            if (*end || count < 1)
+                usage();
+            break;
+        case 'l':
+            list = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (list) {
+        for (b = benchmarks; b->name; b++)
+            printf("Benchmark%s\n", b->name);
+        return 0;
+    }
+
+    /* Files in the page cache, as they usually would be */
+    src = tmpfile();
+    sink = tmpfile();
+    if (!src || !sink) {
+        fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+        return EX_OSERR;
+    }
+    buf = xmalloc(FILE_SIZE);
+    for (i = 0; i < FILE_SIZE; i++)
+        buf[i] = (char)(i * 2654435761UL >> 13);
+    if (fwrite(buf, 1, FILE_SIZE, src) != FILE_SIZE || fflush(src)) {
+        fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+        return EX_IOERR;
+    }
+    free(buf);
+
+    for (b = benchmarks; b->name; b++) {
+        match = optind == argc;
+        for (i = optind; i < argc && !match; i++)
+            match = strstr(b->name, argv[i]) != NULL;
+        if (match)
+            measure(b, target, count);
+    }
+
+    return 0;
+}
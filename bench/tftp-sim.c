@@ -0,0 +1,556 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * tftp-sim.c
+ *
+ * Runs sender() and receiver() against each other in one process, over
+ * a simulated link with loss, delay, jitter, reordering, duplication
+ * and a bandwidth limit, on a virtual clock.  Nothing waits for real:
+ * when both ends are waiting, the clock jumps to the next packet due
+ * or the next timeout, so a transfer which would take minutes on a
+ * bad link takes a fraction of a millisecond, and the same seed gives
+ * the same result every time.
+ *
+ * The two ends are coroutines: sender() and receiver() run unchanged,
+ * with xfer_io pointed at the simulated clock and link, and give way to
+ * each other whenever they would block.  Socket 0 is the sender's end
+ * and socket 1 the receiver's.
+ *
+ * -w and -l take lists, and every combination is run; one line of
+ * goodput, retransmission overhead and completion times each.
+ *
+ * With -W, the receiver writes into a scratch file through an
+ * xfer_writer of that many buffers, as tftpd does with --write-behind,
+ * and the file is read back to check it.
+ */
+
+#include "../common/tftpsubs.h"
+#include "../common/xfer.h"
+
+#if defined(HAVE_UCONTEXT_H) && defined(HAVE_FMEMOPEN)
+
+#include <ucontext.h>
+
+#define MAX_LIST        32
+#define MAX_WBUFS       64
+#define STACK_SIZE      (256 * 1024)
+
+struct packet {
+    struct packet *next;
+    long due;                   /* us */
+    size_t len;
+    char data[PKTSIZE];
+};
+
+struct end {
+    ucontext_t ctx;
+    char *stack;
+    struct packet *inbox;       /* In order of due time */
+    long busy_until;            /* us: its link is sending until then */
+    long last_due;              /* us: when the last packet sent arrives */
+    int waiting;
+    long wake;                  /* us: when waiting gives up */
+    int done;
+    int r;
+    unsigned long data_sent, acks_sent;
+    struct xfer_stats st;
+};
+
+static const char *progname;
+static ucontext_t sched;
+static struct end ends[2];
+static struct packet *free_packets;
+static long vnow;               /* us */
+
+/* What is being simulated */
+static int blksize = SEGSIZE;
+static int windowsize;
+static int timeout = TIMEOUT;
+static unsigned long filesize = 1024 * 1024;
+static double loss, duplicate, reorder;
+static long delay, jitter, hold = -1, rate;    /* us, bytes/s */
+
+static char *src, *dst;
+
+/* -W: buffers for the writer, and the file it writes */
+static char *wbufs[MAX_WBUFS];
+static int nwbufs, nfree;
+static FILE *wfile;
+static unsigned long long rng_state = 1;
+
+static double rnd(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+static long sim_now(void)
+{
+    return vnow / 1000;
+}
+
+static long sim_now_us(void)
+{
+    return vnow;
+}
+
+static void deliver(struct end *to, const void *pkt, size_t len, long due)
+{
+    struct packet *p, **pp;
+
+    p = free_packets;
+    if (p)
+        free_packets = p->next;
+    else
+        p = xmalloc(sizeof *p);
+    memcpy(p->data, pkt, len);
+    p->len = len;
+    p->due = due;
+
+    /* After everything due at the same time, to keep the order sent */
+    for (pp = &to->inbox; *pp && (*pp)->due <= due; pp = &(*pp)->next)
+        ;
+    p->next = *pp;
+    *pp = p;
+}
+
+static ssize_t sim_send(int sockfd, const union sock_addr *to,
+                        const void *pkt, size_t len)
+{
+    struct end *from = &ends[sockfd], *peer = &ends[!sockfd];
+    const struct tftphdr *tp = pkt;
+    long due = vnow;
+    int copies = 1;
+
+    (void)to;
+
+    if (len >= 2 && ntohs(tp->th_opcode) == DATA)
+        from->data_sent++;
+    else
+        from->acks_sent++;
+
+    if (rate) {
+        if (from->busy_until > due)
+            due = from->busy_until;
+        due += (long)(len * 1000000.0 / rate);
+        from->busy_until = due;
+    }
+
+    if (loss > 0 && rnd() < loss)
+        return len;
+    if (duplicate > 0 && rnd() < duplicate)
+        copies++;
+
+    while (copies--) {
+        long t = due + delay;
+
+        /* Jitter alone does not let a packet overtake the one before */
+        if (jitter)
+            t += (long)((rnd() * 2 - 1) * jitter);
+        if (t < from->last_due)
+            t = from->last_due;
+        if (t < vnow)
+            t = vnow;
+        from->last_due = t;
+        if (reorder > 0 && rnd() < reorder)
+            t += hold;
+        if (!peer->done)
+            deliver(peer, pkt, len, t);
+    }
+    return len;
+}
+
+static ssize_t sim_recv(int sockfd, union sock_addr *from, void *buf,
+                        size_t len, int wait)
+{
+    struct end *e = &ends[sockfd];
+    long until = vnow + wait * 1000L;
+    struct packet *p;
+
+    if (from)
+        memset(from, 0, sizeof *from);
+
+    for (;;) {
+        p = e->inbox;
+        if (p && p->due <= vnow) {
+            e->inbox = p->next;
+            if (len > p->len)
+                len = p->len;
+            memcpy(buf, p->data, len);
+            p->next = free_packets;
+            free_packets = p;
+            return len;
+        }
+        if (wait <= 0 || vnow >= until)
+            return 0;
+
+        e->waiting = 1;
+        e->wake = until;
+        swapcontext(&e->ctx, &sched);
+        e->waiting = 0;
+    }
+}
+
+static const struct xfer_io sim_io = {
+    sim_now,
+    sim_now_us,
+    sim_send,
+    sim_recv,
+};
+
+/* A writer which writes each buffer out as soon as it is given one */
+static char *sim_get(void)
+{
+    return nfree ? wbufs[--nfree] : NULL;
+}
+
+static int sim_put(char *buf, size_t len, off_t pos)
+{
+    wbufs[nfree++] = buf;
+    return write_at(fileno(wfile), buf, len, pos);
+}
+
+static int sim_sync(void)
+{
+    return 0;
+}
+
+static const struct xfer_writer sim_writer = {
+    sim_get,
+    sim_put,
+    sim_sync,
+};
+
+static void run_sender(void)
+{
+    struct end *e = &ends[0];
+    FILE *fp = fmemopen(src, filesize, "r");
+
+    e->r = fp ? sender(0, NULL, blksize, windowsize, timeout, 0, fp, -1, NULL,
+                       &e->st) : E_FAILED_TO_READ;
+    if (fp)
+        fclose(fp);
+    e->done = 1;
+}
+
+static void run_receiver(void)
+{
+    struct end *e = &ends[1];
+    unsigned long got = 0;
+    FILE *fp;
+
+    if (wfile) {
+        nfree = nwbufs;
+        e->r = ftruncate(fileno(wfile), 0) ? E_FAILED_TO_WRITE :
+            receiver(1, NULL, blksize, windowsize, timeout, wfile, 0, -1,
+                     &got, NULL, &e->st);
+        if (!e->r && pread(fileno(wfile), dst, filesize + 1, 0) !=
+            (ssize_t)filesize)
+            e->r = E_FAILED_TO_WRITE;
+    } else {
+        fp = fmemopen(dst, filesize + 1, "w");
+        e->r = fp ? receiver(1, NULL, blksize, windowsize, timeout, fp, -1,
+                             -1, &got, NULL, &e->st) : E_FAILED_TO_WRITE;
+        if (fp)
+            fclose(fp);
+    }
+    e->st.end = vnow;           /* us: when the file was all there */
+    if (!e->r && (got != filesize || memcmp(src, dst, filesize)))
+        e->r = E_FAILED_TO_WRITE;
+    if (!e->r)
+        dally_wait();           /* For the sender's sake */
+    e->done = 1;
+}
+
+static int runnable(const struct end *e)
+{
+    if (e->done)
+        return 0;
+    if (!e->waiting)
+        return 1;
+    return (e->inbox && e->inbox->due <= vnow) || e->wake <= vnow;
+}
+
+/* One transfer; returns 0, or an E_* code */
+static int simulate(void)
+{
+    struct packet *p;
+    long next;
+    int i, ran;
+
+    vnow = 0;
+    for (i = 0; i < 2; i++) {
+        struct end *e = &ends[i];
+
+        while ((p = e->inbox)) {
+            e->inbox = p->next;
+            p->next = free_packets;
+            free_packets = p;
+        }
+        e->busy_until = e->last_due = 0;
+        e->waiting = e->done = 0;
+        e->data_sent = e->acks_sent = 0;
+        memset(&e->st, 0, sizeof e->st);
+
+        getcontext(&e->ctx);
+        e->ctx.uc_stack.ss_sp = e->stack;
+        e->ctx.uc_stack.ss_size = STACK_SIZE;
+        e->ctx.uc_link = &sched;
+        makecontext(&e->ctx, i ? run_receiver : run_sender, 0);
+    }
+
+    while (!ends[0].done || !ends[1].done) {
+        ran = 0;
+        for (i = 0; i < 2; i++) {
+            if (runnable(&ends[i])) {
+                swapcontext(&sched, &ends[i].ctx);
+                ran = 1;
+            }
+        }
+        if (ran)
+            continue;
+
+        /* Everyone is waiting: on to whatever happens next */
+        next = -1;
+        for (i = 0; i < 2; i++) {
+            struct end *e = &ends[i];
+
+            if (e->done)
+                continue;
+            if (next < 0 || e->wake < next)
+                next = e->wake;
+            if (e->inbox && e->inbox->due < next)
+                next = e->inbox->due;
+        }
+        vnow = next;
+    }
+
+    return ends[0].r ? ends[0].r : ends[1].r;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: %s [-n count] [-f filesize] [-B blksize] [-w windowsize,...]\n"
+            "       [-t timeout_ms] [-l loss%%,...] [-u duplicate%%] [-r reorder%%]\n"
+            "       [-R reorder_hold_ms] [-d delay_ms] [-j jitter_ms] [-b bytes/s]\n"
+            "       [-s seed] [-W write_buffers]\n",
+            progname);
+    exit(EX_USAGE);
+}
+
+static double number(const char *arg, double max)
+{
+    char *end;
+    double v = strtod(arg, &end);
+
+    if (*end == 'k' || *end == 'K')
+        v *= 1024, end++;
+    else if (*end == 'm' || *end == 'M')
+        v *= 1024 * 1024, end++;
+    if (*end || v < 0 || v > max)
+        usage();
+    return v;
+}
+
+static int list(char *arg, double max, double *out)
+{
+    char *p;
+    int n = 0;
+
+    for (p = strtok(arg, ","); p; p = strtok(NULL, ",")) {
+        if (n == MAX_LIST)
+            usage();
+        out[n++] = number(p, max);
+    }
+    if (!n)
+        usage();
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    double windows[MAX_LIST] = { 1 }, losses[MAX_LIST] = { 0 };
+    int nwindows = 1, nlosses = 1, count = 1000;
+    unsigned long long seed = 1;
+    unsigned long i, failed, blocks, data, acks, timeouts, total = 0;
+    long *times, wall;
+    double sum;
+    char goodput[32], *end;
+    int wi, li, c;
+
+    progname = argv[0];
+
+    while ((c = getopt(argc, argv, "n:f:B:w:t:l:u:r:R:d:j:b:s:W:")) != -1) {
+        switch (c) {
+        case 'n':
+            count = number(optarg, 1e9);
+            if (count < 1)
+                usage();
+            break;
+        case 'f':
+            filesize = number(optarg, 1 << 30);
+            break;
+        case 'B':
+            blksize = number(optarg, MAX_SEGSIZE);
+            if (blksize < 8)
+                usage();
+            break;
+        case 'w':
+            nwindows = list(optarg, 65535, windows);
+            break;
+        case 't':
+            timeout = number(optarg, 255000);
+            if (timeout < 1)
+                usage();
+            break;
+        case 'l':
+            nlosses = list(optarg, 100, losses);
+            break;
+        case 'u':
+            duplicate = number(optarg, 100) / 100;
+            break;
+        case 'r':
+            reorder = number(optarg, 100) / 100;
+            break;
+        case 'R':
+            hold = number(optarg, 1e6) * 1000;
+            break;
+        case 'd':
+            delay = number(optarg, 1e6) * 1000;
+            break;
+        case 'j':
+            jitter = number(optarg, 1e6) * 1000;
+            break;
+        case 'b':
+            rate = number(optarg, 1e12);
+            break;
+        case 's':
+            seed = strtoull(optarg, &end, 10);
+            if (*end)
+                usage();
+            break;
+        case 'W':
+            nwbufs = number(optarg, MAX_WBUFS);
+            if (nwbufs < 1)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc)
+        usage();
+    if (hold < 0)
+        hold = delay > 1000 ? delay : 1000;
+    if (jitter > delay)
+        jitter = delay;
+
+    src = xmalloc(filesize + 1);
+    dst = xmalloc(filesize + 1);
+    for (i = 0; i < filesize; i++)
+        src[i] = (char)(i * 2654435761UL >> 13);
+    for (i = 0; i < 2; i++)
+        ends[i].stack = xmalloc(STACK_SIZE);
+    if (nwbufs) {
+        wfile = tmpfile();
+        if (!wfile) {
+            perror(progname);
+            return EX_CANTCREAT;
+        }
+        for (c = 0; c < nwbufs; c++)
+            wbufs[c] = xmalloc(XFER_WBUF_SIZE);
+        xfer_writer = &sim_writer;
+    }
+    times = xmalloc(count * sizeof *times);
+    blocks = filesize / blksize + 1;
+
+    xfer_io = &sim_io;
+
+    printf("%d transfers each of %lu bytes, blksize %d, timeout %d ms\n"
+           "delay %.1f ms, jitter %.1f ms, %.1f%% duplicated, "
+           "%.1f%% reordered by %.1f ms, ",
+           count, filesize, blksize, timeout, delay / 1000.0,
+           jitter / 1000.0, duplicate * 100, reorder * 100, hold / 1000.0);
+    if (rate)
+        printf("%ld bytes/s\n\n", rate);
+    else
+        printf("no bandwidth limit\n\n");
+    printf("%6s %6s %6s %12s %7s %7s %8s %10s %10s %10s\n",
+           "WIN", "LOSS%", "FAILED", "GOODPUT/s", "RETX%", "ACKS%",
+           "TIMEOUTS", "P50", "P99", "MAX");
+
+    wall = xfer_now_us();
+    for (wi = 0; wi < nwindows; wi++) {
+        for (li = 0; li < nlosses; li++) {
+            windowsize = windows[wi];
+            loss = losses[li] / 100;
+            rng_state = seed ? seed : 1;
+
+            failed = data = acks = timeouts = 0;
+            sum = 0;
+            for (i = 0; i < (unsigned long)count; i++) {
+                if (simulate())
+                    failed++;
+                times[i] = ends[1].st.end;
+                sum += times[i];
+                data += ends[0].data_sent;
+                acks += ends[1].acks_sent;
+                timeouts += ends[0].st.timeouts + ends[1].st.timeouts;
+            }
+            total += count;
+            qsort(times, count, sizeof *times, cmp_long);
+
+            /* No delay and no bandwidth limit take no time at all */
+            if (sum)
+                snprintf(goodput, sizeof goodput, "%.2fMB",
+                         (double)filesize * count / sum);
+            else
+                strcpy(goodput, "-");
+
+            printf("%6d %6.2f %6lu %12s %6.1f%% %6.1f%% %8lu "
+                   "%8.1fms %8.1fms %8.1fms\n",
+                   windowsize, loss * 100, failed, goodput,
+                   (double)(data - blocks * count) * 100 / (blocks * count),
+                   (double)acks * 100 / (blocks * count), timeouts,
+                   times[count / 2] / 1000.0,
+                   times[(count * 99) / 100 < count ? (count * 99) / 100 :
+                         count - 1] / 1000.0,
+                   times[count - 1] / 1000.0);
+            fflush(stdout);
+        }
+    }
+    wall = xfer_now_us() - wall;
+
+    printf("\n%lu transfers simulated in %.3f s, %.0f/s\n", total,
+           wall / 1e6, wall ? total * 1e6 / wall : 0.0);
+    return 0;
+}
+
+#else
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+    fprintf(stderr, "%s: needs ucontext.h and fmemopen()\n", argv[0]);
+    return EX_UNAVAILABLE;
+}
+
+#endif
@@ -32,15 +32,69 @@
  */
 
 #include "common.h"
+#include "xfer.h"
+#include "tftpsubs.h"
 
 #include <poll.h>
 #include <stdarg.h>
 #include <syslog.h>
 
-static char *pktbuf;
 static int verbose;
 
-const int SYNC_TIMEOUT = 50; /* ms */
+struct xfer_live *xfer_live;
+
+int sparse_writes;
+
+static ssize_t socket_send(int sockfd, const union sock_addr *to,
+                           const void *pkt, size_t len)
+{
+    if (to)
+        return sendto(sockfd, pkt, len, 0, &to->sa, SOCKLEN(to));
+    return send(sockfd, pkt, len, 0);
+}
+
+static ssize_t socket_recv(int sockfd, union sock_addr *from, void *buf,
+                           size_t len, int timeout)
+{
+    socklen_t fromlen = sizeof(*from);
+    struct pollfd pfd;
+    ssize_t r;
+
+#ifdef MSG_DONTWAIT
+    if (!timeout) {
+        if (from)
+            r = recvfrom(sockfd, buf, len, MSG_DONTWAIT, &from->sa, &fromlen);
+        else
+            r = recv(sockfd, buf, len, MSG_DONTWAIT);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            r = 0;
+        return r;
+    }
+#endif
+
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    r = poll(&pfd, 1, timeout);
+    if (r <= 0)
+        return r;
+
+    if (from)
+        return recvfrom(sockfd, buf, len, 0, &from->sa, &fromlen);
+    return recv(sockfd, buf, len, 0);
+}
+
+static const struct xfer_io socket_io = {
+    xfer_now,
+    xfer_now_us,
+    socket_send,
+    socket_recv,
+};
+
+const struct xfer_io *xfer_io = &socket_io;
+
+#define DRAIN_MAX 256           /* Packets taken in one go */
 
 void die(const char *fmt, ...)
 {
@@ -73,26 +127,91 @@ void die_on_error(struct tftphdr *tp)
 }
 
 void send_error(int sockfd, union sock_addr *to, const char *msg)
+{
+    send_error_code(sockfd, to, EUNDEF, msg);
+}
+
+void send_error_code(int sockfd, union sock_addr *to, int code,
+                     const char *msg)
 {
     char buf[516];
     struct tftphdr *out = (struct tftphdr *)buf;
     int len;
 
+    memset(buf, 0, 516);
     out->th_opcode = htons(ERROR);
-    out->th_code = htons(EUNDEF);
+    out->th_code = htons(code);
 
     len = strlen(msg) + 1;
-    memset(buf, 0, 516);
     memcpy(out->th_msg, msg, len > 511 ? 511 : len);
     len += 4;
 
-    if (to) {
-        if (sendto(sockfd, out, len, 0, &to->sa, SOCKLEN(to)) != len)
-            die("send_error: sendto: %s", strerror(errno));
-    } else {
-        if (send(sockfd, out, len, 0) != len)
-            die("send_error: send: %s", strerror(errno));
+    if (xfer_io->send(sockfd, to, out, len) != len)
+        die("send_error: send: %s", strerror(errno));
+}
+
+/* One NUL-terminated string into a request, if it fits */
+static char *put_string(char *p, const char *end, const char *s)
+{
+    size_t len = strlen(s) + 1;
+
+    if (!p || len > (size_t)(end - p))
+        return NULL;
+    memcpy(p, s, len);
+    return p + len;
+}
+
+size_t make_request(unsigned short opcode,
+                    const char *name,
+                    const char *mode,
+                    size_t blocksize,
+                    int windowsize,
+                    size_t tsize,
+                    off_t offset,
+                    off_t length,
+                    struct tftphdr *out,
+                    size_t size)
+{
+    char *cp = (char *)&(out->th_stuff);
+    char *end = (char *)out + size;
+    char buf[24];
+
+    out->th_opcode = htons(opcode);
+
+    cp = put_string(cp, end, name);
+    cp = put_string(cp, end, mode);
+
+    /* Don't include options with default values. */
+
+    if (blocksize != SEGSIZE) {
+        snprintf(buf, sizeof(buf), "%zu", blocksize);
+        cp = put_string(cp, end, "blksize");
+        cp = put_string(cp, end, buf);
+    }
+
+    if (windowsize > 0) {
+        snprintf(buf, sizeof(buf), "%d", windowsize);
+        cp = put_string(cp, end, "windowsize");
+        cp = put_string(cp, end, buf);
+    }
+
+    snprintf(buf, sizeof(buf), "%zu", tsize);
+    cp = put_string(cp, end, "tsize");
+    cp = put_string(cp, end, buf);
+
+    /* Part of the file only, to resume or to stripe a download */
+    if (offset >= 0) {
+        snprintf(buf, sizeof(buf), "%" PRIdMAX, (intmax_t)offset);
+        cp = put_string(cp, end, "offset");
+        cp = put_string(cp, end, buf);
     }
+    if (length > 0) {
+        snprintf(buf, sizeof(buf), "%" PRIdMAX, (intmax_t)length);
+        cp = put_string(cp, end, "length");
+        cp = put_string(cp, end, buf);
+    }
+
+    return cp ? (size_t)(cp - (char *)out) : 0;
 }
 
 static void _send_ack(int sockfd, union sock_addr *to, unsigned short block, int check_errors)
@@ -101,13 +220,8 @@ static void _send_ack(int sockfd, union sock_addr *to, unsigned short block, int
     out.th_opcode = htons(ACK);
     out.th_block  = htons(block);
 
-    if (to) {
-        if (sendto(sockfd, &out, 4, 0, &to->sa, SOCKLEN(to)) != 4 && check_errors)
-            die("send_ack: sendto: %s", strerror(errno));
-    } else {
-        if (send(sockfd, &out, 4, 0) != 4 && check_errors)
-            die("send_ack: send: %s", strerror(errno));
-    }
+    if (xfer_io->send(sockfd, to, &out, 4) != 4 && check_errors)
+        die("send_ack: send: %s", strerror(errno));
 }
 
 void send_ack(int sockfd, union sock_addr *to, unsigned short block)
@@ -116,64 +230,133 @@ void send_ack(int sockfd, union sock_addr *to, unsigned short block)
 }
 
 
-static size_t read_data(FILE *fp,
-                        size_t blocksize,
-                        unsigned short block,
-                        int seek,
-                        struct tftphdr *out)
+int preallocate(int fd, off_t offset, off_t length)
 {
-    out->th_opcode = htons(DATA);
-    out->th_block  = htons(block);
-    if (seek)
-        (void) fseek(fp, seek, SEEK_CUR);
-    return fread(pktbuf + 4, 1, blocksize, fp);
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+    /* Keeping the size, a file cut short is no longer than what came.
+       A sparse file may need much less than its length, and space
+       reserved past the end cannot be punched out again. */
+    if (length > 0 && !sparse_writes && fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length) &&
+        errno == ENOSPC)
+        return -1;
+#else
+    (void)fd;
+    (void)offset;
+    (void)length;
+#endif
+    return 0;
 }
 
-static size_t write_data(FILE *fp, char *buf, size_t count, int convert)
+/*
+ * Whether len bytes are all zero.  Words eight at a time in between,
+ * which the compiler turns into vector instructions where it can.
+ */
+static int all_zero(const char *buf, size_t len)
 {
-    char wbuf[count];
-    size_t i = 0, cnt = 0;
-    static int was_cr = 0;
+    const unsigned char *p = (const unsigned char *)buf;
+    const unsigned long *w;
+
+    for (; len && ((uintptr_t)p % sizeof *w); len--)
+        if (*p++)
+            return 0;
+
+    for (w = (const unsigned long *)p; len >= 8 * sizeof *w;
+         len -= 8 * sizeof *w, w += 8)
+        if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7])
+            return 0;
+
+    for (p = (const unsigned char *)w; len; len--)
+        if (*p++)
+            return 0;
+    return 1;
+}
 
-    /* TODO: jsynacek: I don't think any conversion should take place...
-     * RFC 1350 says: "A host which receives netascii mode data must translate
-     * the data to its own format."
-     * That basically means nothing. What does "own format" even mean?
-     * The original implementation translated \r\n to \n and skipped \0 bytes,
-     * which aren't even legal in the netascii format.
-     * However, I believe that the file should remain as is before and after
-     * the transfer.
-     */
-    convert = 0;
+static int write_all(int fd, const char *buf, size_t len, off_t pos)
+{
+    ssize_t n;
 
-    if (convert == 0)
-        return fwrite(buf, 1, count, fp);
+    while (len) {
+        n = pwrite(fd, buf, len, pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = EIO;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        pos += n;
+    }
+    return 0;
+}
 
-    /* Working conversion. Leave it as dead code for now. */
-    if (was_cr && buf[0] == '\n') {
-        wbuf[cnt++] = '\n';
-        i = 1;
-        (void) fseek(fp, -1, SEEK_CUR);
+/* Make len bytes at pos read as zeros without writing them, if we can */
+static int make_hole(int fd, off_t pos, off_t len, off_t *eof)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    static int no_punch;
+
+    if (!no_punch) {
+        if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                       pos, len))
+            return 0;
+        if (errno == EOPNOTSUPP || errno == ENOSYS)
+            no_punch = 1;
     }
+#else
+    (void)len;
+#endif
+    /* Past the end of the file, there is nothing to punch out */
+    if (*eof < 0)
+        *eof = lseek(fd, 0, SEEK_END);
+    return *eof >= 0 && pos >= *eof ? 0 : -1;
+}
 
-    while(i < count) {
-        if (buf[i] == '\r' && buf[i + 1] == '\n') {
-            wbuf[cnt++] = '\n';
-            ++i;
-        } else if (buf[i] == '\0') {
-            /* Skip it */
-        } else {
-            wbuf[cnt++] = buf[i];
+/* Zeros in buf, written out if the hole could not be made */
+static int put_run(int fd, const char *buf, size_t len, off_t pos, int zero,
+                   off_t *eof)
+{
+    if (zero && !make_hole(fd, pos, len, eof))
+        return 0;
+    return write_all(fd, buf, len, pos);
+}
+
+int write_at(int fd, const char *buf, size_t len, off_t pos)
+{
+    size_t start, end, next;
+    off_t eof = -1;
+    int zero, run_zero = 0;
+
+    if (!sparse_writes)
+        return write_all(fd, buf, len, pos);
+
+    /* Runs of whole SPARSE_BLOCKs of zeros, and of anything else */
+    for (start = end = 0; end < len; end = next) {
+        next = end + SPARSE_BLOCK - (pos + end) % SPARSE_BLOCK;
+        if (next > len)
+            next = len;
+        zero = next - end == SPARSE_BLOCK && all_zero(buf + end, SPARSE_BLOCK);
+        if (end > start && zero != run_zero) {
+            if (put_run(fd, buf + start, end - start, pos + start, run_zero,
+                        &eof))
+                return -1;
+            start = end;
         }
-        ++i;
+        run_zero = zero;
     }
-    /* Preserve state between data chunks */
-    was_cr = buf[i - 1] == '\r';
+    return put_run(fd, buf + start, len - start, pos + start, run_zero, &eof);
+}
 
-    if (fwrite(wbuf, 1, cnt, fp) == 0)
-        return 0;
+int extend_to(int fd, off_t end)
+{
+    struct stat st;
 
-    return count;
+    if (fstat(fd, &st))
+        return -1;
+    if (st.st_size < end && ftruncate(fd, end))
+        return -1;
+    return 0;
 }
 
 void set_verbose(int v)
@@ -202,7 +385,7 @@ int recvfrom_flags_with_timeout(int s,
                                 int timeout,
                                 int flags)
 {
-    socklen_t fromlen = sizeof(from);
+    socklen_t fromlen = sizeof(*from);
     struct pollfd pfd;
     int r;
 
@@ -226,97 +409,268 @@ int recvfrom_flags_with_timeout(int s,
     return r;
 }
 
-int receiver(int sockfd,
-             union sock_addr *server,
-             size_t blocksize,
-             int windowsize,
-             int timeout,
-             FILE *fp,
-             unsigned long *received,
-             char *error)
-{
-    struct tftphdr *tp;
-    unsigned short tp_opcode, tp_block;
-    unsigned short block = 1;
-    unsigned long amount = 0;
-    int pktsize = blocksize + 4;
-    int window = 1;
-    size_t size;
-    int retries;
+/*
+ * The final ACK of the last transfer received, which we repeat if the
+ * sender repeats its last block.
+ */
+static struct {
+    int active;
+    int sockfd;
+    int connected;
+    union sock_addr peer;
+    unsigned short block;
+    long until;
+} dally;
+
+/*
+ * Answer a repeated final DATA block with the final ACK.  Waits for up
+ * to "wait" ms for a packet; returns 0 once there is nothing more to
+ * wait for.
+ */
+static int dally_once(long wait)
+{
+    char buf[SEGSIZE + 4];      /* Only the header matters */
+    struct tftphdr *tp = (struct tftphdr *)buf;
+    union sock_addr from;
+    ssize_t n;
+
+    /* The peer may well be gone already; that is not an error here */
+    memset(&from, 0, sizeof(from));
+    n = xfer_io->recv(dally.sockfd, &from, buf, sizeof(buf), wait);
+    if (n <= 0)
+        return n < 0 && errno == EINTR;
+
+    if (!dally.connected &&
+        (from.sa.sa_family != dally.peer.sa.sa_family ||
+         SOCKPORT(&from) != SOCKPORT(&dally.peer)))
+        return 1;               /* Someone else */
+
+    if (n >= 4 && ntohs(tp->th_opcode) == DATA &&
+        ntohs(tp->th_block) == dally.block)
+        _send_ack(dally.sockfd, dally.connected ? NULL : &dally.peer,
+                  dally.block, 0);
+    return 1;
+}
+
+/*
+ * Stay around until the dally period of the last receiver() is over.
+ * For a process which is about to go away anyway.
+ */
+void dally_wait(void)
+{
+    long left;
+
+    while (dally.active && (left = dally.until - xfer_io->now()) > 0)
+        if (!dally_once(left))
+            break;
+    dally.active = 0;
+}
+
+/*
+ * Answer whatever has already arrived for the last receiver() and end
+ * the dally, without waiting.  For a process about to reuse the socket.
+ */
+void dally_poll(void)
+{
+    while (dally.active && dally.until - xfer_io->now() > 0)
+        if (!dally_once(0))
+            break;
+    dally.active = 0;
+}
+
+/*
+ * Keep up the dally while waiting for fd to be readable, for a process
+ * which would otherwise leave it until its next transfer.  Returns once
+ * there is input, leaving whatever is left of the dally to dally_poll()
+ * or dally_wait(), or once the dally is over.
+ */
+void dally_until_input(int fd)
+{
+    struct pollfd pfd[2];
+    long left;
+    int n;
+
+    while (dally.active && (left = dally.until - xfer_io->now()) > 0) {
+        pfd[0].fd = fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = dally.sockfd;
+        pfd[1].events = POLLIN;
+        n = poll(pfd, 2, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || pfd[0].revents)
+            return;
+        if (n > 0 && !dally_once(0))
+            break;
+    }
+    dally.active = 0;
+}
+
+int dally_pending(void)
+{
+    return dally.active && dally.until - xfer_io->now() > 0;
+}
+
+/*
+ * Feed the engine the packet just received and whatever else is already
+ * queued, before anything is sent in reply.  If the peer got out of step
+ * and a burst of stale ACKs or DATA is waiting, the engine sees all of it
+ * at once and answers the newest state, instead of once per packet.
+ */
+static void drain(int sockfd, union sock_addr *peer, struct tftp_xfer *x,
+                  int n)
+{
+    size_t pktsize = x->blocksize + 4;
+    int count = 0;
+
+    for (;;) {
+        xfer_feed(x, x->rxbuf, n, xfer_io->now());
+        if (xfer_finished(x) || ++count >= DRAIN_MAX)
+            break;
+        n = xfer_io->recv(sockfd, peer, x->rxbuf, pktsize, 0);
+        if (n <= 0)
+            break;
+    }
+}
+
+static void get_stats(const struct tftp_xfer *x, struct xfer_stats *stats)
+{
+    if (!stats)
+        return;
+    *stats = x->st;
+    stats->bytes = x->amount;
+    stats->blocks = x->base - 1;
+}
+
+/*
+ * Run a transfer to completion, blocking on the socket in between.
+ * Under a rate limit, nothing more is sent (DATA by a sender, ACKs by
+ * a receiver) until the bytes moved so far are due.
+ */
+static int run_xfer(int sockfd, union sock_addr *peer, struct tftp_xfer *x)
+{
+    struct xfer_live *live = xfer_live;
+    size_t pktsize = x->blocksize + 4;
+    char *rbuf = x->rxbuf;
+    const void *pkt;
+    size_t len;
+    unsigned long rate = 0, rate_base = 0;
+    long now, wait, due, rate_start = 0;
     int n, r = 0;
 
-    pktbuf = calloc(pktsize, 1);
-    if (!pktbuf)
-        die("Out of memory!");
-    tp = (struct tftphdr *)pktbuf;
-
-    retries = RETRIES;
-    do {
-        n = recvfrom_with_timeout(sockfd, tp, pktsize, server, timeout);
-        if (n == 0) {
-            if (--retries <= 0) {
-                r = E_TIMED_OUT;
-                snprintf(error, ERROR_MAXLEN, "Timeout");
-                goto abort;
+    for (;;) {
+        now = xfer_io->now();
+        if (live) {
+            if (live->cancel)
+                xfer_cancel(x, "Transfer cancelled");
+            if (live->rate != rate) {
+                rate = live->rate;
+                rate_start = now;
+                rate_base = x->amount;
             }
-            continue;
         }
-        retries = RETRIES;
-
-        tp_opcode = ntohs(tp->th_opcode);
-        tp_block  = ntohs(tp->th_block);
-
-        if (tp_opcode == DATA) {
-            if (tp_block == block) {
-                size = write_data(fp, tp->th_data, n - 4, 0);
-                if (size == 0 && ferror(fp)) {
-                    send_error(sockfd, server, "Failed to write data");
-                    r = E_FAILED_TO_WRITE;
-                    snprintf(error, ERROR_MAXLEN, "Failed to write data");
-                    goto abort;
-                }
-                amount += size;
 
-                if (window++ >= windowsize || size != blocksize) {
-                    send_ack(sockfd, server, block);
-                    window = 1;
-                }
+        due = now;
+        if (rate && !xfer_finished(x))
+            due = rate_start + (long)((x->amount - rate_base) * 1000 / rate);
 
-                ++block;
-            } else {
-                do {
-                    n = recvfrom_with_timeout(sockfd, pktbuf, pktsize, server, SYNC_TIMEOUT);
-                } while (n > 0);
-                if (windowsize > 0) {
-                    send_ack(sockfd, server, block - 1);
+        if (due - now > 0) {
+            /* Holding back is not the peer's fault */
+            xfer_defer(x, due);
+            wait = due - now;
+        } else {
+            wait = xfer_poll(x, now);
+            while ((len = xfer_produce(x, &pkt)) > 0) {
+                n = xfer_io->send(sockfd, peer, pkt, len);
+                if (n != (int)len) {
+                    syslog(LOG_WARNING, "tftpd: send: %m");
+                    snprintf(x->errmsg, sizeof x->errmsg, "send: %s",
+                             strerror(errno));
+                    r = E_SYSTEM_ERROR;
+                    goto out;
                 }
-                window = 1;
-                n = 0;
+                if (!x->st.sent_us)
+                    x->st.sent_us = xfer_io->now_us();
             }
-        } else if (tp_opcode == ERROR) {
-            format_error(tp, error);
-            r = E_RECEIVED_ERROR;
-            goto abort;
-        } else {
-            snprintf(error, ERROR_MAXLEN, "Unexpeted packet");
-            r = E_UNEXPECTED_PACKET;
-            goto abort;
         }
-    } while (size == blocksize || n == 0);
 
-    /* Last ack can get lost, let's try and resend it twice
-     * to make it more likely that the ack gets to the sender.
-     */
-    --block;
-    for (n = 0; n < 2; ++n) {
-        usleep(SYNC_TIMEOUT * 1000);
-        _send_ack(sockfd, server, block, 0);
+        if (xfer_finished(x))
+            break;
+
+        n = xfer_io->recv(sockfd, peer, rbuf, pktsize, wait);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_WARNING, "tftpd: recv: %m");
+            snprintf(x->errmsg, sizeof x->errmsg, "recv: %s",
+                     strerror(errno));
+            r = E_SYSTEM_ERROR;
+            goto out;
+        }
+        if (n > 0)
+            drain(sockfd, peer, x, n);
+        if (live)
+            get_stats(x, &live->st);
     }
 
+    if (x->state == XFER_FAILED)
+        r = x->error;
+out:
+    x->st.end = xfer_io->now();
+    if (live)
+        get_stats(x, &live->st);
+    return r;
+}
+
+int receiver(int sockfd,
+             union sock_addr *server,
+             size_t blocksize,
+             int windowsize,
+             int timeout,
+             FILE *fp,
+             off_t offset,
+             off_t length,
+             unsigned long *received,
+             char *error,
+             struct xfer_stats *stats)
+{
+    struct tftp_xfer x;
+    int r;
+
+    if (xfer_init(&x, XFER_RECV, fp, blocksize, windowsize, timeout, 0,
+                  xfer_io->now())) {
+        send_error(sockfd, server, "Out of memory");
+        if (error)
+            snprintf(error, ERROR_MAXLEN, "Out of memory");
+        return E_NO_MEMORY;
+    }
+    x.wpos = offset;
+    x.limit = length;
+
+    dally.active = 0;
+    r = run_xfer(sockfd, server, &x);
+    get_stats(&x, stats);
+    if (r) {
+        if (error)
+            snprintf(error, ERROR_MAXLEN, "%s", x.errmsg);
+        goto abort;
+    }
+
+    /* The last ack can get lost; leave it to dally_wait() or
+     * dally_poll() to repeat it, so the caller has the file now.
+     */
+    dally.active = 1;
+    dally.sockfd = sockfd;
+    dally.connected = !server;
+    if (server)
+        dally.peer = *server;
+    dally.block = xfer_block(&x, x.base - 1);
+    dally.until = x.dally_until;
+
     if (received)
-        *received = amount;
+        *received = x.amount;
 abort:
-    free(pktbuf);
+    xfer_free(&x);
     return r;
 }
 
@@ -327,111 +681,25 @@ int sender(int sockfd,
            int timeout,
            int rollover,
            FILE *fp,
-           unsigned long *sent)
-{
-    struct tftphdr *tp;
-    unsigned short tp_opcode, tp_block;
-    unsigned short block = 1;
-    unsigned long amount = 0;
-    int l_timeout = timeout;
-    int pktsize = blocksize + 4;
-    int window = 1;
-    int seek = 0;
-    int retries;
-    size_t size;
-    size_t done = 0;
-    int n, r = 0;
-
-    pktbuf = calloc(pktsize, 1);
-    if (!pktbuf)
-        die("Out of memory!");
-    tp = (struct tftphdr *)pktbuf;
-
-    retries = RETRIES;
-    do {
-        size = read_data(fp, blocksize, block, seek, tp);
-        if (size == 0 && ferror(fp)) {
-            send_error(sockfd, server, "Error while reading the file");
-            r = E_FAILED_TO_READ;
-            goto abort;
-        }
-        amount += size;
-        seek = 0;
-
-        if (server)
-            n = sendto(sockfd, tp, size + 4, 0, &server->sa, SOCKLEN(server));
-        else
-            n = send(sockfd, tp, size + 4, 0);
-        if (n != (int)(size + 4)) {
-            syslog(LOG_WARNING, "tftpd: send: %m");
-            r = E_SYSTEM_ERROR;
-            goto abort;
-        }
-
-        if (window++ < windowsize) {
-            /* Even if the entire window is not sent, the server should check for incoming packets
-             * and react to out of order ACKs, or ERRORs.
-             */
-            l_timeout = 0;
-        } else {
-            l_timeout = timeout;
-            window = 1;
-        }
-        done = size != blocksize;
-        if (done) {
-            l_timeout = timeout;
-            window = 1;
-        }
+           off_t length,
+           unsigned long *sent,
+           struct xfer_stats *stats)
+{
+    struct tftp_xfer x;
+    int r;
 
-        n = recvfrom_with_timeout(sockfd, pktbuf, pktsize, server, l_timeout);
-        if (n < 0) {
-            syslog(LOG_WARNING, "tftpd: recv: %m");
-            r = E_SYSTEM_ERROR;
-            goto abort;
-        } else if (l_timeout > 0 && n == 0) {
-            seek = -size;
-            if (--retries <= 0) {
-                r = E_TIMED_OUT;
-                goto abort;
-            }
-            done = 0;
-            continue;
-        }
+    if (xfer_init(&x, XFER_SEND, fp, blocksize, windowsize, timeout,
+                  rollover, xfer_io->now())) {
+        send_error(sockfd, server, "Out of memory");
+        return E_NO_MEMORY;
+    }
+    x.limit = length;
 
-        if (++block == 0)
-            block = rollover;
-
-        tp_opcode = ntohs(tp->th_opcode);
-        tp_block  = ntohs(tp->th_block);
-
-        if (tp_opcode == ACK) {
-            if (tp_block != (unsigned short)(block - 1)) {
-                int offset = tp_block;
-
-                done = 0;
-                do {
-                    n = recvfrom_with_timeout(sockfd, pktbuf, pktsize, server, SYNC_TIMEOUT);
-                } while (n > 0);
-                /* This is a bit of a hack. Mismatched packets that are "over the edge" of the unsigned short
-                 * have to be handled and a correct seek has to be issued. In theory, overflowing block number
-                 * should not even be supported, as it is impossible to distinguish correctly if more than 2^16
-                 * packets are sent, but the first ones are received later than the last ones.
-                 */
-                if (tp_block > 65000 && tp_block > (unsigned short)(block - 1))
-                    offset -= 65535;
-                seek = (offset - block + 2) * blocksize - size;
-            }
-            block = tp_block + 1;
-            retries = RETRIES;
-        } else if (tp_opcode == ERROR) {
-            r = E_RECEIVED_ERROR;
-            goto abort;
-        }
-    } while (!done);
+    r = run_xfer(sockfd, server, &x);
+    get_stats(&x, stats);
+    if (!r && sent)
+        *sent = x.amount;
 
-    if (sent)
-        *sent = amount;
-abort:
-    free(pktbuf);
+    xfer_free(&x);
     return r;
 }
@@ -47,6 +47,8 @@
 #define E_FAILED_TO_READ -4
 #define E_FAILED_TO_WRITE -5
 #define E_SYSTEM_ERROR -6
+#define E_NO_MEMORY -7
+#define E_CANCELLED -8
 #define ERROR_MAXLEN 511
 
 union sock_addr {
@@ -69,7 +71,36 @@ void set_verbose(int v);
 int format_error(struct tftphdr *tp, char *error);
 void die(const char *fmt, ...);
 void die_on_error(struct tftphdr *tp);
+/* An RRQ or WRQ with our options, in at most size bytes; returns its
+   length, or 0 if it does not fit.  The offset is left out if it is
+   negative, and the length if it is 0. */
+size_t make_request(unsigned short opcode,
+                    const char *name,
+                    const char *mode,
+                    size_t blocksize,
+                    int windowsize,
+                    size_t tsize,
+                    off_t offset,
+                    off_t length,
+                    struct tftphdr *out,
+                    size_t size);
+/* Reserve disk space for length bytes of fd from offset on, without
+   changing its size, where the system can and sparse_writes is not
+   set.  Returns 0, or -1 with errno ENOSPC if there is no room;
+   anything else is not an error. */
+int preallocate(int fd, off_t offset, off_t length);
+/* With sparse_writes set, write_at() leaves holes for the blocks of
+   SPARSE_BLOCK zeros it is given, instead of writing them */
+#define SPARSE_BLOCK    4096
+extern int sparse_writes;
+/* pwrite() all of buf at pos.  Returns 0, or -1 with errno set. */
+int write_at(int fd, const char *buf, size_t len, off_t pos);
+/* Make fd at least end bytes long, for a file which ended in a hole.
+   Returns 0, or -1 with errno set. */
+int extend_to(int fd, off_t end);
 void send_error(int sockfd, union sock_addr *to, const char *msg);
+void send_error_code(int sockfd, union sock_addr *to, int code,
+                     const char *msg);
 void send_ack(int sockfd, union sock_addr *to, unsigned short block);
 int recv_with_timeout(int s, void *in, size_t len, int timeout);
 int recvfrom_with_timeout(int s, void *in, size_t len, union sock_addr *from, int timeout);
@@ -79,15 +110,77 @@ int recvfrom_flags_with_timeout(int s,
                                 union sock_addr *from,
                                 int timeout,
                                 int flags);
+/* What happened during a transfer run by sender() or receiver() */
+struct xfer_stats {
+    unsigned long bytes;        /* Acknowledged or written */
+    unsigned long blocks;
+    unsigned long retransmits;  /* DATA sent again, or ACKs repeated */
+    unsigned long out_of_order; /* Duplicate ACKs, or DATA out of sequence */
+    unsigned long timeouts;
+    long start;                 /* xfer_now() times: transfer started, */
+    long first;                 /* first DATA sent or received, */
+    long end;                   /* and transfer over */
+    long sent_us;               /* xfer_now_us() of the first packet sent */
+};
+
+/*
+ * A transfer as seen from outside while it runs, for a server which
+ * lets an operator watch and steer it.  Read and written without
+ * locking; the fields are only ever replaced whole.
+ */
+struct xfer_live {
+    struct xfer_stats st;       /* Kept up to date during the transfer */
+    int cancel;                 /* Set to abort, with an error to the peer */
+    unsigned long rate;         /* Bytes per second, or 0 for no limit */
+};
+
+/* If set, sender() and receiver() report to it and obey it */
+extern struct xfer_live *xfer_live;
+
+/*
+ * The clock and the network as sender(), receiver() and the dally see
+ * them.  Normally the system clock and the socket they are given; a
+ * simulation can put its own in their place.
+ */
+struct xfer_io {
+    long (*now)(void);          /* ms, as xfer_now() */
+    long (*now_us)(void);       /* us, as xfer_now_us() */
+    /* One packet, to "to" or on a connected socket if that is NULL.
+       Returns the length sent, or -1 with errno set. */
+    ssize_t (*send)(int sockfd, const union sock_addr *to,
+                    const void *pkt, size_t len);
+    /* One packet, waiting up to timeout ms for it (0: not at all), and
+       where it came from if "from" is not NULL.  Returns its length, 0
+       if none came, or -1 with errno set. */
+    ssize_t (*recv)(int sockfd, union sock_addr *from, void *buf,
+                    size_t len, int timeout);
+};
+
+extern const struct xfer_io *xfer_io;
+
+/* With an offset of 0 or more, the file is written with pwrite() from
+   there on, so that several transfers can fill in parts of it; -1
+   writes through fp.  length is how much is to come, if known (from
+   tsize), or -1; it only sizes the buffer the data is gathered in. */
 int receiver(int sockfd,
              union sock_addr *server,
              size_t blocksize,
              int windowsize,
              int timeout,
              FILE *fp,
+             off_t offset,
+             off_t length,
              unsigned long *received,
-             char *error);
+             char *error,
+             struct xfer_stats *stats);
+
+/* RFC 1350 dally after receiver() has returned the complete file */
+void dally_wait(void);
+void dally_poll(void);
+void dally_until_input(int fd);
+int dally_pending(void);
 
+/* Sends up to length bytes from where fp is, or all the rest if -1 */
 int sender(int sockfd,
            union sock_addr *server,
            size_t blocksize,
@@ -95,5 +188,7 @@ int sender(int sockfd,
            int timeout,
            int rollover,
            FILE *fp,
-           unsigned long *sent);
+           off_t length,
+           unsigned long *sent,
+           struct xfer_stats *stats);
 #endif
@@ -0,0 +1,270 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * pool.c
+ *
+ * Size-class allocator with a memory budget for transfer buffers.  A
+ * transfer needs one buffer of about blocksize x windowsize, so with
+ * power-of-two classes a process serving transfers one after another
+ * (or many at once) keeps reusing the same few chunks.  Each class keeps
+ * at most POOL_KEEP free chunks; the rest go back to malloc().
+ */
+
+#include "pool.h"
+#include "tftpsubs.h"
+
+#define POOL_MIN_SHIFT  10      /* Smallest class: 1 KiB */
+#define POOL_CLASSES    22      /* Largest class: 2 GiB */
+#define POOL_KEEP       4       /* Free chunks kept per class */
+#define POOL_PROCS      4096    /* Processes with an account of their own */
+
+struct chunk {
+    struct chunk *next;         /* Free list link */
+    int cls;                    /* Size class */
+    int acct;                   /* Account charged for it, or -1 */
+};
+
+static struct chunk *freelist[POOL_CLASSES];
+static int nfree[POOL_CLASSES];
+
+static struct pool_stats local_stats;
+static struct pool_stats *stats = &local_stats;
+
+#ifdef HAVE_ATOMIC_BUILTINS
+
+/*
+ * With a shared budget, what each process has charged is also kept in an
+ * account of its own, so that what a process which died without freeing
+ * its buffers still had charged can be given back to the budget.  A
+ * process takes an account the first time it charges anything, and the
+ * accounts of processes which are gone are reaped when the budget runs
+ * out, and when the stats are read.  Without a free account, charges go
+ * to the budget alone, and stay there if the process dies.
+ */
+struct pool_acct {
+    pid_t pid;                  /* 0 if free, -1 while being reaped */
+    long used;
+};
+
+struct pool_shared {
+    struct pool_stats stats;
+    struct pool_acct acct[POOL_PROCS];
+};
+
+static struct pool_shared *shared;
+static int my_acct = -1;
+static pid_t my_pid;
+
+#endif
+
+int pool_init(size_t limit)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+    struct pool_shared *sh = shm_alloc(sizeof *sh);
+
+    if (sh) {
+        shared = sh;
+        stats = &sh->stats;
+    }
+#endif
+    stats->limit = limit;
+
+    return stats == &local_stats ? -1 : 0;
+}
+
+#ifdef HAVE_ATOMIC_BUILTINS
+
+/* Give back the charges of processes which are gone; returns how many
+   bytes that came to */
+static size_t reap(void)
+{
+    struct pool_acct *a;
+    size_t freed = 0;
+    pid_t pid;
+    long used;
+    int i;
+
+    for (i = 0; i < POOL_PROCS; i++) {
+        a = &shared->acct[i];
+        pid = __atomic_load_n(&a->pid, __ATOMIC_ACQUIRE);
+        if (pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH)
+            continue;
+        if (!__atomic_compare_exchange_n(&a->pid, &pid, -1, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            continue;
+        used = __atomic_exchange_n(&a->used, 0, __ATOMIC_ACQ_REL);
+        if (used > 0) {
+            __atomic_sub_fetch(&stats->used, (size_t)used, __ATOMIC_ACQ_REL);
+            freed += used;
+        }
+        __atomic_store_n(&a->pid, 0, __ATOMIC_RELEASE);
+    }
+
+    return freed;
+}
+
+/* This process's account, taking one if it has none yet, or -1 */
+static int account(void)
+{
+    pid_t me = getpid(), pid;
+    int i, tries;
+
+    if (!shared)
+        return -1;
+    if (my_pid == me)
+        return my_acct;         /* Not one inherited from a parent */
+
+    my_pid = me;
+    my_acct = -1;
+    for (tries = 0; tries < 2; tries++) {
+        for (i = 0; i < POOL_PROCS; i++) {
+            pid = 0;
+            if (__atomic_compare_exchange_n(&shared->acct[i].pid, &pid, me,
+                                            0, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_RELAXED)) {
+                my_acct = i;
+                return i;
+            }
+        }
+        reap();
+    }
+    return -1;
+}
+
+#endif
+
+/* Charge n bytes to the budget; returns the account charged (-1 for
+   none of its own), or -2 if over budget */
+static int charge(size_t n)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+    size_t used, peak;
+    int acct = account(), reaped = 0;
+
+    for (;;) {
+        used = __atomic_add_fetch(&stats->used, n, __ATOMIC_ACQ_REL);
+        if (!stats->limit || used <= stats->limit)
+            break;
+        __atomic_sub_fetch(&stats->used, n, __ATOMIC_ACQ_REL);
+        if (!shared || reaped++ || !reap()) {
+            __atomic_add_fetch(&stats->failures, 1, __ATOMIC_RELAXED);
+            return -2;
+        }
+    }
+    if (acct >= 0)
+        __atomic_add_fetch(&shared->acct[acct].used, (long)n,
+                           __ATOMIC_RELAXED);
+
+    peak = __atomic_load_n(&stats->peak, __ATOMIC_RELAXED);
+    while (used > peak &&
+           !__atomic_compare_exchange_n(&stats->peak, &peak, used, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return acct;
+#else
+    if (stats->limit && stats->used + n > stats->limit) {
+        stats->failures++;
+        return -2;
+    }
+    stats->used += n;
+    if (stats->used > stats->peak)
+        stats->peak = stats->used;
+    return -1;
+#endif
+}
+
+static void uncharge(size_t n, int acct)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+    if (acct >= 0)
+        __atomic_sub_fetch(&shared->acct[acct].used, (long)n,
+                           __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&stats->used, n, __ATOMIC_ACQ_REL);
+#else
+    (void)acct;
+    stats->used -= n;
+#endif
+}
+
+void *pool_alloc(size_t size)
+{
+    struct chunk *c;
+    size_t csize;
+    int cls, acct;
+
+    /* The header comes on top of the class size, uncharged */
+    for (cls = 0; cls < POOL_CLASSES; cls++)
+        if (size <= ((size_t)1 << (cls + POOL_MIN_SHIFT)))
+            break;
+    if (cls == POOL_CLASSES) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    csize = (size_t)1 << (cls + POOL_MIN_SHIFT);
+
+    acct = charge(csize);
+    if (acct == -2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    c = freelist[cls];
+    if (c) {
+        freelist[cls] = c->next;
+        nfree[cls]--;
+    } else {
+        c = malloc(sizeof *c + csize);
+        if (!c) {
+            uncharge(csize, acct);
+            errno = ENOMEM;
+            return NULL;
+        }
+        c->cls = cls;
+    }
+    c->acct = acct;
+
+    return c + 1;
+}
+
+void pool_free(void *p)
+{
+    struct chunk *c;
+    int cls;
+
+    if (!p)
+        return;
+
+    c = (struct chunk *)p - 1;
+    cls = c->cls;
+    uncharge((size_t)1 << (cls + POOL_MIN_SHIFT), c->acct);
+
+    if (nfree[cls] < POOL_KEEP) {
+        c->next = freelist[cls];
+        freelist[cls] = c;
+        nfree[cls]++;
+    } else {
+        free(c);
+    }
+}
+
+void pool_get_stats(struct pool_stats *s)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+    if (shared)
+        reap();
+    s->used = __atomic_load_n(&stats->used, __ATOMIC_RELAXED);
+    s->peak = __atomic_load_n(&stats->peak, __ATOMIC_RELAXED);
+    s->limit = stats->limit;
+    s->failures = __atomic_load_n(&stats->failures, __ATOMIC_RELAXED);
+#else
+    *s = *stats;
+#endif
+}
@@ -0,0 +1,44 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * pool.h
+ *
+ * Transfer buffers.  Allocations are rounded up to a power of two and
+ * recycled per size class, and every byte handed out is charged to a
+ * budget which, once pool_init() has been called, is shared with all
+ * processes forked afterwards, and which gets back what a process
+ * which died had charged.  A request for a power of two is charged just
+ * that, so a buffer of such a size wastes nothing.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "common.h"
+
+struct pool_stats {
+    size_t used;                /* Bytes currently handed out */
+    size_t peak;                /* Highest value of used */
+    size_t limit;               /* Cap on used, or 0 for none */
+    unsigned long failures;     /* Allocations refused by the cap */
+};
+
+/* Set up the shared budget; limit is in bytes, 0 for unlimited */
+int pool_init(size_t limit);
+
+/* Returns NULL, with errno set to ENOMEM, if over budget */
+void *pool_alloc(size_t size);
+void pool_free(void *);
+
+/* Snapshot of the (possibly shared) accounting */
+void pool_get_stats(struct pool_stats *);
+
+#endif
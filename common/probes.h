@@ -0,0 +1,67 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * probes.h
+ *
+ * Static tracepoints, in the SystemTap SDT format which bpftrace, perf
+ * and SystemTap can attach to, under the provider name "tftp".  Each is
+ * a single no-op instruction until something attaches to it.  Without
+ * <sys/sdt.h> they compile to nothing, and their arguments are not
+ * evaluated.
+ *
+ * In the server:
+ *
+ *   request(opcode, filename, mode)        RRQ/WRQ parsed, before remapping
+ *   remap(filename, newname)               newname is NULL if denied
+ *   open(filename, fd, errno)              fd is -1 on failure
+ *   oack__sent(length)
+ *   oack__acked()                          ACK of block 0, or the first DATA
+ *   session__end(op, filename, result, bytes)
+ *
+ * In the transfer engine, so also in the client:
+ *
+ *   window__sent(first, last)              sequence numbers of the blocks
+ *   window__acked(seq, bytes)              all blocks up to seq ACKed
+ *   gap(expected, block)                   receiver got a block out of order
+ *   resync(seq)                            ...and then the one it expected
+ *
+ * Sequence numbers count blocks from 1 and do not wrap at 65535 like
+ * block numbers do.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#include "../config.h"
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define TFTP_PROBE0(name)                       DTRACE_PROBE(tftp, name)
+#define TFTP_PROBE1(name, a)                    DTRACE_PROBE1(tftp, name, a)
+#define TFTP_PROBE2(name, a, b)                 DTRACE_PROBE2(tftp, name, a, b)
+#define TFTP_PROBE3(name, a, b, c)              \
+        DTRACE_PROBE3(tftp, name, a, b, c)
+#define TFTP_PROBE4(name, a, b, c, d)           \
+        DTRACE_PROBE4(tftp, name, a, b, c, d)
+
+#else
+
+#define TFTP_PROBE0(name)                       do { } while (0)
+#define TFTP_PROBE1(name, a)                    do { } while (0)
+#define TFTP_PROBE2(name, a, b)                 do { } while (0)
+#define TFTP_PROBE3(name, a, b, c)              do { } while (0)
+#define TFTP_PROBE4(name, a, b, c, d)           do { } while (0)
+
+#endif
+
+#endif                          /* PROBES_H */
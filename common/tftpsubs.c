@@ -33,232 +33,293 @@
 
 #include "tftpsubs.h"
 
-/* Simple minded read-ahead/write-behind subroutines for tftp user and
-   server.  Written originally with multiple buffers in mind, but current
-   implementation has two buffer logic wired in.
-
-   Todo:  add some sort of final error check so when the write-buffer
-   is finally flushed, the caller can detect if the disk filled up
-   (or had an i/o error) and return a nak to the other side.
-
-			Jim Guyton 10/85
- */
+/* Networking subroutines for tftp user and server.  The data transfer
+   itself, which used to be done with the read-ahead/write-behind
+   buffers here, is in xfer.c. */
 
 #include <sys/ioctl.h>
+#include <limits.h>
+#include <poll.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifdef MAP_ANONYMOUS
+#define HAVE_SHM 1
+#endif
+#endif
 
 int segsize = SEGSIZE;          /* Default segsize */
 
-struct bf {
-    int counter;                /* size of data in buffer, or flag */
-    char buf[PKTSIZE];          /* room for data packet */
-} bfs[2];
+/* When an error has occurred, it is possible that the two sides
+ * are out of synch.  Ie: that what I think is the other side's
+ * response to packet N is really their response to packet N-1.
+ *
+ * So, to try to prevent that, we flush all the input queued up
+ * for us on the network connection on our host, without waiting
+ * for anything more to arrive.
+ *
+ * We return the number of packets we flushed (mostly for reporting
+ * when trace is active).
+ */
 
-                                /* Values for bf.counter  */
-#define BF_ALLOC -3             /* alloc'd but not yet filled */
-#define BF_FREE  -2             /* free */
-/* [-1 .. segsize] = size of data in the data buffer */
+int synchnet(int f)
+{                               /* socket to flush */
+    int pktcount = 0;
+    char rbuf[PKTSIZE];
+    int n;
 
-static int nextone;             /* index of next buffer to use */
-static int current;             /* index of buffer in use */
+    for (;;) {
+#ifdef MSG_DONTWAIT
+        n = recv(f, rbuf, sizeof(rbuf), MSG_DONTWAIT);
+#else
+        struct pollfd pfd;
 
-                                /* control flags for crlf conversions */
-int newline = 0;                /* fillbuf: in middle of newline expansion */
-int prevchar = -1;              /* putbuf: previous char (cr check) */
+        pfd.fd = f;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) <= 0)
+            break;              /* Nothing to read */
+        n = recv(f, rbuf, sizeof(rbuf), 0);
+#endif
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;              /* Nothing (more) to read */
+        }
+        pktcount++;
+    }
 
-static struct tftphdr *rw_init(int);
+    return pktcount;            /* Return packets drained */
+}
 
-struct tftphdr *w_init()
+/*
+ * Allocate memory which stays shared with processes forked afterwards.
+ * Returns NULL, with errno set, if that is not possible here.
+ */
+void *shm_alloc(size_t size)
 {
-    return rw_init(0);
-}                               /* write-behind */
+#ifdef HAVE_SHM
+    void *p;
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return (p == MAP_FAILED) ? NULL : p;
+#else
+    (void)size;
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
 
-struct tftphdr *r_init()
-{
-    return rw_init(1);
-}                               /* read-ahead */
+#if defined(HAVE_SHM) && defined(HAVE_ATOMIC_BUILTINS)
 
-/* init for either read-ahead or write-behind */
-/* x == zero for write-behind, one for read-head */
-static struct tftphdr *rw_init(int x)
+/*
+ * Shared port map for pick_port_bind().  One bit per port in the range,
+ * set while a process holds a lease on the port; the lease records the
+ * owner's pid, so ports held by processes which died without releasing
+ * them can be reclaimed.  Allocation picks a free bit with a single
+ * compare-and-swap, so no bind() is wasted on ports which another
+ * session is already using.
+ */
+#define PM_BITS         (sizeof(unsigned long) * CHAR_BIT)
+#define PM_MAX_TRIES    64      /* Ports bound outside of the map */
+
+struct port_map {
+    unsigned int from, to;
+    unsigned int nwords;
+    unsigned int hint;          /* Word to start looking in */
+    pid_t *owner;               /* Lease holder for each port, or 0 */
+    unsigned long bits[1];
+};
+
+static struct port_map *port_map;
+
+static int port_map_grab(struct port_map *pm)
 {
-    newline = 0;                /* init crlf flag */
-    prevchar = -1;
-    bfs[0].counter = BF_ALLOC;  /* pass out the first buffer */
-    current = 0;
-    bfs[1].counter = BF_FREE;
-    nextone = x;                /* ahead or behind? */
-    return (struct tftphdr *)bfs[0].buf;
+    unsigned int i, w, r, bit, start;
+    unsigned long word, avail;
+    pid_t me = getpid();
+
+    start = __atomic_load_n(&pm->hint, __ATOMIC_RELAXED);
+    for (i = 0; i < pm->nwords; i++) {
+        w = (start + i) % pm->nwords;
+        word = __atomic_load_n(&pm->bits[w], __ATOMIC_RELAXED);
+        while (~word) {
+            /* Start at a random bit, so port numbers stay hard to guess */
+            r = (unsigned int)(rand() ^ me) % PM_BITS;
+            avail = ~word;
+            if (r)
+                avail = (avail >> r) | (avail << (PM_BITS - r));
+            bit = (__builtin_ctzl(avail) + r) % PM_BITS;
+
+            if (__atomic_compare_exchange_n(&pm->bits[w], &word,
+                                            word | (1UL << bit), 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_RELAXED)) {
+                __atomic_store_n(&pm->hint, (w + 1) % pm->nwords,
+                                 __ATOMIC_RELAXED);
+                __atomic_store_n(&pm->owner[w * PM_BITS + bit], me,
+                                 __ATOMIC_RELEASE);
+                return pm->from + w * PM_BITS + bit;
+            }
+            /* Lost a race; word now holds the current value */
+        }
+    }
+
+    return -1;
 }
 
-/* Have emptied current buffer by sending to net and getting ack.
-   Free it and return next buffer filled with data.
- */
-int readit(FILE * file, struct tftphdr **dpp, int convert)
+static void port_map_put(struct port_map *pm, unsigned int n)
 {
-    struct bf *b;
+    __atomic_fetch_and(&pm->bits[n / PM_BITS], ~(1UL << (n % PM_BITS)),
+                       __ATOMIC_RELEASE);
+}
 
-    bfs[current].counter = BF_FREE;     /* free old one */
-    current = !current;         /* "incr" current */
+/* Reclaim the leases of processes which are gone; returns how many */
+static int port_map_reap(struct port_map *pm)
+{
+    unsigned int n, nports = pm->to - pm->from + 1;
+    pid_t pid;
+    int reaped = 0;
+
+    for (n = 0; n < nports; n++) {
+        pid = __atomic_load_n(&pm->owner[n], __ATOMIC_ACQUIRE);
+        if (pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH)
+            continue;
+        if (__atomic_compare_exchange_n(&pm->owner[n], &pid, 0, 0,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED)) {
+            port_map_put(pm, n);
+            reaped++;
+        }
+    }
 
-    b = &bfs[current];          /* look at new buffer */
-    if (b->counter == BF_FREE)  /* if it's empty */
-        read_ahead(file, convert);      /* fill it */
-    /*      assert(b->counter != BF_FREE);*//* check */
-    *dpp = (struct tftphdr *)b->buf;    /* set caller's ptr */
-    return b->counter;
+    return reaped;
 }
 
-/*
- * fill the input buffer, doing ascii conversions if requested
- * conversions are  lf -> cr,lf  and cr -> cr, nul
- */
-void read_ahead(FILE * file, int convert)
+void release_port(unsigned int port)
 {
-    int i;
-    char *p;
-    int c;
-    struct bf *b;
-    struct tftphdr *dp;
+    struct port_map *pm = port_map;
+    pid_t me = getpid();
+    unsigned int n;
 
-    b = &bfs[nextone];          /* look at "next" buffer */
-    if (b->counter != BF_FREE)  /* nop if not free */
+    if (!pm || port < pm->from || port > pm->to)
         return;
-    nextone = !nextone;         /* "incr" next buffer ptr */
 
-    dp = (struct tftphdr *)b->buf;
+    n = port - pm->from;
+    if (__atomic_compare_exchange_n(&pm->owner[n], &me, 0, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        port_map_put(pm, n);
+}
 
-    if (convert == 0) {
-        b->counter = read(fileno(file), dp->th_data, segsize);
-        return;
-    }
+static void port_map_exit(void)
+{
+    struct port_map *pm = port_map;
+    unsigned int n, nports = pm->to - pm->from + 1;
+    pid_t me = getpid();
 
-    p = dp->th_data;
-    for (i = 0; i < segsize; i++) {
-        if (newline) {
-            if (prevchar == '\n')
-                c = '\n';       /* lf to cr,lf */
-            else
-                c = '\0';       /* cr to cr,nul */
-            newline = 0;
-        } else {
-            c = getc(file);
-            if (c == EOF)
-                break;
-            if (c == '\n' || c == '\r') {
-                prevchar = c;
-                c = '\r';
-                newline = 1;
-            }
-        }
-        *p++ = c;
-    }
-    b->counter = (int)(p - dp->th_data);
+    for (n = 0; n < nports; n++)
+        if (__atomic_load_n(&pm->owner[n], __ATOMIC_RELAXED) == me)
+            release_port(pm->from + n);
 }
 
-/* Update count associated with the buffer, get new buffer
-   from the queue.  Calls write_behind only if next buffer not
-   available.
- */
-int writeit(FILE * file, struct tftphdr **dpp, int ct, int convert)
+int port_map_init(unsigned int from, unsigned int to)
 {
-    bfs[current].counter = ct;  /* set size of data to write */
-    current = !current;         /* switch to other buffer */
-    if (bfs[current].counter != BF_FREE)        /* if not free */
-        (void)write_behind(file, convert);      /* flush it */
-    bfs[current].counter = BF_ALLOC;    /* mark as alloc'd */
-    *dpp = (struct tftphdr *)bfs[current].buf;
-    return ct;                  /* this is a lie of course */
+    struct port_map *pm;
+    unsigned int nports, nwords, tail;
+    size_t size;
+
+    if (port_map || !from || !to || from > to) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    nports = to - from + 1;
+    nwords = (nports + PM_BITS - 1) / PM_BITS;
+    size = offsetof(struct port_map, bits) + nwords * sizeof(unsigned long)
+        + nports * sizeof(pid_t);
+
+    pm = shm_alloc(size);
+    if (!pm)
+        return -1;
+
+    pm->from = from;
+    pm->to = to;
+    pm->nwords = nwords;
+    pm->hint = (unsigned int)rand() % nwords;
+    pm->owner = (pid_t *)&pm->bits[nwords];
+
+    /* Mark the bits past the end of the range as permanently taken */
+    tail = nports % PM_BITS;
+    if (tail)
+        pm->bits[nwords - 1] = ~0UL << tail;
+
+    port_map = pm;
+    atexit(port_map_exit);
+    return 0;
 }
 
 /*
- * Output a buffer to a file, converting from netascii if requested.
- * CR,NUL -> CR  and CR,LF => LF.
- * Note spec is undefined if we get CR as last byte of file or a
- * CR followed by anything else.  In this case we leave it alone.
+ * Bind to a port from the shared map.  A port can still turn out to be
+ * in use by something outside the map; keep the lease on those until we
+ * are done, so they are not handed to us again.
  */
-int write_behind(FILE * file, int convert)
+static int port_map_bind(int sockfd, union sock_addr *myaddr)
 {
-    char *buf;
-    int count;
-    int ct;
-    char *p;
-    int c;                      /* current character */
-    struct bf *b;
-    struct tftphdr *dp;
-
-    b = &bfs[nextone];
-    if (b->counter < -1)        /* anything to flush? */
-        return 0;               /* just nop if nothing to do */
-
-    count = b->counter;         /* remember byte count */
-    b->counter = BF_FREE;       /* reset flag */
-    dp = (struct tftphdr *)b->buf;
-    nextone = !nextone;         /* incr for next time */
-    buf = dp->th_data;
-
-    if (count <= 0)
-        return -1;              /* nak logic? */
-
-    if (convert == 0)
-        return write(fileno(file), buf, count);
-
-    p = buf;
-    ct = count;
-    while (ct--) {              /* loop over the buffer */
-        c = *p++;               /* pick up a character */
-        if (prevchar == '\r') { /* if prev char was cr */
-            if (c == '\n')      /* if have cr,lf then just */
-                fseek(file, -1, 1);     /* smash lf on top of the cr */
-            else if (c == '\0') /* if have cr,nul then */
-                goto skipit;    /* just skip over the putc */
-            /* else just fall through and allow it */
+    unsigned int tried[PM_MAX_TRIES];
+    int ntried = 0;
+    int port, rv = -1, err = EADDRINUSE;
+    int reaped = 0;
+
+    while (ntried < PM_MAX_TRIES) {
+        port = port_map_grab(port_map);
+        if (port < 0) {
+            if (reaped++ || !port_map_reap(port_map))
+                break;
+            continue;
         }
-        putc(c, file);
-      skipit:
-        prevchar = c;
-    }
-    return count;
-}
 
-/* When an error has occurred, it is possible that the two sides
- * are out of synch.  Ie: that what I think is the other side's
- * response to packet N is really their response to packet N-1.
- *
- * So, to try to prevent that, we flush all the input queued up
- * for us on the network connection on our host.
- *
- * We return the number of packets we flushed (mostly for reporting
- * when trace is active).
- */
+        sa_set_port(myaddr, htons(port));
+        if (bind(sockfd, &myaddr->sa, SOCKLEN(myaddr)) == 0) {
+            rv = 0;
+            break;
+        }
 
-int synchnet(int f)
-{                               /* socket to flush */
-    int pktcount = 0;
-    char rbuf[PKTSIZE];
-    union sock_addr from;
-    socklen_t fromlen;
-    fd_set socketset;
-    struct timeval notime;
+        /* Some versions of Linux return EINVAL instead of EADDRINUSE */
+        if (errno != EINVAL && errno != EADDRINUSE) {
+            err = errno;
+            release_port(port);
+            break;
+        }
+        tried[ntried++] = port;
+    }
 
-    while (1) {
-        notime.tv_sec = notime.tv_usec = 0;
+    while (ntried)
+        release_port(tried[--ntried]);
 
-        FD_ZERO(&socketset);
-        FD_SET(f, &socketset);
+    if (rv)
+        errno = err;
+    return rv;
+}
 
-        if (select(f, &socketset, NULL, NULL, &notime) <= 0)
-            break;              /* Nothing to read */
+#else
 
-        /* Otherwise drain the packet */
-        pktcount++;
-        fromlen = sizeof(from);
-        (void)recvfrom(f, rbuf, sizeof(rbuf), 0,
-                       &from.sa, &fromlen);
-    }
+int port_map_init(unsigned int from, unsigned int to)
+{
+    (void)from;
+    (void)to;
+    errno = ENOSYS;
+    return -1;
+}
 
-    return pktcount;            /* Return packets drained */
+void release_port(unsigned int port)
+{
+    (void)port;
 }
 
+#endif
+
 int pick_port_bind(int sockfd, union sock_addr *myaddr,
                    unsigned int port_range_from,
                    unsigned int port_range_to)
@@ -270,6 +331,17 @@ int pick_port_bind(int sockfd, union sock_addr *myaddr,
         port_range = 1;
     }
 
+#if defined(HAVE_SHM) && defined(HAVE_ATOMIC_BUILTINS)
+    if (port_range && port_map && port_map->from == port_range_from
+        && port_map->to == port_range_to) {
+        if (port_map_bind(sockfd, myaddr) == 0)
+            return 0;
+        if (errno != EADDRINUSE)
+            return -1;
+        /* Everything in the map is taken; probe the hard way */
+    }
+#endif
+
     firstport = port_range
         ? port_range_from + rand() % (port_range_to - port_range_from + 1)
         : 0;
@@ -87,18 +87,8 @@ static inline int sa_set_port(union sock_addr *s, u_short port)
 
 int set_sock_addr(char *, union sock_addr *, char **);
 
-struct tftphdr;
-
-struct tftphdr *r_init(void);
-void read_ahead(FILE *, int);
-int readit(FILE *, struct tftphdr **, int);
-
 int synchnet(int);
 
-struct tftphdr *w_init(void);
-int write_behind(FILE *, int);
-int writeit(FILE *, struct tftphdr **, int, int);
-
 extern int segsize;
 #define MAX_SEGSIZE     65464
 
@@ -109,4 +99,11 @@ extern int segsize;
 int pick_port_bind(int sockfd, union sock_addr *myaddr,
                    unsigned int from, unsigned int to);
 
+/* Memory shared with processes forked after the call */
+void *shm_alloc(size_t);
+
+/* Set up a port map for pick_port_bind() shared with forked children */
+int port_map_init(unsigned int from, unsigned int to);
+void release_port(unsigned int port);
+
 #endif
@@ -0,0 +1,663 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * xfer.c
+ *
+ * The TFTP data transfer state machine (RFC 1350, with RFC 7440 windows),
+ * without any I/O of its own other than reading or writing the file.
+ *
+ * The sender keeps the blocks of the current window in memory, so a
+ * retransmission does not have to seek back in the file.  It goes back
+ * to the oldest unacknowledged block on a timeout, or once on a repeated
+ * ACK for the same block, which is how the receiver says that it lost
+ * something.  The receiver ACKs every windowsize blocks and at the end,
+ * and repeats its last ACK when a block arrives out of order (once until
+ * it makes progress again) or when nothing arrives for a while.  Once it
+ * has the last block it dallies for one timeout, repeating the final ACK
+ * if the last block arrives again.
+ */
+
+#include "xfer.h"
+#include "pool.h"
+#include "probes.h"
+
+const struct xfer_writer *xfer_writer;
+
+long xfer_now(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+        return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+#endif
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+    }
+}
+
+long xfer_now_us(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+        return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+#endif
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec * 1000000L + tv.tv_usec;
+    }
+}
+
+unsigned short xfer_block(const struct tftp_xfer *x, unsigned long seq)
+{
+    unsigned long period = 65536 - x->rollover;
+
+    if (seq < x->rollover)
+        return 0;
+    return x->rollover + (seq - x->rollover) % period;
+}
+
+/*
+ * Find the sequence number in [lo, hi] which goes with a block number
+ * from the wire.  Returns 0 if there is none.
+ */
+static int block_to_seq(const struct tftp_xfer *x, unsigned short block,
+                        unsigned long lo, unsigned long hi,
+                        unsigned long *seq)
+{
+    unsigned long period = 65536 - x->rollover;
+    unsigned long s;
+
+    if (block < x->rollover)
+        s = 0;
+    else if (hi < x->rollover)
+        return 0;
+    else
+        s = hi - (xfer_block(x, hi) + period - block) % period;
+
+    if (s < lo || s > hi)
+        return 0;
+
+    *seq = s;
+    return 1;
+}
+
+static void queue_ack(struct tftp_xfer *x, unsigned long seq)
+{
+    struct tftphdr *tp = (struct tftphdr *)x->ctl;
+
+    tp->th_opcode = htons(ACK);
+    tp->th_block = htons(xfer_block(x, seq));
+    x->ctllen = 4;
+}
+
+static void fail(struct tftp_xfer *x, int error, const char *msg, int tell)
+{
+    struct tftphdr *tp = (struct tftphdr *)x->ctl;
+    int len;
+
+    x->state = XFER_FAILED;
+    x->error = error;
+    snprintf(x->errmsg, sizeof x->errmsg, "%s", msg);
+
+    if (tell) {
+        tp->th_opcode = htons(ERROR);
+        tp->th_code = htons(EUNDEF);
+        len = strlen(msg) + 1;
+        if (len > ERROR_MAXLEN)
+            len = ERROR_MAXLEN;
+        memcpy(tp->th_msg, msg, len);
+        tp->th_msg[len - 1] = '\0';
+        x->ctllen = len + 4;
+    } else {
+        x->ctllen = 0;
+    }
+}
+
+/* Write out what wbuf holds; returns 0, or -1 if it could not be */
+static int flush_wbuf(struct tftp_xfer *x)
+{
+    int r;
+
+    if (xfer_writer) {
+        r = xfer_writer->put(x->wbuf, x->wlen, x->wpos);
+        x->wbuf = NULL;
+    } else {
+        r = write_at(fileno(x->fp), x->wbuf, x->wlen, x->wpos);
+    }
+    x->wpos += x->wlen;
+    x->wlen = 0;
+    return r;
+}
+
+/* Size for a buffer of at most XFER_WBUF_SIZE which is to hold the
+   "left" bytes still to come, if known, but never less than a block */
+static size_t buf_size(const struct tftp_xfer *x, off_t left)
+{
+    if (left < 0 || left >= XFER_WBUF_SIZE)
+        return XFER_WBUF_SIZE;
+    return (size_t)left > x->blocksize ? (size_t)left : x->blocksize;
+}
+
+/* Gather count bytes into wbuf, writing it out when full.  Returns
+   count, or (size_t)-1 if a write failed. */
+static size_t gather(struct tftp_xfer *x, const char *buf, size_t count)
+{
+    size_t room, n;
+
+    for (n = 0; n < count; n += room) {
+        /* A buffer at the first block, and again after each one which
+           went to xfer_writer */
+        if (!x->wbuf && xfer_writer) {
+            x->wbuf = xfer_writer->get();
+            if (!x->wbuf)
+                return (size_t)-1;
+            x->bufsize = XFER_WBUF_SIZE;
+        } else if (!x->wbuf) {
+            x->bufsize = buf_size(x, x->limit);
+            x->wbuf = pool_alloc(x->bufsize);
+        }
+        if (!x->wbuf) {
+            /* Over the memory budget: straight to the file, then */
+            if (write_at(fileno(x->fp), buf + n, count - n, x->wpos))
+                return (size_t)-1;
+            x->wpos += count - n;
+            break;
+        }
+
+        /* Up to the next multiple of XFER_WBUF_SIZE in the file, or
+           as much as a small wbuf holds if more came than was said */
+        room = XFER_WBUF_SIZE - (x->wpos + x->wlen) % XFER_WBUF_SIZE;
+        if (room > x->bufsize - x->wlen)
+            room = x->bufsize - x->wlen;
+        if (room > count - n)
+            room = count - n;
+        memcpy(x->wbuf + x->wlen, buf + n, room);
+        x->wlen += room;
+        if (((x->wpos + x->wlen) % XFER_WBUF_SIZE == 0 ||
+             x->wlen == x->bufsize) && flush_wbuf(x))
+            return (size_t)-1;
+    }
+    return count;
+}
+
+static size_t write_data(struct tftp_xfer *x, const char *buf, size_t count,
+                         int convert)
+{
+    char wbuf[count];
+    size_t i = 0, cnt = 0;
+
+    if (x->wpos >= 0)
+        return gather(x, buf, count);
+
+    /* TODO: jsynacek: I don't think any conversion should take place...
+     * RFC 1350 says: "A host which receives netascii mode data must translate
+     * the data to its own format."
+     * That basically means nothing. What does "own format" even mean?
+     * The original implementation translated \r\n to \n and skipped \0 bytes,
+     * which aren't even legal in the netascii format.
+     * However, I believe that the file should remain as is before and after
+     * the transfer.
+     */
+    convert = 0;
+
+    if (convert == 0 || count == 0)
+        return fwrite(buf, 1, count, x->fp);
+
+    /* Working conversion. Leave it as dead code for now. */
+    if (x->was_cr && buf[0] == '\n') {
+        wbuf[cnt++] = '\n';
+        i = 1;
+        (void) fseek(x->fp, -1, SEEK_CUR);
+    }
+
+    while(i < count) {
+        if (buf[i] == '\r' && i + 1 < count && buf[i + 1] == '\n') {
+            wbuf[cnt++] = '\n';
+            ++i;
+        } else if (buf[i] == '\0') {
+            /* Skip it */
+        } else {
+            wbuf[cnt++] = buf[i];
+        }
+        ++i;
+    }
+    /* Preserve state between data chunks */
+    x->was_cr = buf[i - 1] == '\r';
+
+    if (fwrite(wbuf, 1, cnt, x->fp) == 0)
+        return 0;
+
+    return count;
+}
+
+/*
+ * Find what rpos is in: data up to seg_end, or a hole up to seg_end,
+ * or if that cannot be told, data from here on (seg_end -1).  Returns
+ * 0, or 1 at the end of the file.
+ */
+static int map_segment(struct tftp_xfer *x)
+{
+    int fd = fileno(x->fp);
+    struct stat st;
+    off_t next = -1;
+
+    x->in_hole = 0;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    next = lseek(fd, x->rpos, SEEK_DATA);
+    if (next > x->rpos) {
+        x->in_hole = 1;
+        x->seg_end = next;
+        return 0;
+    } else if (next == x->rpos) {
+        x->seg_end = lseek(fd, x->rpos, SEEK_HOLE);
+        if (x->seg_end > x->rpos)
+            return 0;
+    } else if (errno == ENXIO) {
+        /* No more data: a hole up to the end, or the end itself */
+        if (fstat(fd, &st) || x->rpos >= st.st_size)
+            return 1;
+        x->in_hole = 1;
+        x->seg_end = st.st_size;
+        return 0;
+    }
+#endif
+    /* Holes cannot be found here: it is all data, from now on */
+    (void)next;
+    (void)st;
+    x->in_hole = 0;
+    x->seg_end = -1;
+    return 0;
+}
+
+/*
+ * Read ahead into rbuf, up to the next multiple of XFER_WBUF_SIZE in
+ * the file.  Returns the bytes read, 0 at the end of the file, or -1.
+ */
+static ssize_t fill_rbuf(struct tftp_xfer *x)
+{
+    size_t want = XFER_WBUF_SIZE - x->rpos % XFER_WBUF_SIZE;
+    size_t chunk;
+    ssize_t n;
+
+    if (want > x->bufsize)
+        want = x->bufsize;
+    if (x->limit >= 0 && (off_t)want > x->limit)
+        want = x->limit;
+
+    x->rlen = x->roff = 0;
+    while (x->rlen < want) {
+        if (x->seg_end >= 0 && x->rpos >= x->seg_end && map_segment(x))
+            break;
+        chunk = want - x->rlen;
+        if (x->seg_end >= 0 && (off_t)chunk > x->seg_end - x->rpos)
+            chunk = x->seg_end - x->rpos;
+
+        if (x->in_hole) {
+            memset(x->rbuf + x->rlen, 0, chunk);
+            n = chunk;
+        } else {
+            n = pread(fileno(x->fp), x->rbuf + x->rlen, chunk, x->rpos);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return -1;
+            if (n == 0)
+                break;          /* Cut short under us */
+        }
+        x->rlen += n;
+        x->rpos += n;
+    }
+    return x->rlen;
+}
+
+/* Bytes left to send, as far as is known now, or -1 */
+static off_t bytes_left(const struct tftp_xfer *x)
+{
+    struct stat st;
+    off_t left = -1;
+
+    if (!fstat(fileno(x->fp), &st) && S_ISREG(st.st_mode))
+        left = st.st_size > x->rpos ? st.st_size - x->rpos : 0;
+    if (x->limit >= 0 && (left < 0 || x->limit < left))
+        left = x->limit;
+    return left;
+}
+
+/* Up to want bytes from rbuf into buf; returns how many, or -1 */
+static ssize_t read_ahead(struct tftp_xfer *x, char *buf, size_t want)
+{
+    size_t got = 0, n;
+    ssize_t r;
+
+    while (got < want) {
+        if (x->roff == x->rlen) {
+            r = fill_rbuf(x);
+            if (r <= 0)
+                return r < 0 ? -1 : (ssize_t)got;
+        }
+        n = x->rlen - x->roff;
+        if (n > want - got)
+            n = want - got;
+        memcpy(buf + got, x->rbuf + x->roff, n);
+        x->roff += n;
+        got += n;
+    }
+    return got;
+}
+
+/* Read the next block of the file into its window slot */
+static int read_block(struct tftp_xfer *x)
+{
+    unsigned long seq = x->nread + 1;
+    int slot = seq % x->windowsize;
+    struct tftphdr *tp;
+    size_t size, want = x->blocksize;
+    ssize_t r;
+
+    tp = (struct tftphdr *)(x->slots + slot * (x->blocksize + 4));
+    tp->th_opcode = htons(DATA);
+    tp->th_block = htons(xfer_block(x, seq));
+
+    if (x->limit >= 0 && (off_t)want > x->limit)
+        want = x->limit;
+
+    if (x->rpos >= 0 && !x->rbuf) {
+        x->bufsize = buf_size(x, bytes_left(x));
+        x->rbuf = pool_alloc(x->bufsize);
+        /* Over the memory budget: through fp, then */
+        if (!x->rbuf && fseeko(x->fp, x->rpos, SEEK_SET) == 0)
+            x->rpos = -1;
+    }
+
+    if (x->rbuf) {
+        r = want ? read_ahead(x, tp->th_data, want) : 0;
+        if (r < 0) {
+            fail(x, E_FAILED_TO_READ, "Error while reading the file", 1);
+            return -1;
+        }
+        size = r;
+    } else {
+        size = want ? fread(tp->th_data, 1, want, x->fp) : 0;
+        if (size == 0 && ferror(x->fp)) {
+            fail(x, E_FAILED_TO_READ, "Error while reading the file", 1);
+            return -1;
+        }
+    }
+    if (x->limit >= 0)
+        x->limit -= size;
+
+    x->slotlen[slot] = size + 4;
+    x->nread = seq;
+    if (size != x->blocksize)
+        x->last = seq;
+
+    return 0;
+}
+
+int xfer_init(struct tftp_xfer *x, enum xfer_dir dir, FILE *fp,
+              size_t blocksize, int windowsize, int timeout,
+              unsigned short rollover, long now)
+{
+    size_t size;
+
+    memset(x, 0, sizeof *x);
+
+    x->dir = dir;
+    x->fp = fp;
+    x->blocksize = blocksize;
+    x->windowsize = windowsize > 0 ? windowsize : 1;
+    x->timeout = timeout;
+    x->rollover = rollover;
+    x->limit = -1;
+    x->wpos = -1;
+    x->rpos = -1;
+    /* A file with a descriptor is read with pread(), from where fp is */
+    if (dir == XFER_SEND && fp && fileno(fp) >= 0)
+        x->rpos = ftello(fp);
+
+    x->state = XFER_RUNNING;
+    x->base = x->next = 1;
+    x->tries = RETRIES;
+    x->deadline = now + timeout;
+    x->st.start = now;
+    if (dir == XFER_SEND)
+        x->st.first = now;      /* The first block goes out right away */
+
+    size = blocksize + 4;
+    if (dir == XFER_SEND)
+        size += x->windowsize * (blocksize + 4 + sizeof *x->slotlen);
+
+    x->mem = pool_alloc(size);
+    if (!x->mem)
+        return -1;
+
+    /* The lengths go first, to keep them aligned */
+    if (dir == XFER_SEND) {
+        x->slotlen = x->mem;
+        x->rxbuf = (char *)(x->slotlen + x->windowsize);
+        x->slots = x->rxbuf + blocksize + 4;
+    } else {
+        x->rxbuf = x->mem;
+    }
+
+    return 0;
+}
+
+void xfer_free(struct tftp_xfer *x)
+{
+    /* Whatever arrived, even if the transfer failed */
+    if (x->wlen)
+        (void)flush_wbuf(x);
+    pool_free(x->wbuf);
+    x->wbuf = NULL;
+    pool_free(x->rbuf);
+    x->rbuf = NULL;
+    pool_free(x->mem);
+    x->mem = NULL;
+    x->rxbuf = x->slots = NULL;
+    x->slotlen = NULL;
+}
+
+static void feed_ack(struct tftp_xfer *x, unsigned short block, long now)
+{
+    unsigned long seq, s;
+
+    if (!block_to_seq(x, block, x->base - 1, x->next - 1, &seq))
+        return;                 /* Stale, or for something not sent yet */
+
+    if (seq >= x->base) {
+        for (s = x->base; s <= seq; s++)
+            x->amount += x->slotlen[s % x->windowsize] - 4;
+        x->base = seq + 1;
+        TFTP_PROBE2(window__acked, seq, x->amount);
+        x->tries = RETRIES;
+        x->deadline = now + x->timeout;
+        if (x->last && seq == x->last)
+            x->state = XFER_DONE;
+    } else if (x->next > x->base) {
+        /* Repeated ACK: the receiver lost a block, start over from there */
+        x->st.out_of_order++;
+        if (x->goback != x->base) {
+            x->goback = x->base;
+            x->next = x->base;
+        }
+    }
+}
+
+static void feed_data(struct tftp_xfer *x, const struct tftphdr *tp,
+                      size_t size, long now)
+{
+    size_t n;
+
+    if (ntohs(tp->th_block) != xfer_block(x, x->base)) {
+        TFTP_PROBE2(gap, x->base, ntohs(tp->th_block));
+        x->st.out_of_order++;
+        if (!x->reacked) {
+            queue_ack(x, x->base - 1);
+            x->st.retransmits++;
+            x->reacked = 1;
+            x->window = 0;
+        }
+        return;
+    }
+
+    if (size > x->blocksize)
+        return;                 /* Not what we negotiated */
+
+    n = write_data(x, tp->th_data, size, 0);
+    /* The file is all written before the final ACK goes out */
+    if (n != (size_t)-1 && size != x->blocksize && x->wpos >= 0 &&
+        ((x->wlen && flush_wbuf(x)) ||
+         (xfer_writer ? xfer_writer->sync() :
+          sparse_writes && extend_to(fileno(x->fp), x->wpos))))
+        n = (size_t)-1;
+    if (n == (size_t)-1 || (n == 0 && ferror(x->fp))) {
+        fail(x, E_FAILED_TO_WRITE, "Failed to write data", 1);
+        return;
+    }
+
+    if (x->reacked)
+        TFTP_PROBE1(resync, x->base);
+    if (!x->st.first)
+        x->st.first = now;
+    x->amount += n;
+    x->base++;
+    x->reacked = 0;
+    x->tries = RETRIES;
+    x->deadline = now + x->timeout;
+
+    if (++x->window >= x->windowsize || size != x->blocksize) {
+        queue_ack(x, x->base - 1);
+        x->window = 0;
+    }
+    if (size != x->blocksize) {
+        x->state = XFER_DONE;
+        x->dally_until = now + x->timeout;
+    }
+}
+
+void xfer_feed(struct tftp_xfer *x, const void *pkt, size_t len, long now)
+{
+    const struct tftphdr *tp = pkt;
+    unsigned short opcode;
+
+    if (len < 4)
+        return;
+
+    opcode = ntohs(tp->th_opcode);
+
+    if (x->state != XFER_RUNNING) {
+        /* Our final ACK got lost: the sender is repeating the last block */
+        if (xfer_dallying(x, now) && opcode == DATA &&
+            ntohs(tp->th_block) == xfer_block(x, x->base - 1))
+            queue_ack(x, x->base - 1);
+        return;
+    }
+
+    if (opcode == ERROR) {
+        x->state = XFER_FAILED;
+        x->error = E_RECEIVED_ERROR;
+        snprintf(x->errmsg, sizeof x->errmsg, "Error code %d: %.*s",
+                 ntohs(tp->th_code), (int)(len - 4), tp->th_msg);
+    } else if (x->dir == XFER_SEND) {
+        /* Anything but ACK and ERROR is ignored here */
+        if (opcode == ACK)
+            feed_ack(x, ntohs(tp->th_block), now);
+    } else if (opcode == DATA) {
+        feed_data(x, tp, len - 4, now);
+    } else if (opcode == OACK && x->base == 1) {
+        /* Our ACK of the OACK got lost: the sender repeats the OACK
+           each time it times out waiting, so answer each one */
+        queue_ack(x, 0);
+        x->st.retransmits++;
+    } else {
+        fail(x, E_UNEXPECTED_PACKET, "Unexpected packet", 0);
+    }
+}
+
+void xfer_defer(struct tftp_xfer *x, long until)
+{
+    if (x->deadline - (until + x->timeout) < 0)
+        x->deadline = until + x->timeout;
+}
+
+void xfer_cancel(struct tftp_xfer *x, const char *msg)
+{
+    if (x->state == XFER_RUNNING)
+        fail(x, E_CANCELLED, msg, 1);
+}
+
+long xfer_poll(struct tftp_xfer *x, long now)
+{
+    if (x->state != XFER_RUNNING)
+        return xfer_dallying(x, now) ? x->dally_until - now : -1;
+
+    if (now - x->deadline >= 0) {
+        x->st.timeouts++;
+        if (--x->tries <= 0) {
+            fail(x, E_TIMED_OUT, "Timeout", 0);
+            return -1;
+        }
+        if (x->dir == XFER_SEND) {
+            x->next = x->base;
+            x->goback = x->base;
+        } else {
+            queue_ack(x, x->base - 1);
+            x->st.retransmits++;
+            x->reacked = 0;
+            x->window = 0;
+        }
+        x->deadline = now + x->timeout;
+    }
+
+    return x->deadline - now;
+}
+
+size_t xfer_produce(struct tftp_xfer *x, const void **pkt)
+{
+    int slot;
+    size_t len;
+
+    if (x->ctllen) {
+        len = x->ctllen;
+        x->ctllen = 0;
+        *pkt = x->ctl;
+        return len;
+    }
+
+    if (x->state != XFER_RUNNING || x->dir != XFER_SEND)
+        return 0;
+    if (x->next >= x->base + x->windowsize)
+        return 0;               /* Window full */
+    if (x->last && x->next > x->last)
+        return 0;               /* All sent, waiting for the ACK */
+
+    if (x->next > x->nread && read_block(x))
+        return xfer_produce(x, pkt);    /* The ERROR packet */
+
+    if (x->next <= x->hisent)
+        x->st.retransmits++;
+    else
+        x->hisent = x->next;
+    slot = x->next++ % x->windowsize;
+    if (x->next == x->base + x->windowsize || (x->last && x->next > x->last))
+        TFTP_PROBE2(window__sent, x->base, x->next - 1);
+    *pkt = x->slots + slot * (x->blocksize + 4);
+    return x->slotlen[slot];
+}
@@ -0,0 +1,194 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * xfer.h
+ *
+ * Transfer engine shared by the client and the server.  All the state of
+ * one transfer lives in a struct tftp_xfer, and the engine does no
+ * network I/O and never blocks: the caller feeds it the packets it
+ * receives, asks it for the packets to send, and tells it what time it
+ * is.  sender() and receiver() in common.c are blocking loops on top of
+ * this; a process which wants to run many transfers at once can drive
+ * the engine from its own event loop instead.
+ */
+
+#ifndef XFER_H
+#define XFER_H
+
+#include "common.h"
+
+enum xfer_dir {
+    XFER_SEND,                  /* We send DATA and receive ACKs */
+    XFER_RECV,                  /* We receive DATA and send ACKs */
+};
+
+enum xfer_state {
+    XFER_RUNNING,
+    XFER_DONE,
+    XFER_FAILED,
+};
+
+struct tftp_xfer {
+    /* Parameters */
+    enum xfer_dir dir;
+    FILE *fp;
+    size_t blocksize;
+    int windowsize;
+    int timeout;                /* ms without progress before resending */
+    unsigned short rollover;    /* Block number following 65535 */
+    off_t limit;                /* Sender: bytes left to send from fp, or
+                                   -1 for all of the rest of it; receiver:
+                                   bytes to come, if known, or -1 */
+    off_t wpos;                 /* Receiver: where to pwrite() the data
+                                   in wbuf to fp's descriptor, or -1 to
+                                   write through fp */
+    off_t rpos;                 /* Sender: where to pread() rbuf's next
+                                   data from fp's descriptor, or -1 to
+                                   read through fp */
+
+    /* Progress */
+    enum xfer_state state;
+    int error;                  /* E_* code once XFER_FAILED */
+    char errmsg[ERROR_MAXLEN];
+    unsigned long amount;       /* Bytes acknowledged or written */
+    struct xfer_stats st;       /* Counters and times, less bytes/blocks */
+
+    /*
+     * Blocks are tracked by a sequence number which, unlike the 16-bit
+     * block number on the wire, does not wrap.  Block 1 is sequence 1.
+     */
+    unsigned long base;         /* Oldest block not acknowledged/received */
+    unsigned long next;         /* Sender: next block to transmit */
+    unsigned long nread;        /* Sender: blocks read from the file */
+    unsigned long last;         /* Sender: final block, once read */
+    unsigned long goback;       /* Sender: base we last went back to */
+    unsigned long hisent;       /* Sender: highest block sent so far */
+    int window;                 /* Receiver: blocks since the last ACK */
+    int reacked;                /* Receiver: out-of-order ACK already sent */
+    int tries;                  /* Timeouts left before giving up */
+    long deadline;              /* When to time out, in xfer_now() ms */
+    long dally_until;           /* Receiver: answer a repeated final DATA
+                                   until then (RFC 1350 section 6) */
+    int was_cr;                 /* netascii state across blocks */
+
+    /*
+     * One buffer from the pool, sized to the negotiated blocksize (and
+     * for the sender, the window).  It holds room for one received
+     * packet, which the caller may use, and for the sender one slot of
+     * blocksize + 4 bytes per block in the window, and their lengths.
+     */
+    void *mem;
+    char *rxbuf;
+    char *slots;
+    size_t *slotlen;
+
+    /*
+     * Receiver writing with pwrite(): blocks gathered into one buffer,
+     * also from the pool (or from xfer_writer), and written out when it
+     * reaches the next multiple of XFER_WBUF_SIZE in the file, so that
+     * most writes are large and aligned.  Taken at the first block, not
+     * at xfer_init(), and no bigger than the bytes still to come.
+     */
+    char *wbuf;
+    size_t wlen;
+    size_t bufsize;             /* Of wbuf (or rbuf) */
+
+    /*
+     * Sender reading with pread(): the file read ahead into a buffer
+     * like wbuf, up to the next multiple of XFER_WBUF_SIZE at a time, and
+     * no bigger than what is left to send.
+     * Holes, as lseek() with SEEK_DATA and SEEK_HOLE finds them on the
+     * way, are filled with zeros there instead of being read.
+     */
+    char *rbuf;
+    size_t rlen;                /* Bytes in rbuf */
+    size_t roff;                /* Of those, taken into blocks */
+    off_t seg_end;              /* End of the data or hole rpos is in,
+                                   or -1 if holes cannot be found */
+    int in_hole;
+
+    /* ACK or ERROR waiting to be sent */
+    int ctllen;
+    char ctl[4 + ERROR_MAXLEN + 1];
+};
+
+#define XFER_WBUF_SIZE  (256 * 1024)    /* Receiver: bytes per pwrite() */
+
+/*
+ * Where a receiver writing with pwrite() can hand its buffers instead,
+ * for a process which wants the file written in the background while
+ * the transfer goes on.  Buffers are XFER_WBUF_SIZE bytes.
+ */
+struct xfer_writer {
+    /* A free buffer, waiting for one if they are all queued; NULL once
+       a write has failed */
+    char *(*get)(void);
+    /* Queue len bytes of buf to be written at pos, after which the
+       buffer is the writer's again.  Returns 0, or -1 once a write has
+       failed. */
+    int (*put)(char *buf, size_t len, off_t pos);
+    /* Wait until all that is queued is written and on disk.  Returns
+       0, or -1 if any of it failed. */
+    int (*sync)(void);
+};
+
+/* If set, receivers writing with pwrite() go through it.  It is the
+   process's, not a transfer's: its buffers, sync() and a failed write
+   are shared by whatever receiver is running, so a process which sets
+   one runs one receiver at a time and sets the writer up again for
+   the next (as --write-behind does for each upload). */
+extern const struct xfer_writer *xfer_writer;
+
+/* Monotonic clock in milliseconds, for the "now" arguments below */
+long xfer_now(void);
+
+/* The same clock in microseconds, for finer timings */
+long xfer_now_us(void);
+
+/* Set up a transfer of fp.  Returns 0, or -1 if the buffers would not
+   fit in memory or in the pool's budget. */
+int xfer_init(struct tftp_xfer *, enum xfer_dir, FILE *fp, size_t blocksize,
+              int windowsize, int timeout, unsigned short rollover, long now);
+
+/* Release the memory held by a transfer; does not close fp */
+void xfer_free(struct tftp_xfer *);
+
+/* Process a packet received from the peer */
+void xfer_feed(struct tftp_xfer *, const void *pkt, size_t len, long now);
+
+/* Handle timeouts.  Returns the number of ms until the next one, or -1
+   once the transfer is over.  A receiver which has finished keeps
+   returning the time left to dally, and should keep being fed packets
+   until then so it can repeat the final ACK if the sender missed it;
+   the file is complete and can be closed as soon as xfer_finished(). */
+long xfer_poll(struct tftp_xfer *, long now);
+
+/* Return the length of the next packet to send and point *pkt at it, or
+   return 0 if there is nothing to send right now.  The packet stays
+   valid until the next call into the engine. */
+size_t xfer_produce(struct tftp_xfer *, const void **pkt);
+
+/* Put off the next timeout to a full timeout after "until", for a
+   caller which holds back its packets on purpose until then */
+void xfer_defer(struct tftp_xfer *, long until);
+
+/* Abort the transfer with E_CANCELLED, sending msg to the peer */
+void xfer_cancel(struct tftp_xfer *, const char *msg);
+
+/* Block number on the wire for a sequence number */
+unsigned short xfer_block(const struct tftp_xfer *, unsigned long seq);
+
+#define xfer_finished(x)        ((x)->state != XFER_RUNNING)
+#define xfer_dallying(x, now)   ((x)->state == XFER_DONE && \
+                                 (x)->dir == XFER_RECV && \
+                                 (now) - (x)->dally_until < 0)
+
+#endif
@@ -0,0 +1,574 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * tftp-relay.c
+ *
+ * A UDP relay to put between a TFTP client and server, which makes the
+ * path between them behave like a poor network link: it drops,
+ * duplicates, delays and reorders packets and limits the bandwidth,
+ * using its own random number generator so a given seed makes the same
+ * decisions for the same sequence of packets.  No privileges or kernel
+ * support are needed.
+ *
+ * Each request gets a session of two sockets: one towards the server,
+ * and one on a port of its own towards the client, which stands in for
+ * the server's transfer port.  The request goes to the server's
+ * listening port, and what the client sends after it to the port the
+ * server replied from.
+ *
+ * Packets waiting to go out are kept in a heap ordered by when they
+ * are due.  The bandwidth limit serialises each direction like a link
+ * of that speed, with a queue which drops what would wait longer than
+ * a set time.
+ */
+
+#include "../common/tftpsubs.h"
+#include "../common/xfer.h"
+
+#include <poll.h>
+#include <signal.h>
+
+#define MAX_SESSIONS    256
+#define MAX_QUEUED      65536
+
+enum { UP, DOWN };              /* Client to server, server to client */
+
+struct impair {
+    double loss;                /* Probabilities, 0..1 */
+    double dup;
+    double reorder;
+    long delay;                 /* us */
+    long jitter;                /* us, each way from delay */
+    long rate;                  /* Bytes per second, 0 for no limit */
+};
+
+struct link {
+    struct impair im;
+    long busy_until;            /* us: when the last queued packet is out */
+    long last_due;              /* us: when the last packet sent arrives */
+    unsigned long in, dropped, overflow, duplicated, reordered, out;
+};
+
+struct session {
+    int used;
+    union sock_addr client;
+    union sock_addr tid;        /* Where the server replied from */
+    int have_tid;
+    int up_fd;                  /* To the server */
+    int down_fd;                /* To the client, as its transfer port */
+    long last;                  /* us */
+};
+
+struct pkt {
+    long due;                   /* us */
+    unsigned long seq;          /* Keeps equal due times in order */
+    struct link *link;
+    int fd;
+    union sock_addr to;
+    size_t len;
+    char *data;
+};
+
+static const char *progname;
+static struct link links[2];
+static struct session sessions[MAX_SESSIONS];
+static struct pkt *heap[MAX_QUEUED];
+static int nheap;
+static unsigned long pkt_seq;
+static long reorder_hold = 10000;       /* us */
+static long queue_limit = 1000000;      /* us */
+static long idle_limit = 60000000;      /* us */
+static int verbose;
+static volatile sig_atomic_t stop;
+
+static union sock_addr server;
+static int listen_fd;
+
+/* xorshift64*: small, fast and the same everywhere */
+static unsigned long long rng_state = 1;
+
+static double rnd(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [listen-address:]port server [port]\n"
+            "  -l loss%%     -u duplicate%%  -r reorder%%  -d delay_ms\n"
+            "  -j jitter_ms  -b bytes/s      -R reorder_hold_ms\n"
+            "  -q queue_limit_ms  -i idle_s  -s seed  -v\n"
+            "Each of -l -u -r -d -j -b takes one value for both directions,\n"
+            "or UP/DOWN for client-to-server and server-to-client.\n",
+            progname);
+    exit(EX_USAGE);
+}
+
+/* "A" or "A/B"; scale turns the units given into those kept */
+static void parse_pair(const char *arg, double scale, double max,
+                       double *up, double *down)
+{
+    char *end;
+
+    *up = strtod(arg, &end);
+    if (*end == '/')
+        *down = strtod(end + 1, &end);
+    else
+        *down = *up;
+    if (*end || *up < 0 || *down < 0 || *up > max || *down > max)
+        usage();
+    *up *= scale;
+    *down *= scale;
+}
+
+
+static void heap_push(struct pkt *p)
+{
+    int i = nheap++, parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (heap[parent]->due < p->due ||
+            (heap[parent]->due == p->due && heap[parent]->seq < p->seq))
+            break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = p;
+}
+
+static struct pkt *heap_pop(void)
+{
+    struct pkt *top = heap[0], *last = heap[--nheap];
+    int i = 0, child;
+
+    while ((child = 2 * i + 1) < nheap) {
+        if (child + 1 < nheap &&
+            (heap[child + 1]->due < heap[child]->due ||
+             (heap[child + 1]->due == heap[child]->due &&
+              heap[child + 1]->seq < heap[child]->seq)))
+            child++;
+        if (last->due < heap[child]->due ||
+            (last->due == heap[child]->due && last->seq < heap[child]->seq))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/* Put one copy of a packet on the link */
+static void enqueue(struct link *l, int fd, const union sock_addr *to,
+                    const char *data, size_t len, long now)
+{
+    struct impair *im = &l->im;
+    struct pkt *p;
+    long due = now, start;
+
+    if (im->rate) {
+        start = l->busy_until > now ? l->busy_until : now;
+        if (start - now > queue_limit) {
+            l->overflow++;
+            return;
+        }
+        l->busy_until = start + (long)(len * 1000000.0 / im->rate);
+        due = l->busy_until;
+    }
+
+    /* Jitter alone does not let a packet overtake the one before */
+    due += im->delay;
+    if (im->jitter)
+        due += (long)((rnd() * 2 - 1) * im->jitter);
+    if (due < l->last_due)
+        due = l->last_due;
+    if (due < now)
+        due = now;
+    l->last_due = due;
+    if (im->reorder > 0 && rnd() < im->reorder) {
+        due += reorder_hold;
+        l->reordered++;
+    }
+
+    if (nheap >= MAX_QUEUED) {
+        l->overflow++;
+        return;
+    }
+
+    p = xmalloc(sizeof *p + len);
+    p->data = (char *)(p + 1);
+    memcpy(p->data, data, len);
+    p->len = len;
+    p->link = l;
+    p->fd = fd;
+    p->to = *to;
+    p->due = due;
+    p->seq = pkt_seq++;
+    heap_push(p);
+}
+
+static void relay(struct link *l, int fd, const union sock_addr *to,
+                  const char *data, size_t len, long now)
+{
+    l->in++;
+    if (l->im.loss > 0 && rnd() < l->im.loss) {
+        l->dropped++;
+        return;
+    }
+    enqueue(l, fd, to, data, len, now);
+    if (l->im.dup > 0 && rnd() < l->im.dup) {
+        l->duplicated++;
+        enqueue(l, fd, to, data, len, now);
+    }
+}
+
+static void close_session(struct session *s)
+{
+    int i;
+
+    /* Anything still queued for its sockets is dropped */
+    for (i = 0; i < nheap; i++)
+        if (heap[i]->fd == s->up_fd || heap[i]->fd == s->down_fd)
+            heap[i]->fd = -1;
+    close(s->up_fd);
+    close(s->down_fd);
+    s->used = 0;
+}
+
+static int same_addr(const union sock_addr *a, const union sock_addr *b)
+{
+    if (a->sa.sa_family != b->sa.sa_family)
+        return 0;
+    if (a->sa.sa_family == AF_INET)
+        return a->si.sin_port == b->si.sin_port &&
+            a->si.sin_addr.s_addr == b->si.sin_addr.s_addr;
+#ifdef HAVE_IPV6
+    if (a->sa.sa_family == AF_INET6)
+        return a->s6.sin6_port == b->s6.sin6_port &&
+            !memcmp(&a->s6.sin6_addr, &b->s6.sin6_addr,
+                    sizeof a->s6.sin6_addr);
+#endif
+    return 0;
+}
+
+/*
+ * A new session for each request, even from a client we know: what
+ * the server sends to a client port which has moved on to another
+ * transfer must not reach it from the same port as the new one.
+ */
+static struct session *new_session(const union sock_addr *client, long now)
+{
+    struct session *s, *free_s = NULL, *oldest = NULL;
+    union sock_addr local;
+    socklen_t len;
+    int i;
+
+    for (i = 0; i < MAX_SESSIONS; i++) {
+        s = &sessions[i];
+        if (s->used && same_addr(&s->client, client))
+            close_session(s);
+        if (!s->used) {
+            if (!free_s)
+                free_s = s;
+        } else if (!oldest || s->last < oldest->last) {
+            oldest = s;
+        }
+    }
+
+    /* When full, the client heard from least recently makes room */
+    s = free_s;
+    if (!s) {
+        s = oldest;
+        close_session(s);
+    }
+    memset(s, 0, sizeof *s);
+    s->client = *client;
+    s->up_fd = socket(server.sa.sa_family, SOCK_DGRAM, 0);
+    s->down_fd = socket(client->sa.sa_family, SOCK_DGRAM, 0);
+    if (s->up_fd < 0 || s->down_fd < 0) {
+        fprintf(stderr, "%s: socket: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    /* The transfer port the client sees, on the listening address */
+    len = sizeof local;
+    getsockname(listen_fd, &local.sa, &len);
+    sa_set_port(&local, 0);
+    if (bind(s->down_fd, &local.sa, len)) {
+        fprintf(stderr, "%s: bind: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    s->used = 1;
+    s->last = now;
+    if (verbose) {
+        char addr[INET6_ADDRSTRLEN];
+
+        inet_ntop(client->sa.sa_family, SOCKADDR_P(client), addr,
+                  sizeof addr);
+        fprintf(stderr, "%s: new session for %s port %u\n", progname,
+                addr, ntohs(SOCKPORT(client)));
+    }
+    return s;
+}
+
+static void read_socket(int fd, struct session *s, long now)
+{
+    static char buf[PKTSIZE];
+    union sock_addr from;
+    socklen_t fromlen;
+    ssize_t n;
+    unsigned short op;
+
+    for (;;) {
+        fromlen = sizeof from;
+        n = recvfrom(fd, buf, sizeof buf, MSG_DONTWAIT, &from.sa, &fromlen);
+        if (n < 0)
+            return;
+
+        if (fd == listen_fd) {
+            /* A request: always to the server's listening port */
+            s = new_session(&from, now);
+            s->last = now;
+            relay(&links[UP], s->up_fd, &server, buf, n, now);
+        } else if (fd == s->down_fd) {
+            if (!same_addr(&from, &s->client))
+                continue;
+            s->last = now;
+            op = n >= 2 ? ntohs(((struct tftphdr *)buf)->th_opcode) : 0;
+            relay(&links[UP], s->up_fd,
+                  s->have_tid && op != RRQ && op != WRQ ? &s->tid : &server,
+                  buf, n, now);
+        } else {
+            s->tid = from;
+            s->have_tid = 1;
+            s->last = now;
+            relay(&links[DOWN], s->down_fd, &s->client, buf, n, now);
+        }
+    }
+}
+
+static void catch_stop(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void report(void)
+{
+    static const char *const names[2] = { "client->server", "server->client" };
+    struct link *l;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        l = &links[i];
+        fprintf(stderr,
+                "%s: %s: %lu in, %lu out, %lu lost, %lu over the queue "
+                "limit, %lu duplicated, %lu reordered\n",
+                progname, names[i], l->in, l->out, l->dropped, l->overflow,
+                l->duplicated, l->reordered);
+    }
+}
+
+static int resolve(char *host, const char *port, union sock_addr *sa)
+{
+    char *end;
+    long n;
+    int err;
+
+    n = strtol(port, &end, 10);
+    if (*end || n < 1 || n > 65535)
+        usage();
+
+    memset(sa, 0, sizeof *sa);
+    err = set_sock_addr(host, sa, NULL);
+    if (err) {
+        fprintf(stderr, "%s: %s: %s\n", progname, host, gai_strerror(err));
+        exit(EX_NOHOST);
+    }
+    sa_set_port(sa, htons(n));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct pollfd pfd[1 + 2 * MAX_SESSIONS];
+    struct session *owner[1 + 2 * MAX_SESSIONS];
+    union sock_addr local;
+    struct pkt *p;
+    char *colon, *end, *host;
+    char any[] = "0.0.0.0";
+    double up, down;
+    long now, wait;
+    int c, n, i, one = 1;
+
+    progname = argv[0];
+
+    while ((c = getopt(argc, argv, "l:u:r:d:j:b:R:q:i:s:v")) != -1) {
+        switch (c) {
+        case 'l':
+            parse_pair(optarg, 0.01, 100, &up, &down);
+            links[UP].im.loss = up;
+            links[DOWN].im.loss = down;
+            break;
+        case 'u':
+            parse_pair(optarg, 0.01, 100, &up, &down);
+            links[UP].im.dup = up;
+            links[DOWN].im.dup = down;
+            break;
+        case 'r':
+            parse_pair(optarg, 0.01, 100, &up, &down);
+            links[UP].im.reorder = up;
+            links[DOWN].im.reorder = down;
+            break;
+        case 'd':
+            parse_pair(optarg, 1000, 1e9, &up, &down);
+            links[UP].im.delay = up;
+            links[DOWN].im.delay = down;
+            break;
+        case 'j':
+            parse_pair(optarg, 1000, 1e9, &up, &down);
+            links[UP].im.jitter = up;
+            links[DOWN].im.jitter = down;
+            break;
+        case 'b':
+            parse_pair(optarg, 1, 1e12, &up, &down);
+            links[UP].im.rate = up;
+            links[DOWN].im.rate = down;
+            break;
+        case 'R':
+            reorder_hold = strtol(optarg, &end, 10) * 1000;
+            if (*end || reorder_hold < 0)
+                usage();
+            break;
+        case 'q':
+            queue_limit = strtol(optarg, &end, 10) * 1000;
+            if (*end || queue_limit < 0)
+                usage();
+            break;
+        case 'i':
+            idle_limit = strtol(optarg, &end, 10) * 1000000;
+            if (*end || idle_limit < 1)
+                usage();
+            break;
+        case 's':
+            rng_state = strtoull(optarg, &end, 10);
+            if (*end)
+                usage();
+            if (!rng_state)
+                rng_state = 1;  /* xorshift would stay at 0 */
+            break;
+        case 'v':
+            verbose++;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind < 2 || argc - optind > 3)
+        usage();
+
+    /* [address:]port to listen on; by default every IPv4 address */
+    colon = strrchr(argv[optind], ':');
+    if (colon) {
+        *colon = '\0';
+        host = argv[optind];
+        resolve(host, colon + 1, &local);
+    } else {
+        resolve(any, argv[optind], &local);
+    }
+    resolve(argv[optind + 1], argc - optind == 3 ? argv[optind + 2] : "69",
+            &server);
+
+    listen_fd = socket(local.sa.sa_family, SOCK_DGRAM, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "%s: socket: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    if (bind(listen_fd, &local.sa, SOCKLEN(&local))) {
+        fprintf(stderr, "%s: bind: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    signal(SIGINT, catch_stop);
+    signal(SIGTERM, catch_stop);
+
+    while (!stop) {
+        now = xfer_now_us();
+
+        /* Send what is due */
+        while (nheap && heap[0]->due <= now) {
+            p = heap_pop();
+            if (p->fd >= 0 &&
+                sendto(p->fd, p->data, p->len, 0, &p->to.sa,
+                       SOCKLEN(&p->to)) >= 0)
+                p->link->out++;
+            free(p);
+        }
+
+        n = 0;
+        pfd[n].fd = listen_fd;
+        pfd[n].events = POLLIN;
+        owner[n++] = NULL;
+        for (i = 0; i < MAX_SESSIONS; i++) {
+            struct session *s = &sessions[i];
+
+            if (!s->used)
+                continue;
+            if (now - s->last > idle_limit) {
+                close_session(s);
+                continue;
+            }
+            pfd[n].fd = s->up_fd;
+            pfd[n].events = POLLIN;
+            owner[n++] = s;
+            pfd[n].fd = s->down_fd;
+            pfd[n].events = POLLIN;
+            owner[n++] = s;
+        }
+
+        wait = 1000;            /* To notice idle sessions */
+        if (nheap) {
+            wait = (heap[0]->due - now + 999) / 1000;
+            if (wait > 1000)
+                wait = 1000;
+        }
+
+        if (poll(pfd, n, wait) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "%s: poll: %s\n", progname, strerror(errno));
+            exit(EX_OSERR);
+        }
+
+        now = xfer_now_us();
+        for (i = 0; i < n; i++) {
+            struct session *s = owner[i];
+
+            if (!pfd[i].revents)
+                continue;
+            /* A request read just now may have closed this one */
+            if (s && (!s->used ||
+                      (pfd[i].fd != s->up_fd && pfd[i].fd != s->down_fd)))
+                continue;
+            read_socket(pfd[i].fd, s, now);
+        }
+    }
+
+    report();
+    return 0;
+}
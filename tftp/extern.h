@@ -44,6 +44,10 @@ extern size_t g_blocksize;          /* filled in by main */
 extern int g_s;                    /* the opened socket */
 extern int g_trace_opt;
 extern int g_verbose;
+extern int g_resume;               /* -r: continue partial downloads */
+extern int g_stripes;              /* -s: parts to fetch a file in at once */
+
+int open_socket(void);
 
 void tftp_recvfile(int, const char *, const char *, int);
 void tftp_sendfile(int, const char *, const char *, int);
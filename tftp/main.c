@@ -39,6 +39,7 @@
  * TFTP User Program -- Command Interface.
  */
 #include <sys/file.h>
+#include <sys/wait.h>
 #include <ctype.h>
 #ifdef WITH_READLINE
 #include <readline/readline.h>
@@ -56,6 +57,8 @@ size_t g_blocksize = SEGSIZE;
 int g_s = -1;
 int g_trace_opt;
 int g_verbose;
+int g_resume;
+int g_stripes = 1;
 
 struct modes {
     const char *m_name;
@@ -106,6 +109,21 @@ static int portrange = 0;
 static unsigned int portrange_from = 0;
 static unsigned int portrange_to = 0;
 static int windowsize = -1;
+static int jobs = 1;            /* -j: transfers to run at once */
+
+/* A transfer running in a child of its own, with -j */
+struct job {
+    pid_t pid;
+    int op;                     /* RRQ or WRQ */
+    char *local;                /* Local file */
+    unsigned long size;         /* WRQ: its size */
+};
+static struct job *running;
+static int nrunning;
+static unsigned long nstarted, nfailed;
+static int any_failed;          /* For the exit status with -c */
+static unsigned long long nbytes;
+static struct timeval tbatch;   /* When the first one started */
 
 static void get(int, char **);
 static void help(int, char **);
@@ -121,6 +139,7 @@ static void settrace(int, char **);
 static void setverbose(int, char **);
 static void status(int, char **);
 static void setliteral(int, char **);
+static void batch(int, char **);
 
 static void command(void);
 
@@ -128,6 +147,9 @@ static void getusage(char *);
 static void makeargv(void);
 static void putusage(char *);
 static void settftpmode(const struct modes *);
+static void transfer(int, int, const char *, const char *);
+static void finish_one(void);
+static void finish_transfers(void);
 
 #define HELPINDENT (sizeof("connect"))
 
@@ -150,6 +172,9 @@ struct cmd cmdtab[] = {
     {"get",
      "receive file",
      get},
+    {"batch",
+     "run the transfers listed in a file",
+     batch},
     {"quit",
      "exit tftp",
      quit},
@@ -193,22 +218,61 @@ char *xstrdup(const char *);
 
 static const char *program;
 
+/*
+ * If the last file received is still dallying, leave a child behind to
+ * repeat the final ACK, so that the command itself returns at once.
+ */
+static void dally_at_exit(void)
+{
+    int fd;
+
+    if (!dally_pending())
+        return;
+
+    fflush(NULL);
+    if (fork() == 0) {
+        for (fd = 0; fd < 3; fd++)
+            close(fd);
+        dally_wait();
+        _exit(0);
+    }
+}
+
 static void usage(int errcode)
 {
     fprintf(stderr,
 #ifdef HAVE_IPV6
-            "Usage: %s [-4][-6][-v][-V][-l][-m mode][-w size][-B blocksize] "
+            "Usage: %s [-4][-6][-v][-V][-l][-m mode][-w size][-B blocksize][-j jobs][-r][-s stripes][-S] "
 #else
-            "Usage: %s [-v][-V][-l][-m mode][-w size][-B blocksize] "
+            "Usage: %s [-v][-V][-l][-m mode][-w size][-B blocksize][-j jobs][-r][-s stripes][-S] "
 #endif
             "[-R port:port] [host [port]] [-c command]\n",
             program);
     exit(errcode);
 }
 
-int main(int argc, char *argv[])
+/* A socket for transfers, bound to a port in the range given by -R */
+int open_socket(void)
 {
     union sock_addr sa;
+    int s;
+
+    s = socket(ai_fam_sock, SOCK_DGRAM, 0);
+    if (s < 0) {
+        perror("tftp: socket");
+        exit(EX_OSERR);
+    }
+    bzero(&sa, sizeof(sa));
+    sa.sa.sa_family = ai_fam_sock;
+    if (pick_port_bind(s, &sa, portrange_from, portrange_to)) {
+        perror("tftp: bind");
+        exit(EX_OSERR);
+    }
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
     int arg;
     static int pargc, peerargc;
     static int iscmd = 0;
@@ -219,6 +283,7 @@ int main(int argc, char *argv[])
     program = argv[0];
 
     mode = MODE_DEFAULT;
+    atexit(dally_at_exit);
 
     peerargv[0] = argv[0];
     peerargc = 1;
@@ -299,6 +364,30 @@ int main(int argc, char *argv[])
                         exit(EX_USAGE);
                     }
                     break;
+                case 'j':
+                    if (++arg >= argc)
+                        usage(EX_USAGE);
+                    jobs = atoi(argv[arg]);
+                    if (jobs <= 0 || jobs > 256) {
+                        fprintf(stderr, "Bad number of jobs: %s (1-256)\n", argv[arg]);
+                        exit(EX_USAGE);
+                    }
+                    break;
+                case 'r':
+                    g_resume = 1;
+                    break;
+                case 's':
+                    if (++arg >= argc)
+                        usage(EX_USAGE);
+                    g_stripes = atoi(argv[arg]);
+                    if (g_stripes <= 0 || g_stripes > 64) {
+                        fprintf(stderr, "Bad number of stripes: %s (1-64)\n", argv[arg]);
+                        exit(EX_USAGE);
+                    }
+                    break;
+                case 'S':
+                    sparse_writes = 1;
+                    break;
                 case 'h':
                 default:
                     usage(*optx == 'h' ? 0 : EX_USAGE);
@@ -342,17 +431,8 @@ int main(int argc, char *argv[])
     if (ai_fam_sock == AF_UNSPEC)
         ai_fam_sock = AF_INET;
 
-    g_s = socket(ai_fam_sock, SOCK_DGRAM, 0);
-    if (g_s < 0) {
-        perror("tftp: socket");
-        exit(EX_OSERR);
-    }
-    bzero(&sa, sizeof(sa));
-    sa.sa.sa_family = ai_fam_sock;
-    if (pick_port_bind(g_s, &sa, portrange_from, portrange_to)) {
-        perror("tftp: bind");
-        exit(EX_OSERR);
-    }
+    g_s = open_socket();
+    running = xmalloc(jobs * sizeof(*running));
 
     if (iscmd && pargc) {
         /* -c specified; execute command and exit */
@@ -368,7 +448,7 @@ int main(int argc, char *argv[])
             exit(EX_USAGE);
         }
         (*c->handler) (pargc, pargv);
-        exit(0);
+        exit(any_failed ? 1 : 0);
     }
 #ifdef WITH_READLINE
 #ifdef HAVE_READLINE_HISTORY_H
@@ -376,8 +456,10 @@ int main(int argc, char *argv[])
 #endif
 #endif
 
-    if (sigsetjmp(toplevel, 1) != 0)
+    if (sigsetjmp(toplevel, 1) != 0) {
         (void)putchar('\n');
+        finish_transfers();     /* Interrupted along with us */
+    }
     command();
 
     return 0;                   /* Never reached */
@@ -457,6 +539,7 @@ void setpeer(int argc, char *argv[])
         if (ai_fam_sock != ai_fam) { /* need reopen socken for new family */
             union sock_addr sa;
 
+            dally_poll();
             close(g_s);
             ai_fam_sock = ai_fam;
             g_s = socket(ai_fam_sock, SOCK_DGRAM, 0);
@@ -617,8 +700,8 @@ void put(int argc, char *argv[])
         if (g_verbose)
             printf("putting %s to %s:%s [%s]\n",
                    cp, hostname, targ, mode->m_mode);
-        sa_set_port(&g_peeraddr, port);
-        tftp_sendfile(fd, targ, mode->m_mode, windowsize);
+        transfer(WRQ, fd, targ, cp);
+        finish_transfers();
         return;
     }
     /* this assumes the target is a directory */
@@ -649,9 +732,9 @@ void put(int argc, char *argv[])
         if (g_verbose)
             printf("putting %s to %s:%s [%s]\n",
                    argv[n], hostname, remote_pth, mode->m_mode);
-        sa_set_port(&g_peeraddr, port);
-        tftp_sendfile(fd, remote_pth, mode->m_mode, windowsize);
+        transfer(WRQ, fd, remote_pth, argv[n]);
     }
+    finish_transfers();
 }
 
 static void putusage(char *s)
@@ -660,6 +743,14 @@ static void putusage(char *s)
     printf("       %s file ... target (when already connected)\n", s);
 }
 
+/* The local file to get into; with -r, what is there is kept, to be
+   resumed from */
+static int open_dest(const char *name)
+{
+    return open(name, O_WRONLY | O_CREAT | (g_resume ? 0 : O_TRUNC) |
+                mode->m_openflags, 0666);
+}
+
 /*
  * Receive file(s).
  */
@@ -707,8 +798,7 @@ void get(int argc, char *argv[])
         }
         if (argc < 4) {
             cp = argc == 3 ? argv[2] : tail(src);
-            fd = open(cp, O_WRONLY | O_CREAT | O_TRUNC | mode->m_openflags,
-                      0666);
+            fd = open_dest(cp);
             if (fd < 0) {
                 fprintf(stderr, "tftp: ");
                 perror(cp);
@@ -717,13 +807,11 @@ void get(int argc, char *argv[])
             if (g_verbose)
                 printf("getting from %s:%s to %s [%s]\n",
                        hostname, src, cp, mode->m_mode);
-            sa_set_port(&g_peeraddr, port);
-            tftp_recvfile(fd, src, mode->m_mode, windowsize);
+            transfer(RRQ, fd, src, cp);
             break;
         }
         cp = tail(src);         /* new .. jdg */
-        fd = open(cp, O_WRONLY | O_CREAT | O_TRUNC | mode->m_openflags,
-                  0666);
+        fd = open_dest(cp);
         if (fd < 0) {
             fprintf(stderr, "tftp: ");
             perror(cp);
@@ -732,9 +820,9 @@ void get(int argc, char *argv[])
         if (g_verbose)
             printf("getting from %s:%s to %s [%s]\n",
                    hostname, src, cp, mode->m_mode);
-        sa_set_port(&g_peeraddr, port);
-        tftp_recvfile(fd, src, mode->m_mode, windowsize);
+        transfer(RRQ, fd, src, cp);
     }
+    finish_transfers();
 }
 
 static void getusage(char *s)
@@ -743,6 +831,204 @@ static void getusage(char *s)
     printf("       %s file file ... file if connected\n", s);
 }
 
+/*
+ * Run a transfer to or from fd, which is closed afterwards.  With -j,
+ * it runs in a child of its own, on a socket of its own, while the
+ * next is started; finish_transfers() waits for them all.
+ */
+static void transfer(int op, int fd, const char *remote, const char *local)
+{
+    struct job *j;
+    struct stat st;
+    pid_t pid;
+
+    sa_set_port(&g_peeraddr, port);
+    if (jobs <= 1) {
+        if (op == RRQ)
+            tftp_recvfile(fd, remote, mode->m_mode, windowsize);
+        else
+            tftp_sendfile(fd, remote, mode->m_mode, windowsize);
+        return;
+    }
+
+    while (nrunning >= jobs)
+        finish_one();
+
+    if (!nstarted)
+        gettimeofday(&tbatch, NULL);
+    fflush(NULL);
+    pid = fork();
+    if (pid < 0) {
+        perror("tftp: fork");
+        close(fd);
+        nfailed++;
+        any_failed = 1;
+        return;
+    }
+    if (pid == 0) {
+        bsd_signal(SIGINT, SIG_DFL);
+        close(g_s);
+        g_s = open_socket();
+        if (op == RRQ)
+            tftp_recvfile(fd, remote, mode->m_mode, windowsize);
+        else
+            tftp_sendfile(fd, remote, mode->m_mode, windowsize);
+        exit(0);                /* Leaving any dally to a child of ours */
+    }
+
+    j = &running[nrunning++];
+    j->pid = pid;
+    j->op = op;
+    j->local = xstrdup(local);
+    j->size = op == WRQ && !fstat(fd, &st) ? (unsigned long)st.st_size : 0;
+    close(fd);
+    nstarted++;
+}
+
+/* Wait for one transfer started by transfer() to end */
+static void finish_one(void)
+{
+    struct job *j;
+    struct stat st;
+    pid_t pid;
+    int status;
+
+    do {
+        pid = wait(&status);
+    } while (pid < 0 && errno == EINTR);
+    if (pid < 0) {
+        nrunning = 0;           /* None left, somehow */
+        return;
+    }
+
+    for (j = running; j < running + nrunning; j++)
+        if (j->pid == pid)
+            break;
+    if (j == running + nrunning)
+        return;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        nfailed++;
+        any_failed = 1;
+    } else if (j->op == WRQ) {
+        nbytes += j->size;
+    } else if (!stat(j->local, &st)) {
+        nbytes += st.st_size;
+    }
+    free(j->local);
+    *j = running[--nrunning];
+}
+
+/* Wait for the transfers still running, and report on them all */
+static void finish_transfers(void)
+{
+    struct timeval now;
+    double delta;
+
+    if (!nstarted)
+        return;
+    while (nrunning)
+        finish_one();
+
+    gettimeofday(&now, NULL);
+    delta = (now.tv_sec + now.tv_usec / 1000000.0) -
+        (tbatch.tv_sec + tbatch.tv_usec / 1000000.0);
+    printf("%lu of %lu transfers done, %llu bytes in %.1f seconds",
+           nstarted - nfailed, nstarted, nbytes, delta);
+    if (delta > 0)
+        printf(" [%.0f bit/s]", nbytes * 8. / delta);
+    putchar('\n');
+
+    nstarted = nfailed = 0;
+    nbytes = 0;
+}
+
+/*
+ * Run the transfers listed in a file, one to a line:
+ *
+ *   get remotefile [localfile]
+ *   put localfile [remotefile]
+ *
+ * Blank lines and lines starting with # are skipped.
+ */
+void batch(int argc, char *argv[])
+{
+    char buf[LBUFLEN * 4];
+    char *op, *from, *to;
+    unsigned long lineno = 0;
+    FILE *f;
+    int fd;
+
+    if (argc < 2) {
+        getmoreargs("batch ", "(manifest) ");
+        makeargv();
+        argc = margc;
+        argv = margv;
+    }
+    if (argc != 2) {
+        printf("usage: %s manifest\n", argv[0]);
+        return;
+    }
+    if (!connected) {
+        printf("No target machine specified.\n");
+        return;
+    }
+    f = fopen(argv[1], "r");
+    if (!f) {
+        fprintf(stderr, "tftp: ");
+        perror(argv[1]);
+        any_failed = 1;
+        return;
+    }
+
+    while (fgets(buf, sizeof buf, f)) {
+        lineno++;
+        op = strtok(buf, " \t\r\n");
+        if (!op || *op == '#')
+            continue;
+        from = strtok(NULL, " \t\r\n");
+        to = strtok(NULL, " \t\r\n");
+        if (!from || strtok(NULL, " \t\r\n") ||
+            (strcmp(op, "get") && strcmp(op, "put"))) {
+            fprintf(stderr, "tftp: %s:%lu: bad line\n", argv[1], lineno);
+            any_failed = 1;
+            continue;
+        }
+
+        if (!strcmp(op, "get")) {
+            if (!to)
+                to = tail(from);
+            fd = open_dest(to);
+            if (fd < 0) {
+                fprintf(stderr, "tftp: ");
+                perror(to);
+                any_failed = 1;
+                continue;
+            }
+            if (g_verbose)
+                printf("getting from %s:%s to %s [%s]\n",
+                       hostname, from, to, mode->m_mode);
+            transfer(RRQ, fd, from, to);
+        } else {
+            if (!to)
+                to = tail(from);
+            fd = open(from, O_RDONLY | mode->m_openflags);
+            if (fd < 0) {
+                fprintf(stderr, "tftp: ");
+                perror(from);
+                any_failed = 1;
+                continue;
+            }
+            if (g_verbose)
+                printf("putting %s to %s:%s [%s]\n",
+                       from, hostname, to, mode->m_mode);
+            transfer(WRQ, fd, to, from);
+        }
+    }
+    fclose(f);
+    finish_transfers();
+}
+
 static int rexmtval = RTIMEOUT;
 
 void setrexmt(int argc, char *argv[])
@@ -811,6 +1097,8 @@ void status(int argc, char *argv[])
     printf("Rexmt-interval: %d seconds, Max-timeout: %d seconds\n",
            rexmtval, maxtimeout);
     printf("Blocksize: %lu, windowsize: %d\n", g_blocksize, (windowsize > 0 ? windowsize : 1));
+    printf("Jobs: %d, stripes: %d, resume: %s, sparse: %s\n", jobs,
+           g_stripes, g_resume ? "on" : "off", sparse_writes ? "on" : "off");
 }
 
 void intr(int sig)
@@ -854,11 +1142,24 @@ static void command(void)
             free(remote_pth);
             remote_pth = NULL;
         }
+        if (dally_pending() && isatty(fileno(stdin))) {
+            /* Prompt now, and go on dallying until there is a command */
+            fputs(prompt, stdout);
+            fflush(stdout);
+            dally_until_input(fileno(stdin));
+            rl_already_prompted = 1;
+        }
         line = readline(prompt);
+        rl_already_prompted = 0;
         if (!line)
             exit(0);            /* EOF */
 #else
         fputs(prompt, stdout);
+        if (dally_pending() && isatty(fileno(stdin))) {
+            /* Go on dallying until there is a command */
+            fflush(stdout);
+            dally_until_input(fileno(stdin));
+        }
         if (fgets(line, LBUFLEN, stdin) == 0) {
             if (feof(stdin)) {
                 exit(0);
@@ -35,6 +35,7 @@
 
 #include <stdarg.h>
 #include <poll.h>
+#include <sys/wait.h>
 
 static char pktbuf[PKTSIZE];
 
@@ -47,68 +48,6 @@ static void timed_out(void)
     exit(1);
 }
 
-static size_t make_request(unsigned short opcode,
-                           const char *name,
-                           const char *mode,
-                           size_t blocksize,
-                           int windowsize,
-                           size_t tsize,
-                           struct tftphdr *out)
-{
-    char *cp, buf[16];
-    size_t len;
-
-    cp = (char *)&(out->th_stuff);
-
-    out->th_opcode = htons(opcode);
-
-    len = strlen(name) + 1;
-    memcpy(cp, name, len);
-    cp += len;
-
-    len = strlen(mode) + 1;
-    memcpy(cp, mode, len);
-    cp += len;
-
-    /* Don't include options with default values. */
-
-    if (blocksize != SEGSIZE) {
-        len = strlen("blksize") + 1;
-        memcpy(cp, "blksize", len);
-        cp += len;
-        if (snprintf(buf, 16, "%lu", blocksize) < 0)
-            die("out of memory");
-        len = strlen(buf) + 1;
-        memcpy(cp, buf, len);
-        cp += len;
-    }
-
-    if (windowsize > 0) {
-        len = strlen("windowsize") + 1;
-        memcpy(cp, "windowsize", len);
-        cp += len;
-        if (snprintf(buf, 16, "%u", windowsize) < 0)
-            die("out of memory");
-        len = strlen(buf) + 1;
-        memcpy(cp, buf, len);
-        cp += len;
-    }
-
-    {
-        len = strlen("tsize") + 1;
-        memcpy(cp, "tsize", len);
-        cp += len;
-        if (snprintf(buf, 16, "%zu", tsize) < 0)
-            die("out of memory");
-        printf("client: option request tsize:%s\n", buf);
-        len = strlen(buf) + 1;
-        memcpy(cp, buf, len);
-        cp += len;
-    }
-
-    return (cp - (char *)out);
-}
-
 static void send_request(int sock,
                          union sock_addr *to,
                          short request,
@@ -116,13 +55,21 @@ static void send_request(int sock,
                          const char *mode,
                          size_t blocksize,
                          unsigned windowsize,
-                         size_t tsize)
+                         size_t tsize,
+                         off_t offset,
+                         off_t length)
 {
     struct tftphdr *out;
     size_t size;
 
+    dally_poll();               /* Done with the previous transfer */
+
     out = (struct tftphdr *)pktbuf;
-    size = make_request(request, name, mode, blocksize, windowsize, tsize, out);
+    size = make_request(request, name, mode, blocksize, windowsize, tsize,
+                        offset, length, out, sizeof(pktbuf));
+    if (!size)
+        die("send_request: %s: name too long", name);
+    printf("client: option request tsize:%zu\n", tsize);
 
     if (sendto(sock, out, size, 0, &to->sa, SOCKLEN(to)) != (unsigned)size)
         die("send_request: sendto: %s", strerror(errno));
@@ -168,6 +115,7 @@ struct option_values {
     int windowsize;
     size_t blocksize;
     size_t tsize;
+    off_t offset;       /* As the server took it up, or -1 */
 };
 
 static int tftp_parse_oack(int sock, union sock_addr *from, struct option_values *def)
@@ -210,6 +158,9 @@ static int tftp_parse_oack(int sock, union sock_addr *from, struct option_values
                     def->blocksize = bs;
                 }
 
+                if (str_equal(opt, "offset"))
+                    def->offset = strtoumax(val, NULL, 10);
+
                 if (str_equal(opt, "tsize")) {
                     size_t ts = strtoumax(val, NULL, 10);
                     printf("client: server negotiated tsize: %zu\n", ts);
@@ -248,7 +199,8 @@ void tftp_sendfile(int fd, const char *name, const char *mode, int windowsize)
     set_verbose(g_trace_opt + g_verbose);
 
     startclock();
-    send_request(g_s, &server, WRQ, name, mode, blocksize, windowsize, tsize);
+    send_request(g_s, &server, WRQ, name, mode, blocksize, windowsize, tsize,
+                 -1, 0);
 
 #if 0
     /* If no windowsize was specified on the command line,
@@ -260,7 +212,7 @@ void tftp_sendfile(int fd, const char *name, const char *mode, int windowsize)
         goto no_options;
 #endif
 
-    struct option_values values = {windowsize, blocksize, tsize};
+    struct option_values values = {windowsize, blocksize, tsize, -1};
     int ok = tftp_parse_oack(g_s, &server, &values);
     if (!ok) return;
 
@@ -288,7 +240,7 @@ void tftp_sendfile(int fd, const char *name, const char *mode, int windowsize)
 #endif
 
     fp = fdopen(fd, "r");
-    int r = sender(g_s, &server, values.blocksize, values.windowsize, TIMEOUT, 0, fp, &amount);
+    int r = sender(g_s, &server, values.blocksize, values.windowsize, TIMEOUT, 0, fp, -1, &amount, NULL);
     if (r < 0)
         exit(1);
 
@@ -299,7 +251,154 @@ void tftp_sendfile(int fd, const char *name, const char *mode, int windowsize)
 }
 
 /*
- * Receive a file.
+ * Receive one part of a file into the same part of fd, in a child of
+ * recv_parts(), on a socket of its own.
+ */
+static void recv_part(int fd, const char *name, const char *mode,
+                      const struct option_values *def, off_t offset,
+                      off_t length)
+{
+    union sock_addr server = g_peeraddr;
+    struct option_values values = *def;
+    unsigned long amount = 0;
+    char error[ERROR_MAXLEN] = {};
+    FILE *fp;
+    int r;
+
+    close(g_s);
+    g_s = open_socket();
+
+    values.offset = -1;
+    send_request(g_s, &server, RRQ, name, mode, def->blocksize,
+                 def->windowsize, 0, offset, length);
+    if (!tftp_parse_oack(g_s, &server, &values) || values.offset != offset)
+        die("client: server did not start at offset %jd", (intmax_t)offset);
+    send_ack(g_s, &server, 0);
+
+    fp = fdopen(fd, "w");
+    r = receiver(g_s, &server, values.blocksize, values.windowsize, TIMEOUT,
+                 fp, offset, length, &amount, error, NULL);
+    if (r < 0) {
+        fprintf(stderr, "client: %s\n", error);
+        exit(1);
+    }
+    if ((off_t)amount != length)
+        die("client: part at %jd ended after %lu of %jd bytes",
+            (intmax_t)offset, amount, (intmax_t)length);
+    fclose(fp);
+}
+
+static pid_t part_pids[64];     /* The most g_stripes can be */
+static int part_count;
+static volatile sig_atomic_t parts_stopped;
+
+/* Stop the parts, and let the parent tidy up after them */
+static void stop_parts(int sig)
+{
+    int i;
+
+    (void)sig;
+    parts_stopped = 1;
+    for (i = 0; i < part_count; i++)
+        if (part_pids[i] > 0)
+            kill(part_pids[i], SIGTERM);
+}
+
+/*
+ * Fetch a file of known size in g_stripes parts at once, each in a
+ * child of its own, writing into its own stretch of the file.
+ *
+ * The file only grows as the parts are written, and if any of them
+ * does not finish it is cut back to the end of the parts before it
+ * which did, so that -r carries on from there rather than taking a
+ * file with holes in it for a whole one.
+ */
+static void recv_parts(int fd, const char *name, const char *mode,
+                       const struct option_values *def)
+{
+    off_t size = def->tsize, part, offset, good;
+    int status, i, nparts = 0, failed = 0;
+    void (*old_int)(int), (*old_term)(int);
+    pid_t pid;
+
+    /* Whole blocks to each but the last */
+    part = (size / g_stripes + def->blocksize - 1) / def->blocksize *
+        def->blocksize;
+
+    /* Room for the whole of it, without yet making it that long */
+    if (preallocate(fd, 0, size))
+        die("client: no room for %s: %s", name, strerror(errno));
+
+    fflush(NULL);
+    old_int = bsd_signal(SIGINT, stop_parts);
+    old_term = bsd_signal(SIGTERM, stop_parts);
+    part_count = 0;
+    parts_stopped = 0;
+    for (offset = 0; offset < size && !parts_stopped; offset += part) {
+        pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "client: fork: %s\n", strerror(errno));
+            break;
+        }
+        if (pid == 0) {
+            bsd_signal(SIGINT, SIG_DFL);
+            bsd_signal(SIGTERM, SIG_DFL);
+            recv_part(fd, name, mode, def, offset,
+                      size - offset < part ? size - offset : part);
+            exit(0);
+        }
+        part_pids[part_count++] = pid;
+        nparts++;
+    }
+
+    while (nparts > 0) {
+        pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (i = 0; i < part_count; i++) {
+            if (part_pids[i] != pid)
+                continue;
+            if (WIFEXITED(status) && !WEXITSTATUS(status))
+                part_pids[i] = 0;       /* Done */
+            else
+                part_pids[i] = -1;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            failed++;
+        nparts--;
+    }
+    if (offset < size)
+        failed++;               /* Not all of them were started */
+    bsd_signal(SIGINT, old_int);
+    bsd_signal(SIGTERM, old_term);
+
+    if (failed) {
+        /* Up to the first part which is not all there */
+        for (i = 0, good = 0; i < part_count && !part_pids[i]; i++)
+            good += part;
+        if (ftruncate(fd, good < size ? good : size))
+            fprintf(stderr, "client: %s: %s\n", name, strerror(errno));
+        fprintf(stderr, "client: %d of the parts of %s failed\n", failed,
+                name);
+        exit(1);
+    }
+    if (ftruncate(fd, size))
+        die("client: %s", strerror(errno));
+
+    stopclock();
+    printstats("Received", size);
+    close(fd);
+}
+
+/*
+ * Receive a file.  With g_resume, a file which is there already is
+ * taken to be the start of this one, and only the rest is fetched;
+ * with g_stripes, the file is fetched in that many parts at once.
+ * Both need a server which takes up the "offset" option, and fall back
+ * to fetching the whole file in one go if it does not.
  */
 void tftp_recvfile(int fd, const char *name, const char *mode, int windowsize)
 {
@@ -309,11 +408,23 @@ void tftp_recvfile(int fd, const char *name, const char *mode, int windowsize)
     char error[ERROR_MAXLEN] = {};
     FILE *fp;
     size_t tsize = 0;
+    off_t offset = -1, start;
 
     set_verbose(g_trace_opt + g_verbose);
 
+    /* Offsets in the file and in a netascii transfer are not the same */
+    if (!strcmp(mode, "octet")) {
+        if (g_resume)
+            offset = lseek(fd, 0, SEEK_END);
+        if (offset <= 0 && g_stripes > 1)
+            offset = 0;         /* To ask whether we can */
+        else if (offset == 0)
+            offset = -1;
+    }
+
     startclock();
-    send_request(g_s, &server, RRQ, name, mode, blocksize, windowsize, tsize);
+    send_request(g_s, &server, RRQ, name, mode, blocksize, windowsize, tsize,
+                 offset, 0);
 
 #if 0
     /* If no windowsize was specified on the command line,
@@ -325,10 +436,27 @@ void tftp_recvfile(int fd, const char *name, const char *mode, int windowsize)
         goto no_options;
 #endif
 
-    struct option_values values = {windowsize, blocksize, tsize};
+    struct option_values values = {windowsize, blocksize, tsize, -1};
     int ok = tftp_parse_oack(g_s, &server, &values);
     if (!ok) return;
 
+    if (offset == 0 && values.offset == 0 &&
+        values.tsize >= (size_t)g_stripes * values.blocksize) {
+        /* Turn down this one's options (RFC 2347), which tells the
+           server nothing went wrong, and fetch the file in parts */
+        send_error_code(g_s, &server, EOPTNEG, "Fetching in parts");
+        recv_parts(fd, name, mode, &values);
+        return;
+    }
+    if (offset > 0) {
+        if (values.offset == offset) {
+            if (g_verbose)
+                printf("resuming %s at %jd bytes\n", name, (intmax_t)offset);
+        } else if (ftruncate(fd, 0) || lseek(fd, 0, SEEK_SET)) {
+            die("client: %s", strerror(errno));
+        }
+    }
+
 #if 0
 //XXX no_options:
     if (!ok) {
@@ -352,10 +480,21 @@ void tftp_recvfile(int fd, const char *name, const char *mode, int windowsize)
     }
 #endif
 
+    /* Room for the rest of the file, if we know how much that is, before
+       any of it comes; then it is written in large pieces where it goes */
+    start = lseek(fd, 0, SEEK_CUR);
+    if (start >= 0 && (off_t)values.tsize > start &&
+        preallocate(fd, start, values.tsize - start)) {
+        send_error(g_s, &server, "Disk full");
+        die("client: no room for %s: %s", name, strerror(errno));
+    }
+
     send_ack(g_s, &server, 0);
 
     fp = fdopen(fd, "w");
-    int r = receiver(g_s, &server, values.blocksize, values.windowsize, TIMEOUT, fp, &amount, error);
+    int r = receiver(g_s, &server, values.blocksize, values.windowsize, TIMEOUT, fp, start,
+                     start >= 0 && (off_t)values.tsize > start ?
+                     (off_t)values.tsize - start : -1, &amount, error, NULL);
     if (r < 0) {
         fprintf(stderr, "client: %s\n", error);
         exit(1);
@@ -0,0 +1,371 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * alog.c
+ *
+ * Asynchronous logging for --async-log.  syslog() is a blocking send to
+ * /dev/log, so a syslog daemon which falls behind stalls every transfer
+ * that logs something.  Instead, alog() formats the message and puts it
+ * in a bounded queue in shared memory, from which a separate process
+ * passes it on to syslog.
+ *
+ * The queue is a ring of slots, each with a sequence number which says
+ * whether it is free for the writer with a given position or holds the
+ * message for the reader at a given position.  A writer claims a
+ * position with a compare-and-swap on the tail, then the slot itself by
+ * putting its pid in the slot's owner, checks that the slot is still
+ * the one for its position, fills it in and publishes it with a
+ * compare-and-swap against that position; when the ring is full the
+ * message is counted as dropped instead.  Nothing ever waits for a
+ * lock, so a process which dies halfway through cannot hold up the
+ * others: the reader skips a slot which stays unpublished for too long,
+ * once no live process owns it.  A writer is never left filling in a
+ * slot which has been given to someone else.
+ *
+ * The reader also rate limits each kind of message, as told apart by
+ * its format string, and reports how many were dropped or suppressed.
+ */
+
+#include "tftpd.h"
+#include "alog.h"
+#include "../common/xfer.h"
+
+#include <syslog.h>
+#include <stdarg.h>
+#include <poll.h>
+
+#define ALOG_MSGLEN     480     /* Longest message, with the NUL */
+
+#ifdef HAVE_ATOMIC_BUILTINS
+
+#define ALOG_SLOTS      1024    /* Must be a power of two */
+#define ALOG_RATE       100     /* Messages per second of each kind... */
+#define ALOG_BURST      200     /* ...after a burst of this many */
+#define ALOG_KINDS      64      /* Kinds rate limited; a power of two */
+#define ALOG_STUCK      1000    /* ms before skipping an unfinished slot */
+
+struct alog_slot {
+    unsigned long seq;
+    pid_t owner;                /* Writer filling it in, -1 for the
+                                   reader giving up on it, or 0 */
+    const char *fmt;            /* Kind of message */
+    pid_t pid;
+    int prio;
+    char msg[ALOG_MSGLEN];
+};
+
+struct alog_queue {
+    unsigned long tail;         /* Next position to claim */
+    unsigned long dropped;      /* Messages lost to a full queue */
+    int sleeping;               /* The reader wants a wakeup */
+    struct alog_slot slot[ALOG_SLOTS];
+};
+
+struct alog_kind {
+    const char *fmt;
+    long tokens;                /* In thousandths of a message */
+    long last;                  /* xfer_now() when last refilled */
+    unsigned long suppressed;
+};
+
+static struct alog_queue *queue;
+static int wake_fd = -1;
+
+#endif
+
+/* Copy fmt, replacing %m with the error message like syslog() does */
+static void expand_m(char *out, size_t size, const char *fmt, int err)
+{
+    const char *s;
+    size_t n = 0, len;
+
+    while (*fmt && n + 1 < size) {
+        if (fmt[0] == '%' && fmt[1] == 'm') {
+            for (s = strerror(err); *s && n + 2 < size; s++) {
+                if (*s == '%')
+                    out[n++] = '%';
+                out[n++] = *s;
+            }
+            fmt += 2;
+        } else if (fmt[0] == '%') {
+            /* A whole conversion or none of it, never a stray '%' */
+            len = 2 + strspn(fmt + 1, "-+ #'0123456789.*hlLqjzt");
+            if (!fmt[len - 1] || n + len >= size)
+                break;
+            memcpy(out + n, fmt, len);
+            n += len;
+            fmt += len;
+        } else {
+            out[n++] = *fmt++;
+        }
+    }
+    out[n] = '\0';
+}
+
+#ifdef HAVE_ATOMIC_BUILTINS
+
+static void enqueue(int prio, const char *fmt, const char *msg)
+{
+    struct alog_queue *q = queue;
+    struct alog_slot *s;
+    unsigned long pos, expected;
+    pid_t me = getpid(), nobody;
+    long dif;
+
+    pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        s = &q->slot[pos & (ALOG_SLOTS - 1)];
+        dif = (long)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            __atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
+            return;             /* Full */
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* Own the slot, unless the reader has given up on it meanwhile
+       (and counted the message as dropped) */
+    nobody = 0;
+    if (!__atomic_compare_exchange_n(&s->owner, &nobody, me, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return;
+    if (__atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) != pos) {
+        __atomic_store_n(&s->owner, 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+    s->fmt = fmt;
+    s->pid = me;
+    s->prio = prio;
+    memcpy(s->msg, msg, strlen(msg) + 1);
+    __atomic_store_n(&s->owner, 0, __ATOMIC_RELEASE);
+
+    /* This only fails if the reader has given up on the slot since */
+    expected = pos;
+    __atomic_compare_exchange_n(&s->seq, &expected, pos + 1, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+
+    if (__atomic_exchange_n(&q->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        if (write(wake_fd, "", 1) < 0) {
+            /* The pipe is full, so the reader is awake anyway */
+        }
+    }
+}
+
+/* Returns nonzero if a message of this kind may be logged now */
+static int rate_ok(struct alog_kind *kinds, const char *fmt, long now)
+{
+    struct alog_kind *k;
+    unsigned int h, i;
+
+    h = (unsigned int)((uintptr_t)fmt >> 3) * 2654435761U;
+    for (i = 0; i < ALOG_KINDS; i++) {
+        k = &kinds[(h + i) & (ALOG_KINDS - 1)];
+        if (k->fmt == fmt)
+            break;
+        if (!k->fmt) {
+            k->fmt = fmt;
+            k->tokens = ALOG_BURST * 1000L;
+            k->last = now;
+            break;
+        }
+    }
+    if (i == ALOG_KINDS)
+        return 1;               /* Too many kinds to keep track of */
+
+    k->tokens += (now - k->last) * ALOG_RATE;
+    if (k->tokens > ALOG_BURST * 1000L)
+        k->tokens = ALOG_BURST * 1000L;
+    k->last = now;
+
+    if (k->tokens < 1000) {
+        k->suppressed++;
+        return 0;
+    }
+    k->tokens -= 1000;
+    return 1;
+}
+
+static void report(struct alog_kind *kinds, unsigned long *dropped)
+{
+    unsigned long d;
+    int i;
+
+    d = __atomic_load_n(&queue->dropped, __ATOMIC_RELAXED);
+    if (d != *dropped) {
+        syslog(LOG_WARNING, "log queue full, %lu messages dropped",
+               d - *dropped);
+        *dropped = d;
+    }
+
+    for (i = 0; i < ALOG_KINDS; i++) {
+        if (kinds[i].suppressed) {
+            syslog(LOG_NOTICE, "%lu messages suppressed like \"%s\"",
+                   kinds[i].suppressed, kinds[i].fmt);
+            kinds[i].suppressed = 0;
+        }
+    }
+}
+
+/* The logging process: pass the queue on to syslog until every writer
+   has closed the pipe */
+static void reader(int rfd)
+{
+    static struct alog_kind kinds[ALOG_KINDS];
+    struct alog_queue *q = queue;
+    struct alog_slot *s;
+    unsigned long head = 0, dropped = 0, seq, expected;
+    pid_t owner;
+    long now, stuck = 0, last_report = 0;
+    struct pollfd pfd;
+    char junk[64];
+    int eof = 0;
+
+    for (;;) {
+        now = xfer_now();
+        s = &q->slot[head & (ALOG_SLOTS - 1)];
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == head + 1) {
+            if (rate_ok(kinds, s->fmt, now))
+                syslog(s->prio, "[%d] %s", (int)s->pid, s->msg);
+            __atomic_store_n(&s->seq, head + ALOG_SLOTS, __ATOMIC_RELEASE);
+            head++;
+            stuck = 0;
+            continue;
+        }
+
+        if (__atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) != head) {
+            /* Claimed but not yet published */
+            owner = __atomic_load_n(&s->owner, __ATOMIC_SEQ_CST);
+            if (!stuck) {
+                stuck = now;
+            } else if (now - stuck > ALOG_STUCK &&
+                       (owner <= 0 || (kill(owner, 0) && errno == ESRCH)) &&
+                       __atomic_compare_exchange_n(&s->owner, &owner, -1, 0,
+                                                   __ATOMIC_SEQ_CST,
+                                                   __ATOMIC_RELAXED)) {
+                /* Nobody is filling it in, so it can be given up on */
+                expected = head;
+                if (__atomic_compare_exchange_n(&s->seq, &expected,
+                                                head + ALOG_SLOTS, 0,
+                                                __ATOMIC_SEQ_CST,
+                                                __ATOMIC_RELAXED)) {
+                    __atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
+                    head++;
+                }
+                __atomic_store_n(&s->owner, 0, __ATOMIC_RELEASE);
+                stuck = 0;
+                continue;
+            }
+            poll(NULL, 0, 1);
+            continue;
+        }
+
+        if (now - last_report >= 1000) {
+            report(kinds, &dropped);
+            last_report = now;
+        }
+
+        if (eof)
+            exit(0);
+
+        /* Ask to be woken, then make sure nothing came in meanwhile */
+        __atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) != head) {
+            __atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        pfd.fd = rfd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1000) > 0 && read(rfd, junk, sizeof junk) == 0) {
+            /* Everyone is gone; one last pass and a final report */
+            eof = 1;
+            last_report = now - 1000;
+        }
+    }
+}
+
+int alog_start(const struct passwd *pw)
+{
+    struct alog_queue *q;
+    int p[2], i;
+    pid_t pid;
+
+    q = shm_alloc(sizeof *q);
+    if (!q)
+        return -1;
+    for (i = 0; i < ALOG_SLOTS; i++)
+        q->slot[i].seq = i;
+
+    if (pipe(p))
+        return -1;
+
+    pid = fork();
+    if (pid < 0) {
+        close(p[0]);
+        close(p[1]);
+        return -1;
+    } else if (pid == 0) {
+        close(p[1]);
+        detach_helper(pw, "log process");
+
+        queue = q;
+        reader(p[0]);
+        exit(0);
+    }
+
+    close(p[0]);
+    fcntl(p[1], F_SETFL, fcntl(p[1], F_GETFL) | O_NONBLOCK);
+    wake_fd = p[1];
+    queue = q;
+    return 0;
+}
+
+#else
+
+int alog_start(const struct passwd *pw)
+{
+    (void)pw;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
+
+void alog(int prio, const char *fmt, ...)
+{
+    char xfmt[ALOG_MSGLEN], msg[ALOG_MSGLEN];
+    int err = errno;
+    va_list ap;
+
+    expand_m(xfmt, sizeof xfmt, fmt, err);
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof msg, xfmt, ap);
+    va_end(ap);
+
+#ifdef HAVE_ATOMIC_BUILTINS
+    if (queue) {
+        enqueue(prio, fmt, msg);
+        errno = err;
+        return;
+    }
+#endif
+    syslog(prio, "%s", msg);
+    errno = err;
+}
@@ -0,0 +1,37 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * alog.h
+ *
+ * Asynchronous logging for --async-log: the processes serving requests
+ * put their messages in a queue in shared memory, and a separate process
+ * passes them on to syslog.
+ */
+
+#ifndef TFTPD_ALOG_H
+#define TFTPD_ALOG_H
+
+#include <pwd.h>
+
+/* Start the logging process, which runs as the given user.  Returns 0,
+   or -1 if asynchronous logging is not available; alog() then just
+   calls syslog(). */
+int alog_start(const struct passwd *pw);
+
+/* Like syslog(), but never blocks.  Messages are dropped if the queue
+   is full, and messages with the same format are rate limited. */
+void alog(int prio, const char *fmt, ...)
+#ifdef __GNUC__
+    __attribute__ ((format(printf, 2, 3)))
+#endif
+    ;
+
+#endif                          /* TFTPD_ALOG_H */
@@ -0,0 +1,160 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * beneath.c
+ *
+ * Open a file relative to a directory descriptor, refusing to resolve
+ * anything outside of that directory.  Used by --early-drop, where the
+ * served directories are opened once at startup instead of checking
+ * path prefixes on every request.
+ */
+
+#include "tftpd.h"
+
+#include <limits.h>
+#ifdef HAVE_LINUX_OPENAT2_H
+#include <linux/openat2.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+#if defined(HAVE_LINUX_OPENAT2_H) && defined(SYS_openat2)
+/*
+ * Let the kernel do it.  Returns -1 with errno == ENOSYS if this kernel
+ * predates openat2(), in which case the caller falls back to walking the
+ * path by hand.
+ */
+static int openat2_beneath(int dirfd, const char *path, int flags,
+                           mode_t mode)
+{
+    struct open_how how;
+
+    memset(&how, 0, sizeof how);
+    how.flags = flags;
+    how.mode = (flags & O_CREAT) ? mode : 0;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+    return syscall(SYS_openat2, dirfd, path, &how, sizeof how);
+}
+#endif
+
+#ifdef HAVE_OPENAT
+/*
+ * Walk the path one component at a time.  This is stricter than
+ * RESOLVE_BENEATH: ".." and symbolic links are refused outright rather
+ * than being followed as long as they stay below dirfd.
+ */
+static int walk_beneath(int dirfd, const char *path, int flags, mode_t mode)
+{
+    char name[PATH_MAX];
+    const char *p, *q;
+    size_t len;
+    int fd = dirfd;
+    int nfd, err;
+
+    p = path;
+    for (;;) {
+        while (*p == '/')
+            p++;
+
+        q = p;
+        while (*q && *q != '/')
+            q++;
+        len = q - p;
+
+        while (*q == '/')
+            q++;
+
+        if (len >= sizeof name) {
+            err = ENAMETOOLONG;
+            goto fail;
+        }
+        memcpy(name, p, len);
+        name[len] = '\0';
+
+        if (!strcmp(name, "..")) {
+            err = EXDEV;
+            goto fail;
+        }
+
+        if (!*q) {
+            /* Last component: this is the file itself */
+            nfd = openat(fd, len ? name : ".", flags | O_NOFOLLOW, mode);
+            err = errno;
+            if (fd != dirfd)
+                close(fd);
+            errno = err;
+            return nfd;
+        }
+
+        nfd = openat(fd, len ? name : ".",
+                     O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (nfd < 0) {
+            err = errno;
+            goto fail;
+        }
+        if (fd != dirfd)
+            close(fd);
+        fd = nfd;
+        p = q;
+    }
+
+fail:
+    if (fd != dirfd)
+        close(fd);
+    errno = err;
+    return -1;
+}
+#else
+static int walk_beneath(int dirfd, const char *path, int flags, mode_t mode)
+{
+    (void)dirfd;
+    (void)path;
+    (void)flags;
+    (void)mode;
+    errno = ENOSYS;
+    return -1;
+}
+#endif
+
+/*
+ * Open "path" relative to "dirfd", failing with EXDEV if the path
+ * would resolve to something outside of it.  Leading slashes are
+ * ignored, so an absolute name is taken relative to dirfd too.
+ */
+int open_beneath(int dirfd, const char *path, int flags, mode_t mode)
+{
+    while (*path == '/')
+        path++;
+
+#if defined(HAVE_LINUX_OPENAT2_H) && defined(SYS_openat2)
+    {
+        static int have_openat2 = 1;
+
+        if (have_openat2) {
+            int fd = openat2_beneath(dirfd, *path ? path : ".", flags, mode);
+            if (fd >= 0 || errno != ENOSYS)
+                return fd;
+            have_openat2 = 0;
+        }
+    }
+#endif
+
+    return walk_beneath(dirfd, path, flags, mode);
+}
@@ -0,0 +1,349 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * control.c
+ *
+ * Control socket for --control.  Each process serving a transfer claims
+ * an entry in a table in shared memory, by swapping its pid into a free
+ * one, and points xfer_live at it: the transfer engine keeps the
+ * counters there up to date, and checks the entry for a cancellation
+ * or a rate limit every time around its loop.  A separate process,
+ * forked like the log process, reads the table and sets those fields
+ * on request.
+ *
+ * An entry left behind by a process that died is freed the next time
+ * the table is listed.
+ */
+
+#include "tftpd.h"
+#include "control.h"
+#include "../common/xfer.h"
+
+#include <syslog.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <signal.h>
+
+#ifdef HAVE_ATOMIC_BUILTINS
+
+#define MAX_SESSIONS    1024
+#define NAME_MAX_LEN    256     /* File name shown, with the NUL */
+#define IO_TIMEOUT      1       /* Seconds to wait on a control client */
+
+struct session {
+    pid_t pid;                  /* Serving process, 0 if the entry is free,
+                                   or minus it while being filled in */
+    union sock_addr client;
+    const char *op;             /* Points to a literal, same in every process */
+    char filename[NAME_MAX_LEN];
+    unsigned int blksize;
+    unsigned int windowsize;
+    long started;               /* xfer_now() */
+    struct xfer_live live;
+};
+
+static struct session *sessions;
+static struct session *mine;
+
+void control_session_start(const union sock_addr *client,
+                           const struct xferlog_rec *r)
+{
+    struct session *s;
+    pid_t pid = getpid(), free_pid;
+    size_t len;
+    int i;
+
+    if (!sessions)
+        return;
+
+    /* Claimed with -pid, so it is not listed half filled in */
+    for (i = 0; i < MAX_SESSIONS; i++) {
+        s = &sessions[i];
+        free_pid = 0;
+        if (__atomic_compare_exchange_n(&s->pid, &free_pid, -pid, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+    if (i == MAX_SESSIONS)
+        return;                 /* Full; this one goes unlisted */
+
+    s->client = *client;
+    s->op = r->op;
+    len = strlen(r->filename);
+    if (len >= sizeof s->filename)
+        len = sizeof s->filename - 1;       /* Only for show */
+    memcpy(s->filename, r->filename, len);
+    s->filename[len] = '\0';
+    s->blksize = r->blksize;
+    s->windowsize = r->windowsize;
+    s->started = xfer_now();
+    memset(&s->live, 0, sizeof s->live);
+    __atomic_store_n(&s->pid, pid, __ATOMIC_RELEASE);
+
+    mine = s;
+    xfer_live = &s->live;
+}
+
+void control_session_end(void)
+{
+    if (!mine)
+        return;
+
+    xfer_live = NULL;
+    __atomic_store_n(&mine->pid, 0, __ATOMIC_RELEASE);
+    mine = NULL;
+}
+
+static struct session *find(long pid)
+{
+    int i;
+
+    if (pid <= 0)
+        return NULL;
+    for (i = 0; i < MAX_SESSIONS; i++)
+        if (__atomic_load_n(&sessions[i].pid, __ATOMIC_ACQUIRE) == pid)
+            return &sessions[i];
+    return NULL;
+}
+
+static void reply(int fd, const char *fmt, ...)
+#ifdef __GNUC__
+    __attribute__ ((format(printf, 2, 3)))
+#endif
+    ;
+
+static void reply(int fd, const char *fmt, ...)
+{
+    char line[NAME_MAX_LEN + 512];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof line, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if ((size_t)n >= sizeof line)
+        n = sizeof line - 1;
+    if (write(fd, line, n) < 0) {
+        /* The client is gone; nothing to be done */
+    }
+}
+
+static void list(int fd)
+{
+    char addr[INET6_ADDRSTRLEN], name[NAME_MAX_LEN];
+    struct session *s;
+    struct xfer_stats st;
+    long now = xfer_now();
+    pid_t pid;
+    char *p;
+    int i;
+
+    reply(fd, "ok\n");
+    for (i = 0; i < MAX_SESSIONS; i++) {
+        s = &sessions[i];
+        pid = __atomic_load_n(&s->pid, __ATOMIC_ACQUIRE);
+        if (!pid)
+            continue;
+        if (kill(pid < 0 ? -pid : pid, 0) && errno == ESRCH) {
+            /* Died without cleaning up */
+            __atomic_compare_exchange_n(&s->pid, &pid, 0, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (pid < 0)
+            continue;           /* Still being filled in */
+
+        st = s->live.st;
+        if (!inet_ntop(s->client.sa.sa_family, SOCKADDR_P(&s->client),
+                       addr, sizeof addr))
+            strcpy(addr, "???");
+        memcpy(name, s->filename, sizeof name);
+        name[sizeof name - 1] = '\0';
+        for (p = name; *p; p++)
+            if ((unsigned char)*p < ' ')
+                *p = '?';
+
+        reply(fd, "pid=%d client=%s port=%u op=%s blksize=%u windowsize=%u "
+              "elapsed_ms=%ld bytes=%lu blocks=%lu retransmits=%lu "
+              "timeouts=%lu rate=%lu file=%s\n",
+              (int)pid, addr, ntohs(SOCKPORT(&s->client)),
+              s->op ? s->op : "?", s->blksize, s->windowsize,
+              now - s->started, st.bytes, st.blocks, st.retransmits,
+              st.timeouts, s->live.rate, name);
+    }
+}
+
+static void command(int fd, char *line)
+{
+    struct session *s;
+    char *cmd, *arg, *end;
+    unsigned long rate;
+    long pid;
+
+    cmd = strtok(line, " \t\r\n");
+    if (!cmd) {
+        reply(fd, "error: no command\n");
+        return;
+    }
+
+    if (!strcmp(cmd, "list")) {
+        list(fd);
+        return;
+    }
+
+    if (strcmp(cmd, "cancel") && strcmp(cmd, "rate")) {
+        reply(fd, "error: unknown command %s\n", cmd);
+        return;
+    }
+
+    arg = strtok(NULL, " \t\r\n");
+    pid = arg ? strtol(arg, &end, 10) : 0;
+    s = (arg && !*end) ? find(pid) : NULL;
+    if (!s) {
+        reply(fd, "error: no such session\n");
+        return;
+    }
+
+    if (!strcmp(cmd, "cancel")) {
+        s->live.cancel = 1;
+    } else {
+        arg = strtok(NULL, " \t\r\n");
+        if (!arg) {
+            reply(fd, "error: no rate given\n");
+            return;
+        }
+        rate = strtoul(arg, &end, 10);
+        if (*end) {
+            reply(fd, "error: bad rate %s\n", arg);
+            return;
+        }
+        s->live.rate = rate;
+    }
+    reply(fd, "ok\n");
+}
+
+static void serve(int fd)
+{
+    struct timeval tv;
+    char line[256];
+    size_t got = 0;
+    int n;
+
+    tv.tv_sec = IO_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+    while (got < sizeof line - 1) {
+        n = read(fd, line + got, sizeof line - 1 - got);
+        if (n <= 0)
+            break;
+        got += n;
+        if (memchr(line, '\n', got))
+            break;
+    }
+    line[got] = '\0';
+
+    command(fd, line);
+}
+
+static void server(int lfd, int rfd)
+{
+    struct pollfd pfd[2];
+    char junk[64];
+    int fd;
+
+    pfd[0].fd = lfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = rfd;
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0)
+            continue;
+        if (pfd[1].revents && read(rfd, junk, sizeof junk) <= 0)
+            exit(0);            /* Everyone else is gone */
+        if (!pfd[0].revents)
+            continue;
+
+        fd = accept(lfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        serve(fd);
+        close(fd);
+    }
+}
+
+int control_start(const char *path, const struct passwd *pw)
+{
+    struct session *t;
+    int p[2], lfd;
+    pid_t pid;
+
+    t = shm_alloc(MAX_SESSIONS * sizeof *t);
+    if (!t)
+        return -1;
+
+    /* Only for whoever started us */
+    lfd = listen_unix(path);
+    if (lfd < 0)
+        return -1;
+    if (chmod(path, 0600) || pipe(p)) {
+        close(lfd);
+        return -1;
+    }
+
+    sessions = t;
+
+    pid = fork();
+    if (pid < 0) {
+        close(lfd);
+        close(p[0]);
+        close(p[1]);
+        sessions = NULL;
+        return -1;
+    } else if (pid == 0) {
+        close(p[1]);
+        detach_helper(pw, "control process");
+        server(lfd, p[0]);
+        exit(0);
+    }
+
+    /* The write end stays open in us and everything we fork, unused */
+    close(lfd);
+    close(p[0]);
+    return 0;
+}
+
+#else
+
+int control_start(const char *path, const struct passwd *pw)
+{
+    (void)path;
+    (void)pw;
+    errno = ENOSYS;
+    return -1;
+}
+
+void control_session_start(const union sock_addr *client,
+                           const struct xferlog_rec *r)
+{
+    (void)client;
+    (void)r;
+}
+
+void control_session_end(void)
+{
+}
+
+#endif
@@ -0,0 +1,44 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * control.h
+ *
+ * The control socket for --control: a table in shared memory of the
+ * transfers in progress, and a process which lists them and passes on
+ * cancellations and rate limits.
+ *
+ * The protocol is one command per connection, one line each way, and
+ * then one line per session for "list":
+ *
+ *   list                   ok, then "pid=... client=... file=..." lines
+ *   cancel PID             ok, or error: ...
+ *   rate PID BYTES/SEC     ok, or error: ...; 0 removes the limit
+ */
+
+#ifndef TFTPD_CONTROL_H
+#define TFTPD_CONTROL_H
+
+#include <pwd.h>
+#include "xferlog.h"
+
+/* Set up the session table and start the process answering on a UNIX
+   socket at path.  Returns 0, or -1 with errno set. */
+int control_start(const char *path, const struct passwd *pw);
+
+/* Enter the transfer about to start in the table, and point xfer_live
+   at its entry so it can be watched and steered */
+void control_session_start(const union sock_addr *client,
+                           const struct xferlog_rec *);
+
+/* Take it out again */
+void control_session_end(void);
+
+#endif                          /* TFTPD_CONTROL_H */
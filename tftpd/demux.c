@@ -0,0 +1,310 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * demux.c
+ *
+ * Session table for --single-port.  Each transfer is still handled by
+ * its own child, but instead of a UDP socket bound to a port of its
+ * own the child gets one end of a SOCK_SEQPACKET socket pair.  The
+ * parent looks up incoming datagrams by client address and port and
+ * passes them down the socket pair; whatever the child sends is sent
+ * on to the client from the listening socket.  When the child exits,
+ * the parent sees end-of-file on its end and forgets the session.
+ *
+ * This saves ports, not memory: a session still costs a process and
+ * the buffers of a socket pair, much as it would cost a UDP socket.
+ *
+ * The parent never waits on the network.  If the listening socket's
+ * send buffer is full, the datagram in hand is held in the session,
+ * and nothing more is read from that child until POLLOUT says the
+ * socket can take it; meanwhile the child's datagrams queue up in the
+ * socket pair, and the child's own timeouts take care of the rest.
+ */
+
+#include "tftpd.h"
+#include "demux.h"
+#include "recvfrom.h"
+#include "../common/xfer.h"
+
+#include <syslog.h>
+
+#define HASH_SIZE       1024    /* Must be a power of two */
+#define RELAY_BURST     64      /* Datagrams relayed per session per pass */
+#define WARN_INTERVAL   10000   /* ms between warnings about failed sends */
+
+struct session {
+    struct session *next;       /* Hash chain */
+    int index;                  /* Position in sessions[] */
+    int fd;                     /* Our end of the socket pair */
+    int listen_fd;              /* Socket the request came in on */
+    union sock_addr client;     /* Client address and port (the key) */
+    union sock_addr local;      /* Local address the request was sent to */
+    union sock_addr reply_to;   /* Client address in the listener's family */
+    char *held;                 /* Datagram waiting for the listening */
+    int heldlen;                /* socket to take it, if heldlen > 0 */
+};
+
+static struct session *hash[HASH_SIZE];
+static struct session **sessions;
+static int nsessions, maxsessions;
+
+static const unsigned char *addr_bytes(const union sock_addr *a, size_t *len)
+{
+#ifdef HAVE_IPV6
+    if (a->sa.sa_family == AF_INET6) {
+        *len = sizeof(a->s6.sin6_addr);
+        return (const unsigned char *)&a->s6.sin6_addr;
+    }
+#endif
+    *len = sizeof(a->si.sin_addr);
+    return (const unsigned char *)&a->si.sin_addr;
+}
+
+/* FNV-1a over the address and port */
+static unsigned int hash_client(const union sock_addr *a)
+{
+    const unsigned char *p;
+    size_t len;
+    unsigned int h = 2166136261U;
+    u_short port = SOCKPORT(a);
+
+    p = addr_bytes(a, &len);
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619U;
+    }
+    h ^= port & 0xff;
+    h *= 16777619U;
+    h ^= port >> 8;
+    h *= 16777619U;
+
+    return h & (HASH_SIZE - 1);
+}
+
+static int same_client(const union sock_addr *a, const union sock_addr *b)
+{
+    const unsigned char *pa, *pb;
+    size_t la, lb;
+
+    if (a->sa.sa_family != b->sa.sa_family || SOCKPORT(a) != SOCKPORT(b))
+        return 0;
+
+    pa = addr_bytes(a, &la);
+    pb = addr_bytes(b, &lb);
+    return la == lb && !memcmp(pa, pb, la);
+}
+
+struct session *demux_lookup(const union sock_addr *client)
+{
+    struct session *s;
+
+    for (s = hash[hash_client(client)]; s; s = s->next)
+        if (same_client(&s->client, client))
+            return s;
+
+    return NULL;
+}
+
+/*
+ * myrecvfrom() turns IPv4-mapped addresses received on a dual-stack
+ * IPv6 socket into plain IPv4 ones; map them back for sending.
+ */
+static void set_reply_address(struct session *s)
+{
+    memcpy(&s->reply_to, &s->client, sizeof s->reply_to);
+#ifdef HAVE_IPV6
+    {
+        union sock_addr la;
+        socklen_t len = sizeof la;
+
+        if (s->client.sa.sa_family == AF_INET &&
+            !getsockname(s->listen_fd, &la.sa, &len) &&
+            la.sa.sa_family == AF_INET6) {
+            memset(&s->reply_to, 0, sizeof s->reply_to);
+            s->reply_to.s6.sin6_family = AF_INET6;
+            s->reply_to.s6.sin6_port = s->client.si.sin_port;
+            s->reply_to.s6.sin6_addr.s6_addr[10] = 0xff;
+            s->reply_to.s6.sin6_addr.s6_addr[11] = 0xff;
+            memcpy(&s->reply_to.s6.sin6_addr.s6_addr[12],
+                   &s->client.si.sin_addr, 4);
+        }
+    }
+#endif
+}
+
+int demux_create(const union sock_addr *client, const union sock_addr *local,
+                 int listen_fd)
+{
+    struct session *s;
+    unsigned int h;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        syslog(LOG_ERR, "socketpair: %m");
+        return -1;
+    }
+
+    if (nsessions == maxsessions) {
+        maxsessions = maxsessions ? maxsessions * 2 : 64;
+        sessions = xrealloc(sessions, maxsessions * sizeof *sessions);
+    }
+
+    s = tfmalloc(sizeof *s);
+    memset(s, 0, sizeof *s);
+    s->fd = sv[0];
+    s->listen_fd = listen_fd;
+    memcpy(&s->client, client, sizeof s->client);
+    memcpy(&s->local, local, sizeof s->local);
+    set_reply_address(s);
+
+    h = hash_client(client);
+    s->next = hash[h];
+    hash[h] = s;
+
+    s->index = nsessions;
+    sessions[nsessions++] = s;
+
+    return sv[1];
+}
+
+static void demux_destroy(struct session *s)
+{
+    struct session **sp;
+
+    for (sp = &hash[hash_client(&s->client)]; *sp; sp = &(*sp)->next)
+        if (*sp == s) {
+            *sp = s->next;
+            break;
+        }
+
+    /* Move the last session into the hole */
+    sessions[s->index] = sessions[--nsessions];
+    sessions[s->index]->index = s->index;
+
+    close(s->fd);
+    free(s->held);
+    free(s);
+}
+
+/* Warn about a failed send now and then, not for every datagram */
+static void send_failed(const char *what)
+{
+    static long last;
+    static unsigned long count;
+    long now = xfer_now();
+    int err = errno;
+
+    count++;
+    if (last && now - last < WARN_INTERVAL)
+        return;
+    errno = err;
+    syslog(LOG_WARNING, "demux: %s: %m (%lu in all since the last warning)",
+           what, count);
+    last = now;
+    count = 0;
+}
+
+void demux_forward(struct session *s, const void *buf, int len)
+{
+    /* If the child is not keeping up, drop it like the network would */
+    if (send(s->fd, buf, len, MSG_DONTWAIT) < 0 && !E_WOULD_BLOCK(errno))
+        send_failed("forward");
+}
+
+int demux_count(void)
+{
+    return nsessions;
+}
+
+int demux_pollfds(struct pollfd *pfd)
+{
+    int i;
+
+    for (i = 0; i < nsessions; i++) {
+        /* A session holding a datagram waits for the listener instead */
+        if (sessions[i]->heldlen) {
+            pfd[i].fd = sessions[i]->listen_fd;
+            pfd[i].events = POLLOUT;
+        } else {
+            pfd[i].fd = sessions[i]->fd;
+            pfd[i].events = POLLIN;
+        }
+        pfd[i].revents = 0;
+    }
+
+    return nsessions;
+}
+
+/*
+ * Send a datagram from the child on to the client.  Returns 0 if it is
+ * sent (or dropped for good), or -1 if the listening socket cannot take
+ * it now, in which case it is held in the session.
+ */
+static int relay_out(struct session *s, const void *buf, int len)
+{
+    if (mysendto(s->listen_fd, buf, len, 0, &s->reply_to, &s->local) == len)
+        return 0;
+
+    if (!E_WOULD_BLOCK(errno)) {
+        send_failed("send");
+        return 0;
+    }
+
+    if (!s->held)
+        s->held = tfmalloc(PKTSIZE);
+    if (buf != s->held)
+        memcpy(s->held, buf, len);
+    s->heldlen = len;
+    return -1;
+}
+
+void demux_relay(const struct pollfd *pfd, int npfd)
+{
+    static char buf[PKTSIZE];
+    struct session *s;
+    int i, j, n;
+
+    /* Walk backwards, since demux_destroy() moves the last entry */
+    for (i = npfd - 1; i >= 0; i--) {
+        if (!pfd[i].revents)
+            continue;
+
+        s = sessions[i];
+        if (s->heldlen) {
+            n = s->heldlen;
+            s->heldlen = 0;
+            if (relay_out(s, s->held, n))
+                continue;       /* Still full */
+        }
+
+        for (j = 0; j < RELAY_BURST; j++) {
+            n = recv(s->fd, buf, sizeof buf, MSG_DONTWAIT);
+            if (n > 0) {
+                if (relay_out(s, buf, n))
+                    break;      /* Held until the listener can take it */
+            } else if (n < 0 && (E_WOULD_BLOCK(errno) || errno == EINTR)) {
+                break;
+            } else {
+                /* The child has exited */
+                demux_destroy(s);
+                break;
+            }
+        }
+    }
+}
+
+void demux_child_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < nsessions; i++)
+        close(sessions[i]->fd);
+}
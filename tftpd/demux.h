@@ -0,0 +1,52 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * demux.h
+ *
+ * Session table for --single-port, where all transfers are served
+ * from the listening socket(s) and the parent relays datagrams
+ * between the network and the child handling each client.
+ */
+
+#ifndef TFTPD_DEMUX_H
+#define TFTPD_DEMUX_H
+
+#include "../common/tftpsubs.h"
+
+#include <poll.h>
+
+struct session;
+
+/* Look up the session for a client address and port, or NULL */
+struct session *demux_lookup(const union sock_addr *client);
+
+/* Create a session; returns the child's end of the relay socket pair,
+   or -1 on failure */
+int demux_create(const union sock_addr *client, const union sock_addr *local,
+                 int listen_fd);
+
+/* Forward a datagram from the network to the child owning the session */
+void demux_forward(struct session *, const void *buf, int len);
+
+/* Number of active sessions */
+int demux_count(void);
+
+/* Fill in one pollfd per session; returns the number filled in */
+int demux_pollfds(struct pollfd *);
+
+/* Relay datagrams from children back to the network, and reap the
+   sessions whose child has gone away */
+void demux_relay(const struct pollfd *, int);
+
+/* In a newly forked child: close the parent's ends of every session */
+void demux_child_cleanup(void);
+
+#endif                          /* TFTPD_DEMUX_H */
@@ -0,0 +1,567 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * metrics.c
+ *
+ * Metrics for --metrics.  The counters live in shared memory set up
+ * before anything is forked, so every child and worker adds to the
+ * same ones with atomic operations and nobody has to collect them.  A
+ * separate process, forked like the log process, answers each HTTP
+ * request on the metrics socket with a snapshot in the Prometheus text
+ * format; it exits once every process holding the other end of its
+ * pipe is gone.
+ *
+ * Latencies are kept in microseconds and throughput in bytes per
+ * second, each in a fixed set of buckets.
+ */
+
+#include "tftpd.h"
+#include "metrics.h"
+#include "../common/pool.h"
+
+#include <syslog.h>
+#include <stdarg.h>
+#include <poll.h>
+
+#ifdef HAVE_ATOMIC_BUILTINS
+
+#define MAX_NAKS        16      /* TFTP error codes counted */
+#define MAX_BUCKETS     8
+#define IO_TIMEOUT      1000    /* ms to wait on a metrics client */
+
+enum { RES_OK, RES_REFUSED, RES_TIMEOUT, RES_DECLINED, RES_ERROR, NRES };
+
+static const char *const results[NRES] = {
+    "ok", "refused", "timeout", "declined", "error"
+};
+
+struct hist_def {
+    const char *name;
+    const char *help;
+    int nbuckets;
+    unsigned long bound[MAX_BUCKETS];
+    int usec;                   /* Values are in microseconds */
+};
+
+static const struct hist_def remap_def = {
+    "tftpd_remap_seconds", "Time spent applying the remapping rules.",
+    6, { 10, 100, 1000, 10000, 100000, 1000000 }, 1
+};
+
+static const struct hist_def open_def = {
+    "tftpd_file_open_seconds", "Time taken to open the requested file.",
+    6, { 10, 100, 1000, 10000, 100000, 1000000 }, 1
+};
+
+static const struct hist_def stage_def = {
+    "tftpd_request_stage_seconds",
+    "Time from the previous stage of a request to the one labelled.",
+    8, { 10, 50, 250, 1000, 5000, 25000, 100000, 1000000 }, 1
+};
+
+static const struct hist_def ttfb_def = {
+    "tftpd_time_to_first_byte_seconds",
+    "Time from reading a request to sending (RRQ) or receiving (WRQ) "
+    "the first data.",
+    8, { 100, 500, 1000, 5000, 25000, 100000, 500000, 2000000 }, 1
+};
+
+static const struct hist_def rate_def = {
+    "tftpd_transfer_bytes_per_second",
+    "Throughput of each completed transfer.",
+    8, { 1UL << 16, 1UL << 18, 1UL << 20, 1UL << 22,
+         1UL << 24, 1UL << 26, 1UL << 28, 1UL << 30 }, 0
+};
+
+struct histogram {
+    unsigned long bucket[MAX_BUCKETS + 1];      /* The last is +Inf */
+    unsigned long sum;
+};
+
+struct metrics {
+    unsigned long requests[2][NRES];            /* RRQ, WRQ */
+    long active;
+    unsigned long bytes_sent;
+    unsigned long bytes_received;
+    unsigned long retransmits;
+    unsigned long out_of_order;
+    unsigned long timeouts;
+    unsigned long naks[MAX_NAKS];
+    unsigned long rx_dropped[2];                /* IPv4, IPv6 listener */
+    struct histogram remap;
+    struct histogram open;
+    struct histogram stage[NSTAGES];            /* Not STAGE_RECEIVED */
+    struct histogram ttfb;
+    struct histogram rate;
+};
+
+static struct metrics *metrics;
+static const char *const *reasons;
+static int nreasons;
+
+#define ADD(v, n) __atomic_add_fetch(&(v), (n), __ATOMIC_RELAXED)
+#define GET(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+
+static void observe(struct histogram *h, const struct hist_def *d,
+                    unsigned long v)
+{
+    int i;
+
+    for (i = 0; i < d->nbuckets; i++)
+        if (v <= d->bound[i])
+            break;
+    ADD(h->bucket[i], 1);
+    ADD(h->sum, v);
+}
+
+void metrics_session_start(void)
+{
+    if (metrics)
+        ADD(metrics->active, 1);
+}
+
+/* Each stage a request reached, timed from the one before it */
+static void observe_stages(struct metrics *m, const struct xferlog_rec *r)
+{
+    long prev = r->stage[STAGE_RECEIVED], first;
+    int i;
+
+    if (!prev)
+        return;
+    for (i = STAGE_RECEIVED + 1; i < NSTAGES; i++) {
+        if (!r->stage[i])
+            continue;
+        observe(&m->stage[i], &stage_def, r->stage[i] - prev);
+        prev = r->stage[i];
+    }
+
+    first = r->stage[strcmp(r->op, "WRQ") ? STAGE_DATA : STAGE_ACK];
+    if (first)
+        observe(&m->ttfb, &ttfb_def, first - r->stage[STAGE_RECEIVED]);
+}
+
+void metrics_session_end(const struct xferlog_rec *r)
+{
+    struct metrics *m = metrics;
+    long ms;
+    int op, res;
+
+    if (!m)
+        return;
+
+    ADD(m->active, -1);
+
+    op = !strcmp(r->op, "WRQ");
+    for (res = 0; res < RES_ERROR; res++)
+        if (r->result && !strcmp(r->result, results[res]))
+            break;
+    ADD(m->requests[op][res], 1);
+
+    ADD(*(op ? &m->bytes_received : &m->bytes_sent), r->st.bytes);
+    ADD(m->retransmits, r->st.retransmits);
+    ADD(m->out_of_order, r->st.out_of_order);
+    ADD(m->timeouts, r->st.timeouts);
+    observe_stages(m, r);
+
+    if (res == RES_OK && r->st.bytes) {
+        ms = r->st.end - r->request;
+        if (ms < 1)
+            ms = 1;
+        observe(&m->rate, &rate_def, r->st.bytes * 1000 / ms);
+    }
+}
+
+void metrics_nak(int code)
+{
+    if (metrics && code >= 0 && code < MAX_NAKS)
+        ADD(metrics->naks[code], 1);
+}
+
+void metrics_remap(long usec)
+{
+    if (metrics)
+        observe(&metrics->remap, &remap_def, usec);
+}
+
+void metrics_open(long usec)
+{
+    if (metrics)
+        observe(&metrics->open, &open_def, usec);
+}
+
+void metrics_rx_dropped(int listener, long count)
+{
+    /* Only the listening process writes these */
+    if (metrics && count >= 0)
+        __atomic_store_n(&metrics->rx_dropped[listener], count,
+                         __ATOMIC_RELAXED);
+}
+
+struct out {
+    char *buf;
+    size_t len, size;
+};
+
+static void oprintf(struct out *o, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(o->buf + o->len, o->size - o->len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if ((size_t)n < o->size - o->len)
+            break;
+        o->size = (o->size + n) * 2;
+        o->buf = xrealloc(o->buf, o->size);
+    }
+    o->len += n;
+}
+
+static void header(struct out *o, const char *name, const char *type,
+                   const char *help)
+{
+    oprintf(o, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void counter(struct out *o, const char *name, const char *help,
+                    unsigned long v)
+{
+    header(o, name, "counter", help);
+    oprintf(o, "%s %lu\n", name, v);
+}
+
+static void put_value(struct out *o, unsigned long v, int usec)
+{
+    if (usec)
+        oprintf(o, "%lu.%06lu", v / 1000000, v % 1000000);
+    else
+        oprintf(o, "%lu", v);
+}
+
+/* The series of one histogram; label is "" or like "stage=\"open\"" */
+static void histogram_series(struct out *o, const struct hist_def *d,
+                             struct histogram *h, const char *label)
+{
+    const char *sep = *label ? "," : "";
+    unsigned long cum = 0;
+    int i;
+
+    for (i = 0; i < d->nbuckets; i++) {
+        cum += GET(h->bucket[i]);
+        oprintf(o, "%s_bucket{%s%sle=\"", d->name, label, sep);
+        put_value(o, d->bound[i], d->usec);
+        oprintf(o, "\"} %lu\n", cum);
+    }
+    cum += GET(h->bucket[i]);
+    oprintf(o, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", d->name, label, sep, cum);
+    if (*label)
+        oprintf(o, "%s_sum{%s} ", d->name, label);
+    else
+        oprintf(o, "%s_sum ", d->name);
+    put_value(o, GET(h->sum), d->usec);
+    if (*label)
+        oprintf(o, "\n%s_count{%s} %lu\n", d->name, label, cum);
+    else
+        oprintf(o, "\n%s_count %lu\n", d->name, cum);
+}
+
+static void histogram(struct out *o, const struct hist_def *d,
+                      struct histogram *h)
+{
+    header(o, d->name, "histogram", d->help);
+    histogram_series(o, d, h, "");
+}
+
+static void snapshot(struct out *o)
+{
+    static const char *const ops[2] = { "RRQ", "WRQ" };
+    static const char *const listeners[2] = { "ipv4", "ipv6" };
+    struct metrics *m = metrics;
+    struct pool_stats ps;
+    char label[32];
+    int i, j;
+
+    header(o, "tftpd_requests_total", "counter",
+           "Requests handled, by type and result.");
+    for (i = 0; i < 2; i++)
+        for (j = 0; j < NRES; j++)
+            oprintf(o, "tftpd_requests_total{opcode=\"%s\",result=\"%s\"} %lu\n",
+                    ops[i], results[j], GET(m->requests[i][j]));
+
+    header(o, "tftpd_sessions_active", "gauge",
+           "Requests being served right now.");
+    oprintf(o, "tftpd_sessions_active %ld\n", GET(m->active));
+
+    counter(o, "tftpd_bytes_sent_total", "File data sent.",
+            GET(m->bytes_sent));
+    counter(o, "tftpd_bytes_received_total", "File data received.",
+            GET(m->bytes_received));
+    counter(o, "tftpd_retransmits_total", "Packets sent again.",
+            GET(m->retransmits));
+    counter(o, "tftpd_out_of_order_total",
+            "Duplicate ACKs and out-of-sequence DATA received.",
+            GET(m->out_of_order));
+    counter(o, "tftpd_timeouts_total", "Retransmission timeouts.",
+            GET(m->timeouts));
+
+    header(o, "tftpd_naks_total", "counter",
+           "Error packets sent, by TFTP error code.");
+    for (i = 0; i < nreasons && i < MAX_NAKS; i++)
+        oprintf(o, "tftpd_naks_total{code=\"%d\",reason=\"%s\"} %lu\n",
+                i, reasons[i], GET(m->naks[i]));
+
+    histogram(o, &remap_def, &m->remap);
+    histogram(o, &open_def, &m->open);
+
+    header(o, stage_def.name, "histogram", stage_def.help);
+    for (i = STAGE_RECEIVED + 1; i < NSTAGES; i++) {
+        snprintf(label, sizeof label, "stage=\"%s\"", xfer_stage_names[i]);
+        histogram_series(o, &stage_def, &m->stage[i], label);
+    }
+    histogram(o, &ttfb_def, &m->ttfb);
+    histogram(o, &rate_def, &m->rate);
+
+    header(o, "tftpd_listener_drops_total", "counter",
+           "Requests dropped by the kernel for want of buffer space.");
+    for (i = 0; i < 2; i++)
+        oprintf(o, "tftpd_listener_drops_total{listener=\"%s\"} %lu\n",
+                listeners[i], GET(m->rx_dropped[i]));
+
+    pool_get_stats(&ps);
+    header(o, "tftpd_buffer_bytes", "gauge",
+           "Memory in use for transfer buffers.");
+    oprintf(o, "tftpd_buffer_bytes %lu\n", (unsigned long)ps.used);
+    counter(o, "tftpd_buffer_refusals_total",
+            "Transfers refused by --memory-limit.", ps.failures);
+}
+
+/* Wait for the socket to be ready; nonzero if it is */
+static int wait_for(int fd, short events)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    return poll(&pfd, 1, IO_TIMEOUT) > 0;
+}
+
+static void serve(int fd)
+{
+    static const char hdr[] =
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Connection: close\r\n"
+        "Content-Length: %lu\r\n\r\n";
+    char req[2048];
+    struct out o;
+    size_t got = 0, off;
+    char *body;
+    int n;
+
+    /* Whatever was asked for, once the client has finished asking */
+    while (got < sizeof req - 1 && wait_for(fd, POLLIN)) {
+        n = read(fd, req + got, sizeof req - 1 - got);
+        if (n <= 0)
+            break;
+        got += n;
+        req[got] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            break;
+    }
+
+    o.size = 16384;
+    o.buf = xmalloc(o.size);
+    o.len = 0;
+    snapshot(&o);
+    body = o.buf;
+    off = o.len;
+
+    o.buf = xmalloc(o.size = 128);
+    o.len = 0;
+    oprintf(&o, hdr, (unsigned long)off);
+    o.buf = xrealloc(o.buf, o.len + off);
+    memcpy(o.buf + o.len, body, off);
+    o.len += off;
+    free(body);
+
+    for (off = 0; off < o.len; off += n) {
+        if (!wait_for(fd, POLLOUT))
+            break;
+        n = write(fd, o.buf + off, o.len - off);
+        if (n <= 0)
+            break;
+    }
+    free(o.buf);
+}
+
+static void server(int lfd, int rfd)
+{
+    struct pollfd pfd[2];
+    char junk[64];
+    int fd;
+
+    pfd[0].fd = lfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = rfd;
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0)
+            continue;
+        if (pfd[1].revents && read(rfd, junk, sizeof junk) <= 0)
+            exit(0);            /* Everyone else is gone */
+        if (!pfd[0].revents)
+            continue;
+
+        fd = accept(lfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        serve(fd);
+        close(fd);
+    }
+}
+
+static int listen_on(const char *dest)
+{
+    struct addrinfo hints, *ai;
+    char *host, *port;
+    int fd, err, on = 1;
+
+    if (!strncmp(dest, "unix:", 5))
+        return listen_unix(dest + 5);
+
+    host = tfstrdup(dest);
+    port = strrchr(host, ':');
+    if (port) {
+        *port++ = '\0';
+        if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+            memmove(host, host + 1, strlen(host));
+            host[strlen(host) - 1] = '\0';
+        }
+    } else {
+        port = host;
+        host = NULL;
+    }
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    err = getaddrinfo(host ? host : "127.0.0.1", port, &hints, &ai);
+    free(host ? host : port);
+    if (err) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (fd >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) || listen(fd, 16)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(ai);
+    return fd;
+}
+
+int metrics_start(const char *dest, const struct passwd *pw,
+                  const char *const *nak_reasons, int n)
+{
+    struct metrics *m;
+    int p[2], lfd;
+    pid_t pid;
+
+    m = shm_alloc(sizeof *m);
+    if (!m)
+        return -1;
+
+    lfd = listen_on(dest);
+    if (lfd < 0)
+        return -1;
+
+    if (pipe(p)) {
+        close(lfd);
+        return -1;
+    }
+
+    reasons = nak_reasons;
+    nreasons = n;
+    metrics = m;
+
+    pid = fork();
+    if (pid < 0) {
+        close(lfd);
+        close(p[0]);
+        close(p[1]);
+        metrics = NULL;
+        return -1;
+    } else if (pid == 0) {
+        close(p[1]);
+        detach_helper(pw, "metrics process");
+        server(lfd, p[0]);
+        exit(0);
+    }
+
+    /* The write end stays open in us and everything we fork, unused */
+    close(lfd);
+    close(p[0]);
+    return 0;
+}
+
+#else
+
+int metrics_start(const char *dest, const struct passwd *pw,
+                  const char *const *nak_reasons, int n)
+{
+    (void)dest;
+    (void)pw;
+    (void)nak_reasons;
+    (void)n;
+    errno = ENOSYS;
+    return -1;
+}
+
+void metrics_session_start(void)
+{
+}
+
+void metrics_session_end(const struct xferlog_rec *r)
+{
+    (void)r;
+}
+
+void metrics_nak(int code)
+{
+    (void)code;
+}
+
+void metrics_remap(long usec)
+{
+    (void)usec;
+}
+
+void metrics_open(long usec)
+{
+    (void)usec;
+}
+
+void metrics_rx_dropped(int listener, long count)
+{
+    (void)listener;
+    (void)count;
+}
+
+#endif
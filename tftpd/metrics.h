@@ -0,0 +1,39 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * metrics.h
+ *
+ * Counters and histograms for --metrics, kept in shared memory by all
+ * processes serving requests and served in the Prometheus text format
+ * by a separate process.
+ */
+
+#ifndef TFTPD_METRICS_H
+#define TFTPD_METRICS_H
+
+#include <pwd.h>
+#include "xferlog.h"
+
+/* Listen on dest, "unix:PATH" or "[ADDR:]PORT" (TCP, by default on
+   127.0.0.1), and start the process which answers there.  nak_reasons
+   names the TFTP error codes.  Returns 0, or -1 with errno set. */
+int metrics_start(const char *dest, const struct passwd *pw,
+                  const char *const *nak_reasons, int nreasons);
+
+/* The calls below do nothing unless metrics_start() succeeded */
+void metrics_session_start(void);
+void metrics_session_end(const struct xferlog_rec *);
+void metrics_nak(int code);
+void metrics_remap(long usec);
+void metrics_open(long usec);
+void metrics_rx_dropped(int listener, long count);     /* 0 IPv4, 1 IPv6 */
+
+#endif                          /* TFTPD_METRICS_H */
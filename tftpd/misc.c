@@ -17,6 +17,8 @@
 #include "tftpd.h"
 
 #include <syslog.h>
+#include <pwd.h>
+#include <sys/un.h>
 
 /*
  * Set the signal handler and flags.  Basically a user-friendly
@@ -66,3 +68,64 @@ char *tfstrdup(const char *str)
 
     return p;
 }
+
+/*
+ * Set up a helper process forked from the server (the log process, the
+ * metrics server): out of the way of the terminal and the working
+ * directory, deaf to the signals meant for the server, and running as
+ * the given user.
+ */
+void detach_helper(const struct passwd *pw, const char *what)
+{
+    int fd, i;
+
+    setsid();
+    set_signal(SIGHUP, SIG_IGN, 0);
+    set_signal(SIGINT, SIG_IGN, 0);
+    set_signal(SIGTERM, SIG_IGN, 0);
+    if (chdir("/")) {
+        /* Not important */
+    }
+    fd = open("/dev/null", O_RDWR);
+    for (i = 0; i < 3; i++)
+        if (fd >= 0 && fd != i)
+            dup2(fd, i);
+    if (fd > 2)
+        close(fd);
+
+    if (getuid() == 0) {
+#ifdef HAVE_SETGROUPS
+        setgroups(0, NULL);
+#endif
+        if (setgid(pw->pw_gid) || setuid(pw->pw_uid))
+            syslog(LOG_WARNING, "%s: cannot drop privileges: %m", what);
+    }
+}
+
+/*
+ * Listen for connections on a UNIX domain stream socket at path,
+ * replacing whatever an earlier run left there.
+ */
+int listen_unix(const char *path)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+    if (strlen(path) >= sizeof sun.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&sun, 0, sizeof sun);
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *)&sun, sizeof sun) || listen(fd, 16)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
@@ -0,0 +1,228 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * prefork.c
+ *
+ * Worker pool for --prefork.  Each worker is forked once, gives up its
+ * privileges once, and then serves one request after another.  The
+ * parent keeps one end of a SOCK_SEQPACKET socket pair per worker: it
+ * writes each request it reads from the network to an idle worker, and
+ * the worker writes back a single byte when it is ready for the next
+ * one.  End-of-file on the parent's end means the worker has died, and
+ * it is started again (after a pause, if it did not last long).
+ */
+
+#include "tftpd.h"
+#include "prefork.h"
+#include "../common/xfer.h"
+
+#include <syslog.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define RESPAWN_DELAY   1000    /* ms; minimum lifetime of a healthy worker */
+
+struct worker {
+    pid_t pid;
+    int fd;                     /* Our end of the socket pair, or -1 */
+    int busy;                   /* Has a request and has not said ready */
+    long started;               /* xfer_now() when forked */
+    long respawn_at;            /* When to start it again, if fd < 0 */
+};
+
+static struct worker *workers;
+static int nworkers;
+
+void prefork_init(int n)
+{
+    int i;
+
+    workers = xmalloc(n * sizeof *workers);
+    for (i = 0; i < n; i++) {
+        workers[i].pid = 0;
+        workers[i].fd = -1;
+        workers[i].busy = 0;
+        workers[i].respawn_at = 0;
+    }
+    nworkers = n;
+}
+
+/* Returns the worker's end of the socket pair in the worker, -1 otherwise */
+static int spawn(struct worker *w, long now)
+{
+    int sv[2];
+    pid_t pid;
+
+    w->respawn_at = now + RESPAWN_DELAY;        /* If anything fails */
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        syslog(LOG_ERR, "prefork: socketpair: %m");
+        return -1;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        syslog(LOG_ERR, "prefork: fork: %m");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    } else if (pid == 0) {
+        close(sv[0]);
+        prefork_child_cleanup();
+        return sv[1];
+    }
+
+    close(sv[1]);
+    w->pid = pid;
+    w->fd = sv[0];
+    w->busy = 0;
+    w->started = now;
+    return -1;
+}
+
+int prefork_maintain(void)
+{
+    long now = xfer_now();
+    int i, fd;
+
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].fd >= 0 || now - workers[i].respawn_at < 0)
+            continue;
+        fd = spawn(&workers[i], now);
+        if (fd >= 0)
+            return fd;
+    }
+
+    return -1;
+}
+
+int prefork_timeout(void)
+{
+    long now = xfer_now();
+    long wait = -1, left;
+    int i;
+
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].fd >= 0)
+            continue;
+        left = workers[i].respawn_at - now;
+        if (left < 0)
+            left = 0;
+        if (wait < 0 || left < wait)
+            wait = left;
+    }
+
+    return wait;
+}
+
+static void retire(struct worker *w, long now)
+{
+    close(w->fd);
+    w->fd = -1;
+    w->busy = 0;
+    w->respawn_at = now;
+}
+
+int prefork_dispatch(const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    struct worker *w;
+    int i;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    /* The first idle worker, so the same few stay warm when it is quiet */
+    for (i = 0; i < nworkers; i++) {
+        w = &workers[i];
+        if (w->fd < 0 || w->busy)
+            continue;
+        if (sendmsg(w->fd, &msg, MSG_NOSIGNAL) >= 0) {
+            w->busy = 1;
+            return 0;
+        }
+        syslog(LOG_WARNING, "prefork: worker %d: %m", (int)w->pid);
+        retire(w, w->started + RESPAWN_DELAY);
+    }
+
+    return -1;
+}
+
+int prefork_pollfds(struct pollfd *pfd)
+{
+    int i, n = 0;
+
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].fd < 0)
+            continue;
+        pfd[n].fd = workers[i].fd;
+        pfd[n].events = POLLIN;
+        pfd[n].revents = 0;
+        n++;
+    }
+
+    return n;
+}
+
+void prefork_events(const struct pollfd *pfd, int npfd)
+{
+    struct worker *w;
+    char c;
+    int i, n;
+
+    for (i = 0; i < nworkers && npfd > 0; i++) {
+        w = &workers[i];
+        if (w->fd < 0)
+            continue;
+        npfd--;
+        if (!(pfd++)->revents)
+            continue;
+
+        n = recv(w->fd, &c, 1, MSG_DONTWAIT);
+        if (n > 0) {
+            w->busy = 0;
+        } else if (n == 0 || !(E_WOULD_BLOCK(errno) || errno == EINTR)) {
+            syslog(LOG_WARNING, "prefork: worker %d exited", (int)w->pid);
+            retire(w, w->started + RESPAWN_DELAY);
+        }
+    }
+}
+
+void prefork_restart(void)
+{
+    long now = xfer_now();
+    int i;
+
+    /* Each worker exits when it sees end-of-file after its transfer */
+    for (i = 0; i < nworkers; i++)
+        if (workers[i].fd >= 0)
+            retire(&workers[i], now);
+}
+
+void prefork_child_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < nworkers; i++)
+        if (workers[i].fd >= 0)
+            close(workers[i].fd);
+}
+
+void prefork_ready(int fd)
+{
+    char c = 0;
+
+    if (send(fd, &c, 1, MSG_NOSIGNAL) < 0)
+        exit(0);                /* The parent has gone away */
+}
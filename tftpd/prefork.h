@@ -0,0 +1,56 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * prefork.h
+ *
+ * Pool of long-lived worker processes for --prefork, each serving one
+ * transfer after another instead of forking a child per request.
+ */
+
+#ifndef TFTPD_PREFORK_H
+#define TFTPD_PREFORK_H
+
+#include "../common/tftpsubs.h"
+
+#include <poll.h>
+#include <sys/uio.h>
+
+/* Set up the (empty) pool; the workers are started by prefork_maintain() */
+void prefork_init(int nworkers);
+
+/* Start or restart workers which are due.  Returns -1 in the parent;
+   in a newly started worker, returns its end of the request socket
+   instead, in the manner of fork(). */
+int prefork_maintain(void);
+
+/* Milliseconds until prefork_maintain() has something to do, or -1 */
+int prefork_timeout(void);
+
+/* Hand a request to an idle worker.  Returns 0, or -1 if every worker
+   is busy. */
+int prefork_dispatch(const struct iovec *iov, int iovcnt);
+
+/* Fill in one pollfd per running worker; returns the number filled in */
+int prefork_pollfds(struct pollfd *);
+
+/* Note the workers which have become idle or have gone away */
+void prefork_events(const struct pollfd *, int);
+
+/* Retire the current workers once they are done, and start new ones */
+void prefork_restart(void);
+
+/* In a newly forked child: close the parent's ends of the workers */
+void prefork_child_cleanup(void);
+
+/* In a worker: tell the parent that we are ready for the next request */
+void prefork_ready(int fd);
+
+#endif                          /* TFTPD_PREFORK_H */
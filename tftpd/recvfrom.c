@@ -24,6 +24,8 @@
 #include <machine/param.h>      /* Needed on some versions of FreeBSD */
 #endif
 
+long rxq_dropped = -1;
+
 #if defined(HAVE_RECVMSG) && defined(HAVE_MSGHDR_MSG_CONTROL)
 
 #include <sys/uio.h>
@@ -50,6 +52,12 @@ struct in_pktinfo {
 # define CMSG_SPACE(size) (sizeof(struct cmsghdr) + (size))
 #endif
 
+#ifdef SO_RXQ_OVFL
+# define RXQ_SPACE CMSG_SPACE(sizeof(uint32_t))
+#else
+# define RXQ_SPACE 0
+#endif
+
 /*
  * Check to see if this is a valid local address, meaning that we can
  * legally bind to it.
@@ -135,9 +143,72 @@ static void normalize_ip6_compat(union sock_addr *myaddr)
 #endif
 }
 
+/*
+ * Ask the kernel to tell us which local address a datagram was sent to.
+ */
+void set_dstaddr_opts(int s, int family)
+{
+    int on = 1;
+
+#ifdef IP_RECVDSTADDR
+    if (family == AF_INET || !family)
+        setsockopt(s, IPPROTO_IP, IP_RECVDSTADDR, &on, sizeof(on));
+#endif
+#ifdef IP_PKTINFO
+    if (family == AF_INET || !family)
+        setsockopt(s, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+#endif
+#ifdef HAVE_IPV6
+#ifdef IPV6_RECVPKTINFO
+    if (family == AF_INET6 || !family)
+        setsockopt(s, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on));
+#endif
+#endif
+    (void)on;
+}
+
+/*
+ * Ask the kernel to report how many datagrams it has dropped on the
+ * socket for want of buffer space.
+ */
+int set_rxq_opts(int s)
+{
+#ifdef SO_RXQ_OVFL
+    int on = 1;
+
+    return setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+#else
+    (void)s;
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+}
+
+/*
+ * If the address is not a valid local address, then bind to any
+ * address...
+ */
+void check_local_address(union sock_addr *myaddr)
+{
+    if (address_is_local(myaddr) != 1) {
+        if (myaddr->sa.sa_family == AF_INET)
+            ((struct sockaddr_in *)myaddr)->sin_addr.s_addr = INADDR_ANY;
+#ifdef HAVE_IPV6
+        else if (myaddr->sa.sa_family == AF_INET6)
+            memset(&myaddr->s6.sin6_addr, 0, sizeof(struct in6_addr));
+#endif
+    }
+}
+
+/*
+ * Like myrecvfrom(), but set_dstaddr_opts() must already have been
+ * called on the socket, and the local address is returned as-is,
+ * without check_local_address().  Used on the hot path of
+ * --single-port, where most datagrams belong to a running session.
+ */
 int
-myrecvfrom(int s, void *buf, int len, unsigned int flags,
-           union sock_addr *from, union sock_addr *myaddr)
+myrecvfrom_quick(int s, void *buf, int len, unsigned int flags,
+                 union sock_addr *from, union sock_addr *myaddr)
 {
     struct msghdr msg;
     struct iovec iov;
@@ -147,20 +218,19 @@ myrecvfrom(int s, void *buf, int len, unsigned int flags,
         struct cmsghdr cm;
 #ifdef IP_PKTINFO
         char control[CMSG_SPACE(sizeof(struct in_addr)) +
-                     CMSG_SPACE(sizeof(struct in_pktinfo))];
+                     CMSG_SPACE(sizeof(struct in_pktinfo)) + RXQ_SPACE];
 #else
-        char control[CMSG_SPACE(sizeof(struct in_addr))];
+        char control[CMSG_SPACE(sizeof(struct in_addr)) + RXQ_SPACE];
 #endif
 #ifdef HAVE_IPV6
 #ifdef HAVE_STRUCT_IN6_PKTINFO
         char control6[CMSG_SPACE(sizeof(struct in6_addr)) +
-                     CMSG_SPACE(sizeof(struct in6_pktinfo))];
+                     CMSG_SPACE(sizeof(struct in6_pktinfo)) + RXQ_SPACE];
 #else
-        char control6[CMSG_SPACE(sizeof(struct in6_addr))];
+        char control6[CMSG_SPACE(sizeof(struct in6_addr)) + RXQ_SPACE];
 #endif
 #endif
     } control_un;
-    int on = 1;
 #ifdef IP_PKTINFO
     struct in_pktinfo pktinfo;
 #endif
@@ -168,21 +238,6 @@ myrecvfrom(int s, void *buf, int len, unsigned int flags,
     struct in6_pktinfo pktinfo6;
 #endif
 
-    /* Try to enable getting the return address */
-#ifdef IP_RECVDSTADDR
-    if (from->sa.sa_family == AF_INET || !from->sa.sa_family)
-        setsockopt(s, IPPROTO_IP, IP_RECVDSTADDR, &on, sizeof(on));
-#endif
-#ifdef IP_PKTINFO
-    if (from->sa.sa_family == AF_INET || !from->sa.sa_family)
-        setsockopt(s, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
-#endif
-#ifdef HAVE_IPV6
-#ifdef IPV6_RECVPKTINFO
-    if (from->sa.sa_family == AF_INET6 || !from->sa.sa_family)
-        setsockopt(s, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on));
-#endif
-#endif
     bzero(&msg, sizeof msg);    /* Clear possible system-dependent fields */
     msg.msg_control = control_un.control;
     msg.msg_controllen = sizeof(control_un);
@@ -198,6 +253,24 @@ myrecvfrom(int s, void *buf, int len, unsigned int flags,
     if ((n = recvmsg(s, &msg, flags)) < 0)
         return n;               /* Error */
 
+#ifdef SO_RXQ_OVFL
+    /* Only there once something has been dropped */
+    rxq_dropped = 0;
+    if (msg.msg_controllen >= sizeof(struct cmsghdr) &&
+        !(msg.msg_flags & MSG_CTRUNC)) {
+        for (cmptr = CMSG_FIRSTHDR(&msg); cmptr != NULL;
+             cmptr = CMSG_NXTHDR(&msg, cmptr)) {
+            if (cmptr->cmsg_level == SOL_SOCKET &&
+                cmptr->cmsg_type == SO_RXQ_OVFL) {
+                uint32_t drops;
+
+                memcpy(&drops, CMSG_DATA(cmptr), sizeof drops);
+                rxq_dropped = drops;
+            }
+        }
+    }
+#endif
+
     if (myaddr) {
         bzero(myaddr, sizeof(*myaddr));
         myaddr->sa.sa_family = from->sa.sa_family;
@@ -257,18 +330,6 @@ myrecvfrom(int s, void *buf, int len, unsigned int flags,
         }
 
 	normalize_ip6_compat(myaddr);
-
-        /* If the address is not a valid local address,
-         * then bind to any address...
-         */
-        if (address_is_local(myaddr) != 1) {
-            if (myaddr->sa.sa_family == AF_INET)
-                ((struct sockaddr_in *)myaddr)->sin_addr.s_addr = INADDR_ANY;
-#ifdef HAVE_IPV6
-            else if (myaddr->sa.sa_family == AF_INET6)
-                memset(&myaddr->s6.sin6_addr, 0, sizeof(struct in6_addr));
-#endif
-        }
     }
 
     normalize_ip6_compat(from);
@@ -276,6 +337,95 @@ myrecvfrom(int s, void *buf, int len, unsigned int flags,
     return n;
 }
 
+int
+myrecvfrom(int s, void *buf, int len, unsigned int flags,
+           union sock_addr *from, union sock_addr *myaddr)
+{
+    int n;
+
+    /* Try to enable getting the return address */
+    set_dstaddr_opts(s, from->sa.sa_family);
+
+    n = myrecvfrom_quick(s, buf, len, flags, from, myaddr);
+    if (n >= 0 && myaddr)
+        check_local_address(myaddr);
+
+    return n;
+}
+
+/*
+ * Send a datagram from a specific local address, for replies sent
+ * through a socket bound to the wildcard address.  "myaddr" is what
+ * myrecvfrom() returned for the request.
+ */
+int
+mysendto(int s, const void *buf, int len, unsigned int flags,
+         const union sock_addr *to, const union sock_addr *myaddr)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmptr;
+    union {
+        struct cmsghdr cm;
+#ifdef IP_PKTINFO
+        char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+#endif
+#ifdef HAVE_STRUCT_IN6_PKTINFO
+        char control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+#endif
+    } control_un;
+#ifdef IP_PKTINFO
+    struct in_pktinfo pktinfo;
+#endif
+#ifdef HAVE_STRUCT_IN6_PKTINFO
+    struct in6_pktinfo pktinfo6;
+#endif
+
+    bzero(&msg, sizeof msg);
+    msg.msg_name = (void *)&to->sa;
+    msg.msg_namelen = SOCKLEN(to);
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    (void)cmptr;
+    (void)control_un;
+
+#ifdef IP_PKTINFO
+    if (myaddr && myaddr->sa.sa_family == AF_INET &&
+        to->sa.sa_family == AF_INET &&
+        myaddr->si.sin_addr.s_addr != INADDR_ANY) {
+        bzero(&pktinfo, sizeof pktinfo);
+        pktinfo.ipi_spec_dst = myaddr->si.sin_addr;
+        msg.msg_control = control_un.control;
+        msg.msg_controllen = CMSG_SPACE(sizeof pktinfo);
+        cmptr = CMSG_FIRSTHDR(&msg);
+        cmptr->cmsg_level = IPPROTO_IP;
+        cmptr->cmsg_type = IP_PKTINFO;
+        cmptr->cmsg_len = CMSG_LEN(sizeof pktinfo);
+        memcpy(CMSG_DATA(cmptr), &pktinfo, sizeof pktinfo);
+    }
+#endif
+#ifdef HAVE_STRUCT_IN6_PKTINFO
+    if (myaddr && myaddr->sa.sa_family == AF_INET6 &&
+        to->sa.sa_family == AF_INET6 &&
+        !IN6_IS_ADDR_UNSPECIFIED(&myaddr->s6.sin6_addr)) {
+        bzero(&pktinfo6, sizeof pktinfo6);
+        pktinfo6.ipi6_addr = myaddr->s6.sin6_addr;
+        msg.msg_control = control_un.control6;
+        msg.msg_controllen = CMSG_SPACE(sizeof pktinfo6);
+        cmptr = CMSG_FIRSTHDR(&msg);
+        cmptr->cmsg_level = IPPROTO_IPV6;
+        cmptr->cmsg_type = IPV6_PKTINFO;
+        cmptr->cmsg_len = CMSG_LEN(sizeof pktinfo6);
+        memcpy(CMSG_DATA(cmptr), &pktinfo6, sizeof pktinfo6);
+    }
+#endif
+
+    return sendmsg(s, &msg, flags);
+}
+
 #else                           /* pointless... */
 
 int
@@ -292,4 +442,37 @@ myrecvfrom(int s, void *buf, int len, unsigned int flags,
     return recvfrom(s, buf, len, flags, from, &fromlen);
 }
 
+int
+myrecvfrom_quick(int s, void *buf, int len, unsigned int flags,
+                 union sock_addr *from, union sock_addr *myaddr)
+{
+    return myrecvfrom(s, buf, len, flags, from, myaddr);
+}
+
+void set_dstaddr_opts(int s, int family)
+{
+    (void)s;
+    (void)family;
+}
+
+int set_rxq_opts(int s)
+{
+    (void)s;
+    errno = ENOPROTOOPT;
+    return -1;
+}
+
+void check_local_address(union sock_addr *myaddr)
+{
+    (void)myaddr;
+}
+
+int
+mysendto(int s, const void *buf, int len, unsigned int flags,
+         const union sock_addr *to, const union sock_addr *myaddr)
+{
+    (void)myaddr;
+    return sendto(s, buf, len, flags, &to->sa, SOCKLEN(to));
+}
+
 #endif
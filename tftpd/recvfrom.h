@@ -20,3 +20,15 @@
 int
 myrecvfrom(int s, void *buf, int len, unsigned int flags,
            union sock_addr *from, union sock_addr *myaddr);
+int
+myrecvfrom_quick(int s, void *buf, int len, unsigned int flags,
+                 union sock_addr *from, union sock_addr *myaddr);
+int
+mysendto(int s, const void *buf, int len, unsigned int flags,
+         const union sock_addr *to, const union sock_addr *myaddr);
+void set_dstaddr_opts(int s, int family);
+int set_rxq_opts(int s);
+/* Datagrams dropped so far on the socket the last one was read from,
+   if set_rxq_opts() succeeded on it; -1 if the system cannot tell */
+extern long rxq_dropped;
+void check_local_address(union sock_addr *myaddr);
@@ -16,6 +16,7 @@
 
 #include "tftpd.h"
 #include "remap.h"
+#include "alog.h"
 
 #include <ctype.h>
 #include <syslog.h>
@@ -350,7 +351,7 @@ char *rewrite_string(const char *input, const struct rule *rules,
     *errmsg = "Remap table failure";
 
     if (verbosity >= 3) {
-        syslog(LOG_INFO, "remap: input: %s", current);
+        alog(LOG_INFO, "remap: input: %s", current);
     }
 
     for (ruleptr = rules; ruleptr; ruleptr = ruleptr->next) {
@@ -364,9 +365,9 @@ char *rewrite_string(const char *input, const struct rule *rules,
             continue;           /* Rule not applicable, try next */
 
         if (!deadman--) {
-            syslog(LOG_WARNING,
-                   "remap: Breaking loop, input = %s, last = %s", input,
-                   current);
+            alog(LOG_WARNING,
+                 "remap: Breaking loop, input = %s, last = %s", input,
+                 current);
             free(current);
             return NULL;        /* Did not terminate! */
         }
@@ -386,8 +387,8 @@ char *rewrite_string(const char *input, const struct rule *rules,
 
                 if (ruleptr->rule_flags & RULE_ABORT) {
                     if (verbosity >= 3) {
-                        syslog(LOG_INFO, "remap: rule %d: abort: %s",
-                               ruleptr->nrule, current);
+                        alog(LOG_INFO, "remap: rule %d: abort: %s",
+                             ruleptr->nrule, current);
                     }
                     if (ruleptr->pattern[0]) {
                         /* Custom error message */
@@ -414,8 +415,8 @@ char *rewrite_string(const char *input, const struct rule *rules,
                     free(current);
                     current = newstr;
                     if (verbosity >= 3) {
-                        syslog(LOG_INFO, "remap: rule %d: rewrite: %s",
-                               ruleptr->nrule, current);
+                        alog(LOG_INFO, "remap: rule %d: rewrite: %s",
+                             ruleptr->nrule, current);
                     }
                 }
             } else {
@@ -429,22 +430,22 @@ char *rewrite_string(const char *input, const struct rule *rules,
 
             if (ruleptr->rule_flags & RULE_EXIT) {
                 if (verbosity >= 3) {
-                    syslog(LOG_INFO, "remap: rule %d: exit",
-                           ruleptr->nrule);
+                    alog(LOG_INFO, "remap: rule %d: exit",
+                         ruleptr->nrule);
                 }
                 return current; /* Exit here, we're done */
             } else if (ruleptr->rule_flags & RULE_RESTART) {
                 ruleptr = rules;        /* Start from the top */
                 if (verbosity >= 3) {
-                    syslog(LOG_INFO, "remap: rule %d: restart",
-                           ruleptr->nrule);
+                    alog(LOG_INFO, "remap: rule %d: restart",
+                         ruleptr->nrule);
                 }
             }
         }
     }
 
     if (verbosity >= 3) {
-        syslog(LOG_INFO, "remap: done");
+        alog(LOG_INFO, "remap: done");
     }
     return current;
 }
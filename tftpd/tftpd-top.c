@@ -0,0 +1,256 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * tftpd-top.c
+ *
+ * Show the transfers in progress on a tftpd started with --control,
+ * refreshed every few seconds, and cancel them or limit their rate.
+ * The current rate of each transfer is worked out from the bytes
+ * moved since the previous refresh.
+ */
+
+#include "../config.h"
+
+#include <sys/un.h>
+
+#define MAX_SHOWN       1024
+#define LINE_MAX_LEN    1024
+
+struct row {
+    long pid;
+    char client[64];
+    char op[8];
+    char file[LINE_MAX_LEN];
+    unsigned long blksize, windowsize, bytes, retransmits, timeouts, limit;
+    long elapsed;
+};
+
+static const char *progname;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: %s [-d seconds] [-n count] socket\n"
+            "       %s socket cancel pid\n"
+            "       %s socket rate pid bytes-per-second\n",
+            progname, progname, progname);
+    exit(EX_USAGE);
+}
+
+/* Send one command; returns a stream for the reply, past its "ok" */
+static FILE *ask(const char *path, const char *cmd)
+{
+    struct sockaddr_un sun;
+    char line[LINE_MAX_LEN];
+    FILE *f;
+    int fd;
+
+    if (strlen(path) >= sizeof sun.sun_path) {
+        fprintf(stderr, "%s: %s: path too long\n", progname, path);
+        exit(EX_USAGE);
+    }
+    memset(&sun, 0, sizeof sun);
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sun, sizeof sun)) {
+        fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+        exit(EX_UNAVAILABLE);
+    }
+    if (write(fd, cmd, strlen(cmd)) != (ssize_t)strlen(cmd)) {
+        fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+        exit(EX_IOERR);
+    }
+
+    f = fdopen(fd, "r");
+    if (!f || !fgets(line, sizeof line, f)) {
+        fprintf(stderr, "%s: %s: no reply\n", progname, path);
+        exit(EX_PROTOCOL);
+    }
+    if (strcmp(line, "ok\n")) {
+        fprintf(stderr, "%s: %s", progname, line);
+        exit(EX_DATAERR);
+    }
+    return f;
+}
+
+static int parse(char *line, struct row *r)
+{
+    char *p, *key, *val;
+
+    memset(r, 0, sizeof *r);
+    line[strcspn(line, "\n")] = '\0';
+
+    /* The file name is last, and may contain anything */
+    p = strstr(line, " file=");
+    if (p) {
+        snprintf(r->file, sizeof r->file, "%s", p + 6);
+        *p = '\0';
+    }
+
+    for (key = strtok(line, " "); key; key = strtok(NULL, " ")) {
+        val = strchr(key, '=');
+        if (!val)
+            continue;
+        *val++ = '\0';
+        if (!strcmp(key, "pid"))
+            r->pid = strtol(val, NULL, 10);
+        else if (!strcmp(key, "client"))
+            snprintf(r->client, sizeof r->client, "%s", val);
+        else if (!strcmp(key, "port"))
+            snprintf(r->client + strlen(r->client),
+                     sizeof r->client - strlen(r->client), ":%s", val);
+        else if (!strcmp(key, "op"))
+            snprintf(r->op, sizeof r->op, "%s", val);
+        else if (!strcmp(key, "blksize"))
+            r->blksize = strtoul(val, NULL, 10);
+        else if (!strcmp(key, "windowsize"))
+            r->windowsize = strtoul(val, NULL, 10);
+        else if (!strcmp(key, "elapsed_ms"))
+            r->elapsed = strtol(val, NULL, 10);
+        else if (!strcmp(key, "bytes"))
+            r->bytes = strtoul(val, NULL, 10);
+        else if (!strcmp(key, "retransmits"))
+            r->retransmits = strtoul(val, NULL, 10);
+        else if (!strcmp(key, "timeouts"))
+            r->timeouts = strtoul(val, NULL, 10);
+        else if (!strcmp(key, "rate"))
+            r->limit = strtoul(val, NULL, 10);
+    }
+
+    return r->pid > 0;
+}
+
+/* Bytes in at most five characters */
+static const char *human(unsigned long v, char *buf, size_t size)
+{
+    static const char units[] = "KMGT";
+    double d = v;
+    int i = -1;
+
+    while (d >= 10000 && i < 3) {
+        d /= 1024;
+        i++;
+    }
+    if (i < 0)
+        snprintf(buf, size, "%lu", v);
+    else
+        snprintf(buf, size, "%.*f%c", d < 10 ? 1 : 0, d, units[i]);
+    return buf;
+}
+
+static void show(const char *path, int clear)
+{
+    static struct row prev[MAX_SHOWN];
+    static int nprev;
+    static struct row rows[MAX_SHOWN];
+    char line[LINE_MAX_LEN], b1[16], b2[16], b3[16];
+    unsigned long rate;
+    int n = 0, i, j;
+    FILE *f;
+
+    f = ask(path, "list\n");
+    while (n < MAX_SHOWN && fgets(line, sizeof line, f))
+        if (parse(line, &rows[n]))
+            n++;
+    fclose(f);
+
+    if (clear)
+        fputs("\033[H\033[2J", stdout);
+    printf("%d transfer%s in progress\n\n", n, n == 1 ? "" : "s");
+    printf("%7s %-22s %-3s %5s %3s %8s %6s %6s %5s %4s %6s  %s\n",
+           "PID", "CLIENT", "OP", "BLK", "WIN", "ELAPSED", "BYTES",
+           "RATE/s", "RETX", "TMO", "LIMIT", "FILE");
+
+    for (i = 0; i < n; i++) {
+        struct row *r = &rows[i];
+
+        /* Since the last refresh if we saw it then, or on average */
+        rate = r->elapsed > 0 ? r->bytes * 1000 / r->elapsed : 0;
+        for (j = 0; j < nprev; j++) {
+            if (prev[j].pid == r->pid && prev[j].elapsed < r->elapsed &&
+                prev[j].bytes <= r->bytes) {
+                rate = (r->bytes - prev[j].bytes) * 1000 /
+                    (r->elapsed - prev[j].elapsed);
+                break;
+            }
+        }
+
+        printf("%7ld %-22s %-3s %5lu %3lu %7.1fs %6s %6s %5lu %4lu %6s  %s\n",
+               r->pid, r->client, r->op, r->blksize, r->windowsize,
+               r->elapsed / 1000.0, human(r->bytes, b1, sizeof b1),
+               human(rate, b2, sizeof b2), r->retransmits, r->timeouts,
+               r->limit ? human(r->limit, b3, sizeof b3) : "-", r->file);
+    }
+    fflush(stdout);
+
+    memcpy(prev, rows, n * sizeof *rows);
+    nprev = n;
+}
+
+int main(int argc, char **argv)
+{
+    char cmd[LINE_MAX_LEN];
+    int delay = 2, count = -1, clear, c;
+    const char *path;
+    char *end;
+    FILE *f;
+
+    progname = argv[0];
+
+    while ((c = getopt(argc, argv, "d:n:")) != -1) {
+        switch (c) {
+        case 'd':
+            delay = strtol(optarg, &end, 10);
+            if (*end || delay < 1)
+                usage();
+            break;
+        case 'n':
+            count = strtol(optarg, &end, 10);
+            if (*end || count < 1)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind >= argc)
+        usage();
+    path = argv[optind++];
+
+    if (optind < argc) {
+        if (!strcmp(argv[optind], "cancel") && argc - optind == 2)
+            snprintf(cmd, sizeof cmd, "cancel %s\n", argv[optind + 1]);
+        else if (!strcmp(argv[optind], "rate") && argc - optind == 3)
+            snprintf(cmd, sizeof cmd, "rate %s %s\n", argv[optind + 1],
+                     argv[optind + 2]);
+        else
+            usage();
+        f = ask(path, cmd);
+        fclose(f);
+        return 0;
+    }
+
+    /* Clear the screen only for a display that keeps running */
+    clear = count < 0 && isatty(STDOUT_FILENO);
+    for (;;) {
+        show(path, clear);
+        if (count > 0 && --count == 0)
+            break;
+        sleep(delay);
+        if (!clear)
+            putchar('\n');
+    }
+
+    return 0;
+}
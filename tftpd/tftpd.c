@@ -36,6 +36,17 @@
 #include "tftpd.h"
 
 #include "recvfrom.h"
+#include "demux.h"
+#include "prefork.h"
+#include "alog.h"
+#include "xferlog.h"
+#include "trace.h"
+#include "metrics.h"
+#include "control.h"
+#include "wbehind.h"
+#include "../common/pool.h"
+#include "../common/xfer.h"
+#include "../common/probes.h"
 #include "remap.h"
 
 /*
@@ -53,6 +64,9 @@
 #include <syslog.h>
 #include <poll.h>
 #include <stdarg.h>
+#ifdef HAVE_SYS_STATVFS_H
+#include <sys/statvfs.h>
+#endif
 
 #ifdef HAVE_SYS_FILIO_H
 #include <sys/filio.h>          /* Necessary for FIONBIO on Solaris */
@@ -82,15 +96,36 @@ static char buf[PKTSIZE];
 static char pktbuf[PKTSIZE];
 static unsigned int max_blksize = MAX_SEGSIZE;
 #define MAX_WINDOWSIZE 64
+#define MAX_PREFORK 1024
 
 static char tmpbuf[INET6_ADDRSTRLEN], *tmp_p;
 
-static union sock_addr from;
+static union sock_addr from, myaddr;
 static uintmax_t tsize;
 static int tsize_ok;
+static uintmax_t range_offset;  /* Where to start an RRQ, "offset" */
+static uintmax_t range_length;  /* How much to send, "length"; 0: all */
+static int range_ok;            /* Whether the two can be had */
 
 static int ndirs;
 static const char **dirs;
+static int *dirfds;             /* Open descriptors for dirs[], --early-drop */
+
+static int early_drop = 0;
+static int pid_dirfd = -1;      /* The pid file's directory, --early-drop */
+static const char *pid_name;    /* The pid file's name in it */
+static int single_port = 0;
+static size_t memory_limit = 0;
+static int prefork = 0;         /* Number of workers, --prefork */
+static int write_behind = 0;    /* Buffers, --write-behind */
+static int async_log = 0;
+static const char *xfer_log;   /* --xfer-log destination */
+static const char *trace_path;  /* --trace file */
+static const char *metrics_dest;        /* --metrics socket */
+static const char *control_path;        /* --control socket */
+static struct xferlog_rec xrec; /* The request being served */
+#define set_xrec(field, s) snprintf(field, sizeof field, "%s", s)
+#define mark_stage(s) (xrec.stage[s] = xfer_now_us())
 
 static int secure = 0;
 int cancreate = 0;
@@ -99,6 +134,20 @@ int portrange = 0;
 unsigned int portrange_from, portrange_to;
 int verbosity = 0;
 
+static const char *const errmsgs[] = {
+    "Undefined error code",     /* 0 - EUNDEF */
+    "File not found",           /* 1 - ENOTFOUND */
+    "Access denied",            /* 2 - EACCESS */
+    "Disk full or allocation exceeded", /* 3 - ENOSPACE */
+    "Illegal TFTP operation",   /* 4 - EBADOP */
+    "Unknown transfer ID",      /* 5 - EBADID */
+    "File already exists",      /* 6 - EEXISTS */
+    "No such user",             /* 7 - ENOUSER */
+    "Failure to negotiate RFC2347 options"      /* 8 - EOPTNEG */
+};
+
+#define ERR_CNT (sizeof(errmsgs)/sizeof(const char *))
+
 struct formats;
 #ifdef WITH_REGEX
 static struct rule *rewrite_rules = NULL;
@@ -106,7 +155,7 @@ static struct rule *rewrite_rules = NULL;
 
 int tftp(struct tftphdr *, int);
 static void nak(int error, const char *msg);
-static void do_opt(const char *, const char *, char **);
+static int do_opt(const char *, const char *, char **);
 
 static int set_blksize(uintmax_t *);
 static int set_blksize2(uintmax_t *);
@@ -115,6 +164,8 @@ static int set_timeout(uintmax_t *);
 static int set_utimeout(uintmax_t *);
 static int set_rollover(uintmax_t *);
 static int set_windowsize(uintmax_t *);
+static int set_offset(uintmax_t *);
+static int set_length(uintmax_t *);
 
 int g_timeout = 1000; /* ms */
 
@@ -129,6 +180,8 @@ struct options {
     {"utimeout", set_utimeout},
     {"rollover", set_rollover},
     {"windowsize", set_windowsize},
+    {"offset",   set_offset},
+    {"length",   set_length},
     {NULL, NULL}
 };
 
@@ -148,18 +201,28 @@ static void handle_exit(int sig)
 }
 
 #ifdef WITH_REGEX
+/* With --early-drop the map file is kept open, since after the chroot
+   we may no longer be able to reach it by name on SIGHUP. */
+static FILE *rewrite_fp;
+
 static struct rule *read_remap_rules(const char *file)
 {
     FILE *f;
     struct rule *rulep;
 
-    f = fopen(file, "rt");
-    if (!f) {
-        syslog(LOG_ERR, "Cannot open map file: %s: %m", file);
-        exit(EX_NOINPUT);
+    if (rewrite_fp) {
+        f = rewrite_fp;
+        rewind(f);
+    } else {
+        f = fopen(file, "rt");
+        if (!f) {
+            syslog(LOG_ERR, "Cannot open map file: %s: %m", file);
+            exit(EX_NOINPUT);
+        }
     }
     rulep = parserulefile(f);
-    fclose(f);
+    if (f != rewrite_fp)
+        fclose(f);
 
     return rulep;
 }
@@ -250,8 +313,304 @@ static int split_port(char **ap, char **pp)
     return ret;
 }
 
+/*
+ * Set up the supplementary group access list, chroot() if running in
+ * secure mode and switch to the unprivileged user.  Normally done by
+ * each child; with --early-drop, done once before the main loop.
+ */
+static void drop_privileges(const char *user, const struct passwd *pw)
+{
+    int setrv;
+
+    /* Set up the supplementary group access list if possible */
+    /* /etc/group still need to be accessible at this point */
+#ifdef HAVE_INITGROUPS
+    setrv = initgroups(user, pw->pw_gid);
+    if (setrv) {
+        syslog(LOG_ERR, "cannot set groups for user %s", user);
+        exit(EX_OSERR);
+    }
+#else
+    (void)user;
+#ifdef HAVE_SETGROUPS
+    if (setgroups(0, NULL)) {
+        syslog(LOG_ERR, "cannot clear group list");
+    }
+#endif
+#endif
+
+    /* Chroot and drop privileges */
+    if (secure) {
+        if (chroot(".")) {
+            syslog(LOG_ERR, "chroot: %m");
+            exit(EX_OSERR);
+        }
+#ifdef __CYGWIN__
+        if (chdir("/") < 0) {   /* Cygwin chroot() bug workaround */
+            syslog(LOG_ERR, "chroot: %m");
+            exit(EX_OSERR);
+        }
+#endif
+    }
+#ifdef HAVE_SETREGID
+    setrv = setregid(pw->pw_gid, pw->pw_gid);
+#else
+    setrv = setegid(pw->pw_gid) || setgid(pw->pw_gid);
+#endif
+
+#ifdef HAVE_SETREUID
+    setrv = setrv || setreuid(pw->pw_uid, pw->pw_uid);
+#else
+    /* Important: setuid() must come first */
+    setrv = setrv || setuid(pw->pw_uid) ||
+        (geteuid() != pw->pw_uid && seteuid(pw->pw_uid));
+#endif
+
+    if (setrv) {
+        syslog(LOG_ERR, "cannot drop privileges: %m");
+        exit(EX_OSERR);
+    }
+}
+
+/*
+ * For --early-drop: keep the pid file's directory open, so that the pid
+ * file can still be removed after changing root, if the user we run as
+ * may remove it.
+ */
+static void keep_pidfile_dir(const char *pidfile)
+{
+#ifdef HAVE_OPENAT
+    char *dir = tfstrdup(pidfile);
+    char *slash = strrchr(dir, '/');
+
+    if (!slash) {
+        pid_name = pidfile;
+        strcpy(dir, ".");
+    } else {
+        pid_name = pidfile + (slash - dir) + 1;
+        slash[slash == dir] = '\0';    /* "/pidfile" is in "/" */
+    }
+    pid_dirfd = open(dir, O_RDONLY);
+    free(dir);
+#else
+    (void)pidfile;
+#endif
+}
+
+static int remove_pidfile(const char *pidfile)
+{
+#ifdef HAVE_OPENAT
+    if (pid_dirfd >= 0)
+        return unlinkat(pid_dirfd, pid_name, 0);
+#endif
+    return unlink(pidfile);
+}
+
+/*
+ * Open a descriptor for each directory we serve, for --early-drop.
+ * In secure mode we are already in the one directory; without any
+ * directories at all, any absolute path is allowed.
+ */
+static void open_dirfds(void)
+{
+    int i;
+
+    dirfds = xmalloc((ndirs + 1) * sizeof(int));
+
+    if (secure || ndirs == 0) {
+        dirfds[0] = open(secure ? "." : "/", O_RDONLY);
+        if (dirfds[0] < 0) {
+            syslog(LOG_ERR, "%s: %m", secure ? dirs[0] : "/");
+            exit(EX_NOINPUT);
+        }
+        return;
+    }
+
+    for (i = 0; i < ndirs; i++) {
+        dirfds[i] = open(dirs[i], O_RDONLY);
+        if (dirfds[i] < 0) {
+            syslog(LOG_ERR, "%s: %m", dirs[i]);
+            exit(EX_NOINPUT);
+        }
+    }
+}
+
+/*
+ * Check the request from "from" to "myaddr" against hosts_access(5), if
+ * compiled in.  fd is the socket it came in on, or -1 if it was passed
+ * on to us some other way.  Returns nonzero if it may go ahead.
+ */
+static int access_allowed(int fd)
+{
+#ifdef HAVE_TCPWRAPPERS
+    /* Verify if this was a legal request for us.  This has to be
+       done before the chroot, while /etc is still accessible. */
+    request_init(&wrap_request,
+                 RQ_DAEMON, tftpd_progname,
+                 RQ_CLIENT_SIN, &from, RQ_SERVER_SIN, &myaddr, 0);
+    if (fd >= 0)
+        request_set(&wrap_request, RQ_FILE, fd, 0);
+    sock_methods(&wrap_request);
+
+    tmp_p = (char *)inet_ntop(myaddr.sa.sa_family, SOCKADDR_P(&myaddr),
+                              tmpbuf, INET6_ADDRSTRLEN);
+    if (!tmp_p) {
+        tmp_p = tmpbuf;
+        strcpy(tmpbuf, "???");  // TODO: what does this help? CK
+    }
+    if (hosts_access(&wrap_request) == 0) {
+        if (deny_severity != -1)
+            syslog(deny_severity, "connection refused from %s", tmp_p);
+        return 0;
+    } else if (allow_severity != -1) {
+        syslog(allow_severity, "connect from %s", tmp_p);
+    }
+#else
+    (void)fd;
+#endif
+    return 1;
+}
+
+/* Bind the socket in "peer" to a port of our own and connect it to the
+   client.  Returns 0, or -1 after logging the error. */
+static int connect_peer(void)
+{
+    if (pick_port_bind(peer, &myaddr, portrange_from, portrange_to) < 0) {
+        syslog(LOG_ERR, "bind: %m");
+        return -1;
+    }
+
+    if (connect(peer, &from.sa, SOCKLEN(&from)) < 0) {
+        syslog(LOG_ERR, "connect: %m");
+        return -1;
+    }
+
+    /* Disable path MTU discovery */
+    pmtu_discovery_off(peer);
+    return 0;
+}
+
+/* The client address for log messages */
+static void set_client_name(void)
+{
+    tmp_p = (char *)inet_ntop(from.sa.sa_family, SOCKADDR_P(&from),
+                              tmpbuf, INET6_ADDRSTRLEN);
+    if (!tmp_p) {
+        tmp_p = tmpbuf;
+        strcpy(tmpbuf, "???");
+    }
+}
+
+/* Account for the request tftp() has just served */
+static void request_done(void)
+{
+    TFTP_PROBE4(session__end, xrec.op, xrec.filename, xrec.result,
+                xrec.st.bytes);
+    control_session_end();
+    xferlog_write(&xrec, &from);
+    trace_write(&xrec, &from);
+    metrics_session_end(&xrec);
+}
+
+/*
+ * Main loop of a --prefork worker: take requests from the parent and
+ * serve them one at a time, until the parent goes away or retires us.
+ * Whatever tftp() leaves behind in our globals is set back to the
+ * defaults before the next request.
+ */
+static void serve_requests(int wfd)
+{
+    const int timeout = g_timeout;
+    struct tftphdr *tp = (struct tftphdr *)buf;
+    struct iovec iov[4];
+    struct msghdr msg;
+    union sock_addr la;
+    socklen_t lalen;
+    u_short tp_opcode;
+    long received;
+    int n;
+
+    for (;;) {
+        iov[0].iov_base = &from;
+        iov[0].iov_len = sizeof from;
+        iov[1].iov_base = &myaddr;
+        iov[1].iov_len = sizeof myaddr;
+        iov[2].iov_base = &received;
+        iov[2].iov_len = sizeof received;
+        iov[3].iov_base = buf;
+        iov[3].iov_len = sizeof buf - 1;       /* Room for a NUL */
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 4;
+
+        n = recvmsg(wfd, &msg, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            exit(0);            /* Retired, or the parent has exited */
+
+        memset(&xrec, 0, sizeof xrec);
+        xrec.stage[STAGE_RECEIVED] = received;
+        mark_stage(STAGE_SESSION);
+
+        n -= sizeof from + sizeof myaddr + sizeof received;
+        /* wfd is only the socket pair; the addresses are all tcpd gets */
+        if (n < 4 || !access_allowed(-1))
+            goto next;
+        buf[n] = '\0';         /* Not whatever the last request left */
+        mark_stage(STAGE_ACCESS);
+
+        peer = socket(myaddr.sa.sa_family, SOCK_DGRAM, 0);
+        if (peer < 0) {
+            syslog(LOG_ERR, "socket: %m");
+            goto next;
+        }
+
+        if (!connect_peer()) {
+            segsize = SEGSIZE;
+            windowsize = 1;
+            rollover_val = 0;
+            g_timeout = timeout;
+            tsize = 0;
+            tsize_ok = 0;
+            range_offset = range_length = 0;
+            range_ok = 0;
+            set_client_name();
+
+            tp_opcode = ntohs(tp->th_opcode);
+            if (tp_opcode == RRQ || tp_opcode == WRQ) {
+                tftp(tp, n);
+                request_done();
+            }
+            dally_wait();
+        }
+
+        /* Give back the port we leased, if any */
+        lalen = sizeof la;
+        if (getsockname(peer, &la.sa, &lalen))
+            la.sa.sa_family = AF_UNSPEC;
+        close(peer);
+        if (portrange && la.sa.sa_family != AF_UNSPEC)
+            release_port(ntohs(SOCKPORT(&la)));
+
+    next:
+        prefork_ready(wfd);
+    }
+}
+
 enum long_only_options {
     OPT_VERBOSITY       = 256,
+    OPT_EARLY_DROP,
+    OPT_SINGLE_PORT,
+    OPT_MEMORY_LIMIT,
+    OPT_PREFORK,
+    OPT_WRITE_BEHIND,
+    OPT_SPARSE,
+    OPT_ASYNC_LOG,
+    OPT_XFER_LOG,
+    OPT_TRACE,
+    OPT_METRICS,
+    OPT_CONTROL,
 };
 
 static struct option long_options[] = {
@@ -275,6 +634,17 @@ static struct option long_options[] = {
     { "port-range",  1, NULL, 'R' },
     { "map-file",    1, NULL, 'm' },
     { "pidfile",     1, NULL, 'P' },
+    { "early-drop",  0, NULL, OPT_EARLY_DROP },
+    { "single-port", 0, NULL, OPT_SINGLE_PORT },
+    { "memory-limit", 1, NULL, OPT_MEMORY_LIMIT },
+    { "prefork",     1, NULL, OPT_PREFORK },
+    { "write-behind", 1, NULL, OPT_WRITE_BEHIND },
+    { "sparse",      0, NULL, OPT_SPARSE },
+    { "async-log",   0, NULL, OPT_ASYNC_LOG },
+    { "xfer-log",    1, NULL, OPT_XFER_LOG },
+    { "trace",       1, NULL, OPT_TRACE },
+    { "metrics",     1, NULL, OPT_METRICS },
+    { "control",     1, NULL, OPT_CONTROL },
     { NULL, 0, NULL, 0 }
 };
 static const char short_options[] = "46cspvVlLa:B:u:U:r:t:T:R:m:P:";
@@ -284,17 +654,19 @@ int main(int argc, char **argv)
     struct tftphdr *tp;
     struct passwd *pw;
     struct options *opt;
-    union sock_addr myaddr;
     struct sockaddr_in bindaddr4;
 #ifdef HAVE_IPV6
     struct sockaddr_in6 bindaddr6;
     int force_ipv6 = 0;
 #endif
-    int n;
+    int n = 0;
     int fd = -1;
     int fd4 = -1;
     int fd6 = -1;
-    int fdmax = 0;
+    struct pollfd *pfd = NULL;
+    int maxpfd = 0;
+    int child_fd = -1;
+    int worker_fd = -1;
     int standalone = 0;         /* Standalone (listen) mode */
     int nodaemon = 0;           /* Do not detach process */
     char *address = NULL;       /* Address to listen to */
@@ -302,7 +674,6 @@ int main(int argc, char **argv)
     mode_t my_umask = 0;
     int spec_umask = 0;
     int c;
-    int setrv;
     int waittime = 900;         /* Default time to wait for a connect */
     const char *user = "nobody";        /* Default user */
     char *p, *ep;
@@ -444,6 +815,80 @@ int main(int argc, char **argv)
         case 'P':
             pidfile = optarg;
             break;
+        case OPT_EARLY_DROP:
+            early_drop = 1;
+            break;
+        case OPT_SINGLE_PORT:
+            single_port = 1;
+            break;
+        case OPT_MEMORY_LIMIT:
+            {
+                char *vp;
+                uintmax_t lim = strtoumax(optarg, &vp, 10);
+                int shift = 0;
+
+                switch (*vp) {
+                case 'g': case 'G':
+                    shift += 10;
+                    /* fall through */
+                case 'm': case 'M':
+                    shift += 10;
+                    /* fall through */
+                case 'k': case 'K':
+                    shift += 10;
+                    vp++;
+                    break;
+                }
+                if (*vp || lim == 0 || lim > ((size_t)-1 >> shift)) {
+                    syslog(LOG_ERR, "Bad memory limit: %s", optarg);
+                    exit(EX_USAGE);
+                }
+                lim <<= shift;
+                memory_limit = lim;
+            }
+            break;
+        case OPT_PREFORK:
+            {
+                char *vp;
+                unsigned long nw = strtoul(optarg, &vp, 10);
+                if (nw < 1 || nw > MAX_PREFORK || *vp) {
+                    syslog(LOG_ERR, "Bad number of workers (range 1-%d): %s",
+                           MAX_PREFORK, optarg);
+                    exit(EX_USAGE);
+                }
+                prefork = nw;
+            }
+            break;
+        case OPT_WRITE_BEHIND:
+            {
+                char *vp;
+                unsigned long nb = strtoul(optarg, &vp, 10);
+                if (nb > MAX_WRITE_BEHIND || *vp) {
+                    syslog(LOG_ERR, "Bad number of buffers (range 0-%d): %s",
+                           MAX_WRITE_BEHIND, optarg);
+                    exit(EX_USAGE);
+                }
+                write_behind = nb;
+            }
+            break;
+        case OPT_SPARSE:
+            sparse_writes = 1;
+            break;
+        case OPT_ASYNC_LOG:
+            async_log = 1;
+            break;
+        case OPT_XFER_LOG:
+            xfer_log = optarg;
+            break;
+        case OPT_TRACE:
+            trace_path = optarg;
+            break;
+        case OPT_METRICS:
+            metrics_dest = optarg;
+            break;
+        case OPT_CONTROL:
+            control_path = optarg;
+            break;
         default:
             syslog(LOG_ERR, "Unknown option: '%c'", optopt);
             break;
@@ -486,6 +931,66 @@ int main(int argc, char **argv)
         pidfile = NULL;
     }
 
+    if (single_port && !standalone) {
+        syslog(LOG_WARNING, "not in standalone mode, ignoring --single-port");
+        single_port = 0;
+    }
+    if (single_port && portrange) {
+        syslog(LOG_WARNING, "--single-port given, ignoring port range");
+        portrange = 0;
+    }
+
+    if (prefork && !standalone) {
+        syslog(LOG_WARNING, "not in standalone mode, ignoring --prefork");
+        prefork = 0;
+    }
+    if (prefork && single_port) {
+        syslog(LOG_WARNING, "--single-port given, ignoring --prefork");
+        prefork = 0;
+    }
+
+    if (metrics_dest && !standalone) {
+        syslog(LOG_WARNING, "not in standalone mode, ignoring --metrics");
+        metrics_dest = NULL;
+    }
+    if (control_path && !standalone) {
+        syslog(LOG_WARNING, "not in standalone mode, ignoring --control");
+        control_path = NULL;
+    }
+
+    /* Opened here, before any chroot or change of user */
+    if (xfer_log && xferlog_open(xfer_log)) {
+        syslog(LOG_ERR, "cannot open transfer log %s: %m", xfer_log);
+        exit(EX_CANTCREAT);
+    }
+    if (trace_path && trace_open(trace_path)) {
+        syslog(LOG_ERR, "cannot open trace %s: %m", trace_path);
+        exit(EX_CANTCREAT);
+    }
+
+    /* From here on, requests are logged through a separate process */
+    if (async_log && alog_start(pw))
+        syslog(LOG_WARNING, "cannot start log process, logging directly: %m");
+
+    /* Account for the transfer buffers of all children together */
+    pool_init(memory_limit);
+
+    /* Children lease their ports from a map shared with each other,
+       rather than probing the range with bind() */
+    if (portrange && port_map_init(portrange_from, portrange_to))
+        syslog(LOG_WARNING, "cannot set up port map, probing ports instead: %m");
+
+    /* After pool_init(), so the buffer accounting is shared with it */
+    if (metrics_dest &&
+        metrics_start(metrics_dest, pw, errmsgs, ERR_CNT)) {
+        syslog(LOG_ERR, "cannot start metrics on %s: %m", metrics_dest);
+        exit(EX_OSERR);
+    }
+    if (control_path && control_start(control_path, pw)) {
+        syslog(LOG_ERR, "cannot open control socket %s: %m", control_path);
+        exit(EX_OSERR);
+    }
+
     /* If we're running standalone, set up the input port */
     if (standalone) {
         FILE *pf;
@@ -689,16 +1194,25 @@ int main(int argc, char **argv)
                     syslog(LOG_ERR, "error closing pid file '%s': %m", pidfile);
             }
         }
-        if (fd6 > fd4)
-            fdmax = fd6;
-        else
-            fdmax = fd4;
+        if (metrics_dest) {
+            if (fd4 >= 0)
+                set_rxq_opts(fd4);
+            if (fd6 >= 0)
+                set_rxq_opts(fd6);
+        }
+        if (single_port) {
+            if (fd4 >= 0)
+                set_dstaddr_opts(fd4, AF_INET);
+#ifdef HAVE_IPV6
+            if (fd6 >= 0)
+                set_dstaddr_opts(fd6, AF_INET6);
+#endif
+        }
     } else {
         /* 0 is our socket descriptor */
         close(1);
         close(2);
         fd = 0;
-        fdmax = 0;
         /* Note: on Cygwin, select() on a nonblocking socket becomes
            a nonblocking select. */
 #ifndef __CYGWIN__
@@ -724,13 +1238,41 @@ int main(int argc, char **argv)
     if (spec_umask || !unixperms)
         umask(my_umask);
 
+    /* Open the served directories and give up root once, rather than
+       in every child */
+    if (early_drop) {
+        open_dirfds();
+#ifdef WITH_REGEX
+        if (rewrite_file) {
+            rewrite_fp = fopen(rewrite_file, "rt");
+            if (!rewrite_fp) {
+                syslog(LOG_ERR, "Cannot open map file: %s: %m", rewrite_file);
+                exit(EX_NOINPUT);
+            }
+        }
+#endif
+        if (pidfile)
+            keep_pidfile_dir(pidfile);
+        drop_privileges(user, pw);
+    }
+
+    if (prefork)
+        prefork_init(prefork);
+
     while (1) {
-        fd_set readset;
-        struct timeval tv_waittime;
-        int rv;
+        int rv, npfd, nlisten, i;
+        struct session *sess;
+        struct iovec iov[4];
+        long received;
 
         if (exit_signal) { /* happens in standalone mode only */
-            if (pidfile && unlink(pidfile)) {
+            if (pidfile && remove_pidfile(pidfile)) {
+                if (early_drop) {
+                    /* Quite possibly not ours to remove any more */
+                    syslog(LOG_NOTICE, "pid file '%s' left behind: %m",
+                           pidfile);
+                    exit(0);
+                }
                 syslog(LOG_WARNING, "error removing pid file '%s': %m", pidfile);
                 exit(EX_OSERR);
             } else {
@@ -747,29 +1289,46 @@ int main(int argc, char **argv)
                     rewrite_rules = read_remap_rules(rewrite_file);
                 }
 #endif
+                /* The workers have the old rules */
+                if (prefork)
+                    prefork_restart();
             } else {
                 /* Return to inetd for respawn */
                 exit(0);
             }
         }
 
-        FD_ZERO(&readset);
+        /* Start the workers, and replace those which have died */
+        if (prefork && (worker_fd = prefork_maintain()) >= 0)
+            break;
+
+        npfd = 2 + (single_port ? demux_count() : 0) + prefork;
+        if (npfd > maxpfd) {
+            maxpfd = npfd * 2;
+            pfd = xrealloc(pfd, maxpfd * sizeof *pfd);
+        }
+
+        npfd = 0;
         if (standalone) {
             if (fd4 >= 0) {
-                FD_SET(fd4, &readset);
 #ifdef __CYGWIN__
                 /* On Cygwin, select() on a nonblocking socket returns
                    immediately, with a rv of 0! */
                 set_socket_nonblock(fd4, 0);
 #endif
+                pfd[npfd].fd = fd4;
+                pfd[npfd].events = POLLIN;
+                pfd[npfd++].revents = 0;
             }
             if (fd6 >= 0) {
-                FD_SET(fd6, &readset);
 #ifdef __CYGWIN__
                 /* On Cygwin, select() on a nonblocking socket returns
                    immediately, with a rv of 0! */
                 set_socket_nonblock(fd6, 0);
 #endif
+                pfd[npfd].fd = fd6;
+                pfd[npfd].events = POLLIN;
+                pfd[npfd++].revents = 0;
             }
         } else { /* fd always 0 */
             fd = 0;
@@ -778,40 +1337,58 @@ int main(int argc, char **argv)
                immediately, with a rv of 0! */
             set_socket_nonblock(fd, 0);
 #endif
-            FD_SET(fd, &readset);
+            pfd[npfd].fd = fd;
+            pfd[npfd].events = POLLIN;
+            pfd[npfd++].revents = 0;
         }
-        tv_waittime.tv_sec = waittime;
-        tv_waittime.tv_usec = 0;
-
-
-        /* Never time out if we're in standalone mode */
-        rv = select(fdmax + 1, &readset, NULL, NULL,
-                    standalone ? NULL : &tv_waittime);
+        nlisten = npfd;
+        if (single_port)
+            npfd += demux_pollfds(pfd + npfd);
+        if (prefork)
+            npfd += prefork_pollfds(pfd + npfd);
+
+        /* Never time out if we're in standalone mode, other than to
+           restart workers */
+        rv = poll(pfd, npfd, standalone ? (prefork ? prefork_timeout() : -1)
+                  : waittime * 1000);
         if (rv == -1 && errno == EINTR)
             continue;           /* Signal caught, reloop */
 
         if (rv == -1) {
-            syslog(LOG_ERR, "select loop: %m");
+            syslog(LOG_ERR, "poll loop: %m");
             exit(EX_IOERR);
-        } else if (rv == 0) {
+        } else if (rv == 0 && !standalone) {
             exit(0);            /* Timeout, return to inetd */
         }
 
-        if (standalone) {
-            if ((fd4 >= 0) && FD_ISSET(fd4, &readset))
-                fd = fd4;
-            else if ((fd6 >= 0) && FD_ISSET(fd6, &readset))
-                fd = fd6;
-            else /* not in set ??? */
-                continue;
+        /* Pass on whatever the children have sent */
+        if (single_port)
+            demux_relay(pfd + nlisten, npfd - nlisten);
+        if (prefork)
+            prefork_events(pfd + nlisten, npfd - nlisten);
+
+        fd = -1;
+        for (i = 0; i < nlisten; i++) {
+            if (pfd[i].revents) {
+                fd = pfd[i].fd;
+                break;
+            }
         }
+        if (fd < 0)
+            continue;
 #ifdef __CYGWIN__
         /* On Cygwin, select() on a nonblocking socket returns
            immediately, with a rv of 0! */
         set_socket_nonblock(fd, 0);
 #endif
 
-        n = myrecvfrom(fd, buf, sizeof(buf), 0, &from, &myaddr);
+        /* The listeners already have the options set in single-port mode,
+           and the local address only matters for new sessions */
+        if (single_port)
+            n = myrecvfrom_quick(fd, buf, sizeof(buf), 0, &from, &myaddr);
+        else
+            n = myrecvfrom(fd, buf, sizeof(buf), 0, &from, &myaddr);
+        received = xfer_now_us();
 
         if (n < 0) {
             if (E_WOULD_BLOCK(errno) || errno == EINTR) {
@@ -821,6 +1398,8 @@ int main(int argc, char **argv)
                 exit(EX_IOERR);
             }
         }
+        if (metrics_dest)
+            metrics_rx_dropped(fd != fd4, rxq_dropped);
 #ifdef HAVE_IPV6
         if ((from.sa.sa_family != AF_INET) && (from.sa.sa_family != AF_INET6)) {
             syslog(LOG_ERR, "received address was not AF_INET/AF_INET6,"
@@ -833,6 +1412,24 @@ int main(int argc, char **argv)
             exit(EX_PROTOCOL);
         }
 
+        if (single_port) {
+            tp = (struct tftphdr *)buf;
+            tp_opcode = (n >= 2) ? ntohs(tp->th_opcode) : 0;
+
+            sess = demux_lookup(&from);
+            if (sess) {
+                /* A repeated request is answered by the child itself,
+                   if at all; everything else is the child's business */
+                if (tp_opcode != RRQ && tp_opcode != WRQ)
+                    demux_forward(sess, buf, n);
+                continue;
+            }
+            if (tp_opcode != RRQ && tp_opcode != WRQ)
+                continue;       /* Left over from a finished transfer */
+
+            check_local_address(&myaddr);
+        }
+
         if (standalone) {
             if ((from.sa.sa_family == AF_INET) &&
                 (myaddr.si.sin_addr.s_addr == INADDR_ANY)) {
@@ -850,19 +1447,54 @@ int main(int argc, char **argv)
             }
         }
 
+        memset(&xrec, 0, sizeof xrec);
+        xrec.stage[STAGE_RECEIVED] = received;
+
+        /*
+         * Hand the request to a worker if one is idle; otherwise fork
+         * a child for it as usual.
+         */
+        if (prefork) {
+            tp = (struct tftphdr *)buf;
+            tp_opcode = (n >= 2) ? ntohs(tp->th_opcode) : 0;
+            if (tp_opcode != RRQ && tp_opcode != WRQ)
+                continue;
+
+            iov[0].iov_base = &from;
+            iov[0].iov_len = sizeof from;
+            iov[1].iov_base = &myaddr;
+            iov[1].iov_len = sizeof myaddr;
+            iov[2].iov_base = &received;
+            iov[2].iov_len = sizeof received;
+            iov[3].iov_base = buf;
+            iov[3].iov_len = n;
+            if (!prefork_dispatch(iov, 4))
+                continue;
+        }
+
         /*
          * Now that we have read the request packet from the UDP
          * socket, we fork and go back to listening to the socket.
          */
+        if (single_port) {
+            child_fd = demux_create(&from, &myaddr, fd);
+            if (child_fd < 0)
+                continue;
+        }
+
         pid = fork();
         if (pid < 0) {
             syslog(LOG_ERR, "fork: %m");
             exit(EX_OSERR);     /* Return to inetd, just in case */
         } else if (pid == 0)
             break;              /* Child exit, parent loop */
+
+        if (single_port)
+            close(child_fd);
     }
 
     /* Child process: handle the actual request here */
+    mark_stage(STAGE_SESSION);
 
     /* Ignore SIGHUP */
     set_signal(SIGHUP, SIG_IGN, 0);
@@ -870,117 +1502,82 @@ int main(int argc, char **argv)
     /* Make sure the log socket is still connected.  This has to be
        done before the chroot, while /dev/log is still accessible.
        When not running standalone, there is little chance that the
-       syslog daemon gets restarted by the time we get here. */
-    if (secure && standalone) {
+       syslog daemon gets restarted by the time we get here.
+       With --early-drop we are already chrooted, so just keep the
+       socket we have. */
+    if (secure && standalone && !early_drop) {
         closelog();
         openlog(tftpd_progname, LOG_PID | LOG_NDELAY, LOG_DAEMON);
     }
 
-#ifdef HAVE_TCPWRAPPERS
-    /* Verify if this was a legal request for us.  This has to be
-       done before the chroot, while /etc is still accessible. */
-    request_init(&wrap_request,
-                 RQ_DAEMON, tftpd_progname,
-                 RQ_FILE, fd,
-                 RQ_CLIENT_SIN, &from, RQ_SERVER_SIN, &myaddr, 0);
-    sock_methods(&wrap_request);
-
-    tmp_p = (char *)inet_ntop(myaddr.sa.sa_family, SOCKADDR_P(&myaddr),
-                              tmpbuf, INET6_ADDRSTRLEN);
-    if (!tmp_p) {
-        tmp_p = tmpbuf;
-        strcpy(tmpbuf, "???");  // TODO: what does this help? CK
-    }
-    if (hosts_access(&wrap_request) == 0) {
-        if (deny_severity != -1)
-            syslog(deny_severity, "connection refused from %s", tmp_p);
-        exit(EX_NOPERM);        /* Access denied */
-    } else if (allow_severity != -1) {
-        syslog(allow_severity, "connect from %s", tmp_p);
-    }
-#endif
-
-    /* Close file descriptors we don't need */
-    close(fd);
+    if (worker_fd >= 0) {
+        if (fd4 >= 0)
+            close(fd4);
+        if (fd6 >= 0)
+            close(fd6);
 
-    /* Get a socket.  This has to be done before the chroot(), since
-       some systems require access to /dev to create a socket. */
+        if (!early_drop)
+            drop_privileges(user, pw);
 
-    peer = socket(myaddr.sa.sa_family, SOCK_DGRAM, 0);
-    if (peer < 0) {
-        syslog(LOG_ERR, "socket: %m");
-        exit(EX_IOERR);
+        serve_requests(worker_fd);
     }
 
-    /* Set up the supplementary group access list if possible */
-    /* /etc/group still need to be accessible at this point */
-#ifdef HAVE_INITGROUPS
-    setrv = initgroups(user, pw->pw_gid);
-    if (setrv) {
-        syslog(LOG_ERR, "cannot set groups for user %s", user);
-        exit(EX_OSERR);
-    }
-#else
-#ifdef HAVE_SETGROUPS
-    if (setgroups(0, NULL)) {
-        syslog(LOG_ERR, "cannot clear group list");
-    }
-#endif
-#endif
+    if (!access_allowed(fd))
+        exit(EX_NOPERM);        /* Access denied */
+    mark_stage(STAGE_ACCESS);
 
-    /* Chroot and drop privileges */
-    if (secure) {
-        if (chroot(".")) {
-            syslog(LOG_ERR, "chroot: %m");
-            exit(EX_OSERR);
-        }
-#ifdef __CYGWIN__
-        if (chdir("/") < 0) {   /* Cygwin chroot() bug workaround */
-            syslog(LOG_ERR, "chroot: %m");
-            exit(EX_OSERR);
+    /* Close file descriptors we don't need */
+    if (prefork)
+        prefork_child_cleanup();
+    if (single_port) {
+        /* Our traffic goes through the parent; the socket pair is
+           already "connected" to the client */
+        demux_child_cleanup();
+        if (fd4 >= 0)
+            close(fd4);
+        if (fd6 >= 0)
+            close(fd6);
+        peer = child_fd;
+
+        if (!early_drop) {
+            drop_privileges(user, pw);
+            mark_stage(STAGE_PRIVDROP);
         }
-#endif
-    }
-#ifdef HAVE_SETREGID
-    setrv = setregid(pw->pw_gid, pw->pw_gid);
-#else
-    setrv = setegid(pw->pw_gid) || setgid(pw->pw_gid);
-#endif
+    } else {
+        close(fd);
 
-#ifdef HAVE_SETREUID
-    setrv = setrv || setreuid(pw->pw_uid, pw->pw_uid);
-#else
-    /* Important: setuid() must come first */
-    setrv = setrv || setuid(pw->pw_uid) ||
-        (geteuid() != pw->pw_uid && seteuid(pw->pw_uid));
-#endif
+        /* Get a socket.  This has to be done before the chroot(), since
+           some systems require access to /dev to create a socket. */
 
-    if (setrv) {
-        syslog(LOG_ERR, "cannot drop privileges: %m");
-        exit(EX_OSERR);
-    }
+        peer = socket(myaddr.sa.sa_family, SOCK_DGRAM, 0);
+        if (peer < 0) {
+            syslog(LOG_ERR, "socket: %m");
+            exit(EX_IOERR);
+        }
 
-    /* Process the request... */
-    if (pick_port_bind(peer, &myaddr, portrange_from, portrange_to) < 0) {
-        syslog(LOG_ERR, "bind: %m");
-        exit(EX_IOERR);
-    }
+        if (!early_drop) {
+            drop_privileges(user, pw);
+            mark_stage(STAGE_PRIVDROP);
+        }
 
-    if (connect(peer, &from.sa, SOCKLEN(&from)) < 0) {
-        syslog(LOG_ERR, "connect: %m");
-        exit(EX_IOERR);
+        /* Process the request... */
+        if (connect_peer())
+            exit(EX_IOERR);
     }
 
-    /* Disable path MTU discovery */
-    pmtu_discovery_off(peer);
-
+    set_client_name();
     tp = (struct tftphdr *)buf;
     tp_opcode = ntohs(tp->th_opcode);
-    if (tp_opcode == RRQ || tp_opcode == WRQ)
+    if (tp_opcode == RRQ || tp_opcode == WRQ) {
         tftp(tp, n);
+        request_done();
+    }
+    dally_wait();               /* After a WRQ, in case the last ACK is lost */
     exit(0);
 }
 
+static FILE *file;
+
 static char *rewrite_access(char *, int, int, const char **);
 static int validate_access(char *, int, const struct formats *, const char **);
 static void tftp_sendfile(const struct formats *, struct tftphdr *, int, char *);
@@ -1021,6 +1618,11 @@ int tftp(struct tftphdr *tp, int size)
 
     ((struct tftphdr *)pktbuf)->th_opcode = htons(OACK);
 
+    xrec.op = tp_opcode == WRQ ? "WRQ" : "RRQ";
+    xrec.request = xfer_now();
+    metrics_session_start();
+
+    file = NULL;                /* Until validate_access() opens it */
     origfilename = cp = (char *)&(tp->th_stuff);
     argn = 0;
 
@@ -1031,9 +1633,9 @@ int tftp(struct tftphdr *tp, int size)
             cp++;
         } while (cp < end && *cp);
 
-        if (*cp) {
+        if (cp >= end) {
             nak(EBADOP, "Request not null-terminated");
-            exit(0);
+            goto refused;
         }
 
         argn++;
@@ -1048,15 +1650,23 @@ int tftp(struct tftphdr *tp, int size)
             }
             if (!pf->f_mode) {
                 nak(EBADOP, "Unknown mode");
-                exit(0);
+                goto refused;
             }
-            if (!(filename = (*pf->f_rewrite)
-                (origfilename, tp_opcode, from.sa.sa_family, &errmsgptr))) {
+            xrec.mode = pf->f_mode;
+            set_xrec(xrec.filename, origfilename);
+            set_xrec(xrec.reqname, origfilename);
+            TFTP_PROBE3(request, tp_opcode, origfilename, mode);
+            filename = (*pf->f_rewrite)
+                (origfilename, tp_opcode, from.sa.sa_family, &errmsgptr);
+            mark_stage(STAGE_REMAP);
+            if (!filename) {
                 nak(EACCESS, errmsgptr);        /* File denied by mapping rule */
-                exit(0);
+                goto refused;
             }
+            set_xrec(xrec.filename, filename);
             ecode =
                 (*pf->f_validate) (filename, tp_opcode, pf, &errmsgptr);
+            mark_stage(STAGE_OPEN);
 
             if (verbosity >= 1) {
                 tmp_p = (char *)inet_ntop(from.sa.sa_family, SOCKADDR_P(&from),
@@ -1068,40 +1678,51 @@ int tftp(struct tftphdr *tp, int size)
 
                 if (filename == origfilename
                     || !strcmp(filename, origfilename))
-                    syslog(LOG_NOTICE, "%s from %s filename %s\n",
-                           tp_opcode == WRQ ? "WRQ" : "RRQ",
-                           tmp_p, filename);
+                    alog(LOG_NOTICE, "%s from %s filename %s\n",
+                         tp_opcode == WRQ ? "WRQ" : "RRQ",
+                         tmp_p, filename);
                 else
-                    syslog(LOG_NOTICE,
-                           "%s from %s filename %s remapped to %s\n",
-                           tp_opcode == WRQ ? "WRQ" : "RRQ",
-                           tmp_p, origfilename,
-                           filename);
+                    alog(LOG_NOTICE,
+                         "%s from %s filename %s remapped to %s\n",
+                         tp_opcode == WRQ ? "WRQ" : "RRQ",
+                         tmp_p, origfilename,
+                         filename);
 
                 if (ecode == 1) {
-                    syslog(LOG_NOTICE, "Client %s File not found %s\n",
-                    tmp_p,filename);
+                    alog(LOG_NOTICE, "Client %s File not found %s\n",
+                  tmp_p,filename);
                 }
             }
 
+            if (ecode < 0) {
+                xrec.result = "refused";
+                set_xrec(xrec.error, "Duplicate request");
+                goto refused;   /* Duplicate request, already being served */
+            }
             if (ecode) {
                 nak(ecode, errmsgptr);
-                exit(0);
+                goto refused;
             }
             opt = ++cp;
         } else if (argn & 1) {
             val = ++cp;
         } else {
-            do_opt(opt, val, &ap);
+            if (do_opt(opt, val, &ap))
+                goto refused;
             opt = ++cp;
         }
     }
 
     if (!pf) {
         nak(EBADOP, "Missing mode");
-        exit(0);
+        goto refused;
     }
 
+    xrec.blksize = segsize;
+    xrec.windowsize = windowsize;
+    xrec.timeout = g_timeout;
+    control_session_start(&from, &xrec);
+
     if (ap != (pktbuf + 2)) {
         if (tp_opcode == WRQ)
             (*pf->f_recv) (pf, (struct tftphdr *)pktbuf, ap - pktbuf);
@@ -1113,7 +1734,15 @@ int tftp(struct tftphdr *tp, int size)
         else
             (*pf->f_send) (pf, NULL, 0, origfilename);
     }
-    exit(0);                    /* Request completed */
+    return 0;                   /* Request completed */
+
+refused:
+    /* Keep a --prefork worker from holding on to the file, or its lock */
+    if (file) {
+        fclose(file);
+        file = NULL;
+    }
+    return 0;
 }
 
 static int blksize_set;
@@ -1192,11 +1821,11 @@ static int set_tsize(uintmax_t *vp)
     uintmax_t sz = *vp;
 
     if (!tsize_ok) {
-        syslog(LOG_WARNING, "tftpd: mode netascii: tsize_ok == false!\n");
+        alog(LOG_WARNING, "tftpd: mode netascii: tsize_ok == false!\n");
         return 0;
     }
 
-    syslog(LOG_NOTICE, "tftpd: mode octet: tsize == %zu!\n", tsize);
+    alog(LOG_NOTICE, "tftpd: mode octet: tsize == %zu!\n", tsize);
     if (sz == 0)
         sz = tsize; // RRQ, tsize from validate_access()
     else
@@ -1249,6 +1878,33 @@ static int set_windowsize(uintmax_t *vp)
     return 1;
 }
 
+/*
+ * Start an RRQ part of the way into the file (nonstandard), to resume
+ * a download or to fetch one part of it while others fetch the rest.
+ * Not in netascii mode, where offsets in the file and in the transfer
+ * differ.
+ */
+static int set_offset(uintmax_t *vp)
+{
+    if (!range_ok || *vp > tsize)
+        return 0;
+
+    range_offset = *vp;
+    return 1;
+}
+
+/*
+ * Send no more than this many bytes of an RRQ (nonstandard)
+ */
+static int set_length(uintmax_t *vp)
+{
+    if (!range_ok || *vp == 0)
+        return 0;
+
+    range_length = *vp;
+    return 1;
+}
+
 /*
  * Conservative calculation for the size of a buffer which can hold an
  * arbitrary integer
@@ -1257,9 +1913,10 @@ static int set_windowsize(uintmax_t *vp)
 
 /*
  * Parse RFC2347 style options; we limit the arguments to positive
- * integers which matches all our current options.
+ * integers which matches all our current options.  Returns -1 if the
+ * request has been refused.
  */
-static void do_opt(const char *opt, const char *val, char **ap)
+static int do_opt(const char *opt, const char *val, char **ap)
 {
     struct options *po;
     char retbuf[OPTBUFSIZE];
@@ -1272,12 +1929,12 @@ static void do_opt(const char *opt, const char *val, char **ap)
     blksize_set = 0;
 
     if (!*opt || !*val)
-        return;
+        return 0;
 
     errno = 0;
     v = strtoumax(val, &vend, 10);
     if (*vend || errno == ERANGE)
-        return;
+        return 0;
 
     for (po = options; po->o_opt; po++)
         if (!strcasecmp(po->o_opt, opt)) {
@@ -1287,7 +1944,7 @@ static void do_opt(const char *opt, const char *val, char **ap)
 
                 if (p + optlen + retlen + 2 >= pktbuf + sizeof(pktbuf)) {
                     nak(EOPTNEG, "Insufficient space for options");
-                    exit(0);
+                    return -1;
                 }
 
                 memcpy(p, opt, optlen+1);
@@ -1295,7 +1952,7 @@ static void do_opt(const char *opt, const char *val, char **ap)
                 memcpy(p, retbuf, retlen+1);
                 p += retlen+1;
             } else {
-                syslog(LOG_WARNING, "tftpd: Unsupported option(%s:%s) requested", opt, val);
+                alog(LOG_WARNING, "tftpd: Unsupported option(%s:%s) requested", opt, val);
                 //NO! nak(EOPTNEG, "Unsupported option(s) requested");
                 //NO! exit(0); CK
             }
@@ -1303,6 +1960,7 @@ static void do_opt(const char *opt, const char *val, char **ap)
         }
 
     *ap = p;
+    return 0;
 }
 
 #ifdef WITH_REGEX
@@ -1365,10 +2023,13 @@ static char *rewrite_access(char *filename, int mode, int af,
                              const char **msg)
 {
     if (rewrite_rules) {
+        long start = xfer_now_us();
         char *newname =
             rewrite_string(filename, rewrite_rules,
                            mode != RRQ ? 'P' : 'G', af,
                            rewrite_macros, msg);
+        metrics_remap(xfer_now_us() - start);
+        TFTP_PROBE2(remap, filename, newname);
         filename = newname;
     }
     return filename;
@@ -1384,7 +2045,34 @@ static char *rewrite_access(char *filename, int mode, int af, const char **msg)
 }
 #endif
 
-static FILE *file;
+/*
+ * With --early-drop, find the directory descriptor a filename lives
+ * under, and the rest of the name relative to it.  Returns -1 if the
+ * file is not in any of the permitted directories.
+ */
+static int lookup_dirfd(const char *filename, const char **relname)
+{
+    const char **dirp;
+    size_t len;
+
+    if (secure || ndirs == 0) {
+        *relname = filename;
+        return dirfds[0];
+    }
+
+    for (dirp = dirs; *dirp; dirp++) {
+        len = strlen(*dirp);
+        if (strncmp(filename, *dirp, len) == 0 &&
+            (filename[len] == '/' || filename[len] == '\0' ||
+             (len && (*dirp)[len - 1] == '/'))) {
+            *relname = filename + len;
+            return dirfds[dirp - dirs];
+        }
+    }
+
+    return -1;
+}
+
 /*
  * Validate file access.  Since we
  * have no uid or gid, for now require
@@ -1395,18 +2083,23 @@ static FILE *file;
  * in one of the given directory prefixes.
  * Note also, full path name must be
  * given as we have no login directory.
+ * Returns -1, without a message, if the
+ * file is locked by another transfer.
  */
 static int validate_access(char *filename, int mode,
                            const struct formats *pf, const char **errmsg)
 {
     struct stat stbuf = {};
     int i, len;
-    int fd, wmode, rmode;
+    int fd, dirfd, wmode, rmode;
+    long start;
+    const char *relname;
     char *cp;
     const char **dirp;
     char stdio_mode[3];
 
     tsize_ok = 0;
+    range_ok = 0;
     *errmsg = NULL;
 
     if (!secure) {
@@ -1414,7 +2107,10 @@ static int validate_access(char *filename, int mode,
             *errmsg = "Only absolute filenames allowed";
             return (EACCESS);
         }
+    }
 
+    /* With --early-drop, open_beneath() does the checks below */
+    if (!secure && !early_drop) {
         /*
          * prevent tricksters from getting around the directory
          * restrictions
@@ -1448,12 +2144,27 @@ static int validate_access(char *filename, int mode,
     wmode |= O_TRUNC;           /* This really sucks on a dupe */
 #endif
 
-    fd = open(filename, mode == RRQ ? rmode : wmode, 0666);
+    start = xfer_now_us();
+    if (early_drop) {
+        dirfd = lookup_dirfd(filename, &relname);
+        if (dirfd < 0) {
+            *errmsg = "Forbidden directory";
+            return (EACCESS);
+        }
+        fd = open_beneath(dirfd, relname, mode == RRQ ? rmode : wmode, 0666);
+    } else {
+        fd = open(filename, mode == RRQ ? rmode : wmode, 0666);
+    }
+    metrics_open(xfer_now_us() - start);
+    TFTP_PROBE3(open, filename, fd, fd < 0 ? errno : 0);
     if (fd < 0) {
         switch (errno) {
         case ENOENT:
         case ENOTDIR:
             return ENOTFOUND;
+        case EXDEV:
+            *errmsg = "Reverse path not allowed";
+            return (EACCESS);
         case ENOSPC:
             return ENOSPACE;
         case EEXIST:
@@ -1467,21 +2178,26 @@ static int validate_access(char *filename, int mode,
         exit(EX_OSERR);         /* This shouldn't happen */
 
     /* A duplicate RRQ or (worse!) WRQ packet could really cause havoc... */
-    if (lock_file(fd, mode != RRQ))
-        exit(0);
+    if (lock_file(fd, mode != RRQ)) {
+        close(fd);
+        return -1;
+    }
 
     if (mode == RRQ) {
         if (!unixperms && (stbuf.st_mode & (S_IREAD >> 6)) == 0) {
             *errmsg = "File must have global read permissions";
+            close(fd);
             return (EACCESS);
         }
         tsize = stbuf.st_size;
         /* We don't know the tsize if conversion is needed */
         tsize_ok = !pf->f_convert;
+        range_ok = !pf->f_convert;
     } else {
         if (!unixperms) {
             if ((stbuf.st_mode & (S_IWRITE >> 6)) == 0) {
                 *errmsg = "File must have global write permissions";
+                close(fd);
                 return (EACCESS);
             }
         }
@@ -1490,6 +2206,7 @@ static int validate_access(char *filename, int mode,
         /* We didn't get to truncate the file at open() time */
         if (ftruncate(fd, (off_t) 0)) {
           *errmsg = "Cannot reset file size";
+          close(fd);
           return (EACCESS);
         }
 #endif
@@ -1509,6 +2226,46 @@ static int validate_access(char *filename, int mode,
     return (0);
 }
 
+/*
+ * Fill in how the transfer ended for --xfer-log.
+ */
+static void set_result(int r, int timed_out)
+{
+    if (xrec.result)
+        return;                 /* Refused, by nak() */
+    if (timed_out || r == E_TIMED_OUT) {
+        xrec.result = "timeout";
+        return;
+    }
+
+    xrec.result = r ? "error" : "ok";
+    if (xrec.error[0])
+        return;                 /* Already have the details */
+    switch (r) {
+    case E_RECEIVED_ERROR:
+        set_xrec(xrec.error, "Error from client");
+        break;
+    case E_UNEXPECTED_PACKET:
+        set_xrec(xrec.error, "Unexpected packet");
+        break;
+    case E_FAILED_TO_READ:
+        set_xrec(xrec.error, "Error while reading the file");
+        break;
+    case E_FAILED_TO_WRITE:
+        set_xrec(xrec.error, "Error while writing the file");
+        break;
+    case E_NO_MEMORY:
+        set_xrec(xrec.error, "Transfer memory limit reached");
+        break;
+    case E_CANCELLED:
+        set_xrec(xrec.error, "Transfer cancelled");
+        break;
+    case E_SYSTEM_ERROR:
+        set_xrec(xrec.error, "System error");
+        break;
+    }
+}
+
 /*
  * Send the requested file.
  */
@@ -1525,13 +2282,18 @@ static void tftp_sendfile(const struct formats *pf, struct tftphdr *oap, int oac
     if (oap) {
         do {
             if (send(peer, oap, oacklen, 0) != oacklen) {
-                syslog(LOG_WARNING, "tftpd: oack: %m\n");
+                alog(LOG_WARNING, "tftpd: oack: %m\n");
+                r = E_SYSTEM_ERROR;
                 goto abort;
             }
+            TFTP_PROBE1(oack__sent, oacklen);
+            if (!xrec.stage[STAGE_OACK])
+                mark_stage(STAGE_OACK);
 
             n = recv_with_timeout(peer, pktbuf, sizeof(pktbuf), g_timeout);
             if (n < 0) {
-                syslog(LOG_WARNING, "tftpd: recv: %m");
+                alog(LOG_WARNING, "tftpd: recv: %m");
+                r = E_SYSTEM_ERROR;
                 goto abort;
             } else if (n == 0) {
                 if (--retries <= 0) {
@@ -1544,21 +2306,45 @@ static void tftp_sendfile(const struct formats *pf, struct tftphdr *oap, int oac
             tp_opcode = ntohs(tp->th_opcode);
             tp_block  = ntohs(tp->th_block);
 
-            if (tp_opcode == ERROR) {
+            if (tp_opcode == ERROR && ntohs(tp->th_code) == EOPTNEG) {
+                /* Turned down the options, as a striping client does to
+                   ask for the file in parts instead; not a failure */
+                xrec.result = "declined";
+                fclose(file);
+                return;
+            } else if (tp_opcode == ERROR) {
                 char error[ERROR_MAXLEN];
 
                 format_error(tp, error);
-                syslog(LOG_WARNING, "%s", error);
+                alog(LOG_WARNING, "%s", error);
+                set_xrec(xrec.error, error);
+                r = E_RECEIVED_ERROR;
                 goto abort;
             } else if (!(tp_opcode == ACK && tp_block == 0)) {
-                syslog(LOG_WARNING, "unexpected packet %s block=%u", opcode_to_str(tp_opcode), tp_block);
+                alog(LOG_WARNING, "unexpected packet %s block=%u", opcode_to_str(tp_opcode), tp_block);
                 send_error(peer, NULL, "Unexpected packet");
-                exit(1);
+                r = E_UNEXPECTED_PACKET;
+                goto abort;
             }
         } while (n == 0);
+        mark_stage(STAGE_ACK);
+        TFTP_PROBE0(oack__acked);
     }
 
-    r = sender(peer, NULL, segsize, windowsize, TIMEOUT, rollover_val, file, NULL);
+    if (range_offset && fseeko(file, range_offset, SEEK_SET)) {
+        alog(LOG_WARNING, "%s: seek: %m", filename);
+        send_error(peer, NULL, "Cannot seek to the offset");
+        r = E_FAILED_TO_READ;
+        goto abort;
+    }
+
+    r = sender(peer, NULL, segsize, windowsize, TIMEOUT, rollover_val, file,
+               range_length ? (off_t)range_length : -1, NULL, &xrec.st);
+    xrec.stage[STAGE_DATA] = xrec.st.sent_us;
+    if (r == E_NO_MEMORY) {
+        alog(LOG_WARNING, "%s: transfer memory limit reached", filename);
+        goto abort;
+    }
 
     tmp_p = (char *)inet_ntop(from.sa.sa_family, SOCKADDR_P(&from),
                               tmpbuf, INET6_ADDRSTRLEN);
@@ -1566,16 +2352,52 @@ static void tftp_sendfile(const struct formats *pf, struct tftphdr *oap, int oac
         tmp_p = tmpbuf;
         strcpy(tmpbuf, "???");  // TODO: what does this help? CK
     }
-    syslog(LOG_NOTICE, "Client %s finished %s", tmp_p, filename);
+    alog(LOG_NOTICE, "Client %s finished %s", tmp_p, filename);
 
 abort:
     if (timed_out || r == E_TIMED_OUT) {
         assert(tmp_p);
-        syslog(LOG_NOTICE, "Client %s timed out", tmp_p);
+        alog(LOG_NOTICE, "Client %s timed out", tmp_p);
     }
+    set_result(r, timed_out);
     fclose(file);
 }
 
+/*
+ * Whether the file system fd is on has room for size more bytes.
+ * Errs on the side of yes if it cannot tell.
+ */
+static int room_for(int fd, uintmax_t size)
+{
+#if defined(HAVE_SYS_STATVFS_H) && defined(HAVE_FSTATVFS)
+    struct statvfs sv;
+
+    if (fstatvfs(fd, &sv) == 0 && sv.f_frsize &&
+        (uintmax_t)sv.f_bavail < (size + sv.f_frsize - 1) / sv.f_frsize)
+        return 0;
+#else
+    (void)fd;
+    (void)size;
+#endif
+    return 1;
+}
+
+/*
+ * After an upload which did not complete, give back what preallocate()
+ * reserved past the data actually written.  The reservation is beyond
+ * the end of the file, so truncating it to its size frees it.
+ */
+static void release_space(void)
+{
+    struct stat st;
+
+    fflush(file);
+    if (!fstat(fileno(file), &st) && S_ISREG(st.st_mode) &&
+        ftruncate(fileno(file), st.st_size)) {
+        /* Only space lost until the file goes; nothing more to do */
+    }
+}
+
 /*
  * Receive a file.
  */
@@ -1583,16 +2405,27 @@ static void tftp_recvfile(const struct formats *pf, struct tftphdr *oap, int oac
 {
     int retries = RETRIES;
     int timed_out = 0;
-    int r;
-    (void) pf;
+    int r = 0;
 
     set_verbose(verbosity);
+
+    /* tsize, if the client gave it, says whether this can work,
+       unless the file is to be sparse */
+    if (tsize && !sparse_writes && (!room_for(fileno(file), tsize) ||
+                                    preallocate(fileno(file), 0, tsize))) {
+        nak(ENOSPACE, NULL);
+        goto abort;
+    }
     if (oap) {
         do {
             if (send(peer, oap, oacklen, 0) != oacklen) {
-                syslog(LOG_WARNING, "tftpd: oack: %m\n");
+                alog(LOG_WARNING, "tftpd: oack: %m\n");
+                r = E_SYSTEM_ERROR;
                 goto abort;
             }
+            TFTP_PROBE1(oack__sent, oacklen);
+            if (!xrec.stage[STAGE_OACK])
+                mark_stage(STAGE_OACK);
             r = recvfrom_flags_with_timeout(peer, pktbuf, sizeof(pktbuf), NULL, TIMEOUT, MSG_PEEK);
             if (r == 0) {
                 if (--retries <= 0) {
@@ -1601,6 +2434,8 @@ static void tftp_recvfile(const struct formats *pf, struct tftphdr *oap, int oac
                 }
             }
         } while (r == 0);
+        if (r > 0)
+            TFTP_PROBE0(oack__acked);       /* By the first DATA */
     } else {
         do {
             send_ack(peer, NULL, 0);
@@ -1614,30 +2449,31 @@ static void tftp_recvfile(const struct formats *pf, struct tftphdr *oap, int oac
         } while (r == 0);
     }
 
-    r = receiver(peer, NULL, segsize, windowsize, TIMEOUT, file, NULL, NULL);
+    if (r > 0)
+        mark_stage(STAGE_ACK);      /* The first DATA is here */
+
+    /* Binary uploads are written in large blocks, in the background
+       with --write-behind */
+    if (!pf->f_convert && write_behind)
+        wbehind_start(fileno(file), write_behind);
+    r = receiver(peer, NULL, segsize, windowsize, TIMEOUT, file,
+                 pf->f_convert ? -1 : 0, tsize ? (off_t)tsize : -1,
+                 NULL, NULL, &xrec.st);
+    wbehind_stop();
+    if (r == E_NO_MEMORY)
+        alog(LOG_WARNING, "transfer memory limit reached");
 
 abort:
     if (timed_out || r == E_TIMED_OUT) {
         assert(tmp_p);
-        syslog(LOG_NOTICE, "Client %s timed out", tmp_p);
+        alog(LOG_NOTICE, "Client %s timed out", tmp_p);
     }
+    set_result(r, timed_out);
+    if (strcmp(xrec.result, "ok"))
+        release_space();
     fclose(file);
 }
 
-static const char *const errmsgs[] = {
-    "Undefined error code",     /* 0 - EUNDEF */
-    "File not found",           /* 1 - ENOTFOUND */
-    "Access denied",            /* 2 - EACCESS */
-    "Disk full or allocation exceeded", /* 3 - ENOSPACE */
-    "Illegal TFTP operation",   /* 4 - EBADOP */
-    "Unknown transfer ID",      /* 5 - EBADID */
-    "File already exists",      /* 6 - EEXISTS */
-    "No such user",             /* 7 - ENOUSER */
-    "Failure to negotiate RFC2347 options"      /* 8 - EOPTNEG */
-};
-
-#define ERR_CNT (sizeof(errmsgs)/sizeof(const char *))
-
 /*
  * Send a nak packet (error message).
  * Error code passed in is one of the
@@ -1666,11 +2502,17 @@ static void nak(int error, const char *msg)
     }
 
     tp->th_code = htons((u_short) error);
+    metrics_nak(error);
 
     length = strlen(msg) + 1;
     memcpy(tp->th_msg, msg, length);
     length += 4;                /* Add space for header */
 
+    if (!xrec.result) {
+        xrec.result = "refused";
+        set_xrec(xrec.error, msg);
+    }
+
     if (verbosity >= 2) {
         tmp_p = (char *)inet_ntop(from.sa.sa_family, SOCKADDR_P(&from),
                                   tmpbuf, INET6_ADDRSTRLEN);
@@ -1678,10 +2520,10 @@ static void nak(int error, const char *msg)
             tmp_p = tmpbuf;
             strcpy(tmpbuf, "???");  // TODO: what does this help? CK
         }
-        syslog(LOG_INFO, "sending NAK (%d, %s) to %s",
-               error, tp->th_msg, tmp_p);
+        alog(LOG_INFO, "sending NAK (%d, %s) to %s",
+             error, tp->th_msg, tmp_p);
     }
 
     if (send(peer, buf, length, 0) != length)
-        syslog(LOG_WARNING, "nak: %m");
+        alog(LOG_WARNING, "nak: %m");
 }
@@ -22,6 +22,10 @@
 void set_signal(int, void (*)(int), int);
 void *tfmalloc(size_t);
 char *tfstrdup(const char *);
+int open_beneath(int, const char *, int, mode_t);
+struct passwd;
+void detach_helper(const struct passwd *, const char *);
+int listen_unix(const char *);
 
 extern int verbosity;
 
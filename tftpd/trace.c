@@ -0,0 +1,120 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * trace.c
+ *
+ * The request trace for --trace: a compact binary record of each
+ * request, enough to send the same requests again with the same
+ * timing (see tftp-bench -r).  As with --xfer-log, each record goes
+ * out in a single write() to a file opened for appending, so records
+ * from concurrent children do not mix.
+ */
+
+#include "tftpd.h"
+#include "trace.h"
+#include "xferlog.h"
+#include "../common/xfer.h"
+
+static int trace_fd = -1;
+
+int trace_open(const char *path)
+{
+    struct stat st;
+
+    trace_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (trace_fd < 0)
+        return -1;
+
+    if (fstat(trace_fd, &st) == 0 && st.st_size == 0 &&
+        write(trace_fd, TRACE_MAGIC, TRACE_MAGICLEN) != TRACE_MAGICLEN) {
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static enum trace_result result_code(const char *result)
+{
+    if (!result)
+        return TRACE_ERROR;
+    if (!strcmp(result, "ok"))
+        return TRACE_OK;
+    if (!strcmp(result, "refused"))
+        return TRACE_REFUSED;
+    if (!strcmp(result, "timeout"))
+        return TRACE_TIMEOUT;
+    if (!strcmp(result, "declined"))
+        return TRACE_DECLINED;
+    return TRACE_ERROR;
+}
+
+void trace_write(const struct xferlog_rec *r, const union sock_addr *client)
+{
+    char buf[sizeof(struct trace_rec) + TRACE_NAMEMAX];
+    struct trace_rec *t = (struct trace_rec *)buf;
+    unsigned long long bytes = r->st.bytes;
+    size_t namelen;
+    struct timeval tv;
+    long now, start, took;
+
+    if (trace_fd < 0 || !r->op)
+        return;
+
+    /* When the request came in, by the wall clock */
+    gettimeofday(&tv, NULL);
+    now = xfer_now_us();
+    start = r->stage[STAGE_RECEIVED] ? r->stage[STAGE_RECEIVED]
+        : r->request * 1000L;
+    took = (r->st.end ? r->st.end * 1000L : now) - start;
+    if (took < 0)
+        took = 0;
+    tv.tv_sec -= (now - start) / 1000000;
+    tv.tv_usec -= (now - start) % 1000000;
+    if (tv.tv_usec < 0) {
+        tv.tv_sec--;
+        tv.tv_usec += 1000000;
+    }
+
+    memset(t, 0, sizeof *t);
+    namelen = strlen(r->reqname);
+    if (namelen > TRACE_NAMEMAX)
+        namelen = TRACE_NAMEMAX;
+    memcpy(t + 1, r->reqname, namelen);
+
+    t->length = htons(sizeof *t + namelen);
+    t->op = !strcmp(r->op, "WRQ") ? WRQ : RRQ;
+    t->result = result_code(r->result);
+    t->port = SOCKPORT(client);
+    t->blksize = htons(r->blksize);
+    t->sec = htonl(tv.tv_sec);
+    t->usec = htonl(tv.tv_usec);
+    t->bytes_hi = htonl(bytes >> 32);
+    t->bytes_lo = htonl(bytes & 0xffffffffUL);
+    t->duration_us = htonl((unsigned long)took > 0xffffffffUL ?
+                           0xffffffffUL : (unsigned long)took);
+    t->windowsize = htons(r->windowsize);
+    t->timeout = htons(r->timeout);
+
+    if (client->sa.sa_family == AF_INET) {
+        t->addr[10] = t->addr[11] = 0xff;
+        memcpy(&t->addr[12], &client->si.sin_addr, 4);
+    }
+#ifdef HAVE_IPV6
+    else if (client->sa.sa_family == AF_INET6) {
+        memcpy(t->addr, &client->s6.sin6_addr, 16);
+    }
+#endif
+
+    if (write(trace_fd, buf, sizeof *t + namelen) < 0) {
+        /* Nothing sensible to do about it */
+    }
+}
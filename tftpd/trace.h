@@ -0,0 +1,65 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * trace.h
+ *
+ * The binary request trace written by --trace, and read back by
+ * tftp-bench -r to replay it.  A trace file starts with TRACE_MAGIC,
+ * followed by one record per request: a struct trace_rec, in network
+ * byte order, and the file name the client asked for, without a NUL.
+ * Records are in the order the requests ended, not the order they
+ * came in.  A reader skips TRACE_MAGIC wherever a record would start,
+ * in case two servers began the same file at once.
+ */
+
+#ifndef TFTPD_TRACE_H
+#define TFTPD_TRACE_H
+
+#include "../common/tftpsubs.h"
+#include "../common/common.h"
+
+#define TRACE_MAGIC     "TFTPTRC1"
+#define TRACE_MAGICLEN  8
+
+enum trace_result {
+    TRACE_OK,
+    TRACE_REFUSED,
+    TRACE_TIMEOUT,
+    TRACE_ERROR,
+    TRACE_DECLINED
+};
+
+struct trace_rec {
+    uint16_t length;            /* Of the record, with the file name */
+    uint8_t op;                 /* RRQ or WRQ */
+    uint8_t result;             /* enum trace_result */
+    uint16_t port;              /* Client's */
+    uint16_t blksize;           /* Negotiated */
+    uint32_t sec, usec;         /* Wall clock time the request came in */
+    uint32_t bytes_hi, bytes_lo;        /* Transferred */
+    uint32_t duration_us;       /* From the request to the end */
+    uint16_t windowsize;        /* Negotiated */
+    uint16_t timeout;           /* ms */
+    uint8_t addr[16];           /* Client's; IPv4 is mapped into IPv6 */
+};
+
+#define TRACE_NAMEMAX   512
+
+struct xferlog_rec;
+
+/* Open a trace file for appending, and start it if it is empty.
+   Returns 0, or -1 with errno set. */
+int trace_open(const char *path);
+
+/* Append the record for a request, if --trace is in effect */
+void trace_write(const struct xferlog_rec *, const union sock_addr *client);
+
+#endif                          /* TFTPD_TRACE_H */
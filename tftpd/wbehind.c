@@ -0,0 +1,232 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * wbehind.c
+ *
+ * Write-behind for --write-behind.  The receiver gathers an upload into
+ * buffers of XFER_WBUF_SIZE bytes, in memory shared with a writer
+ * process forked for the transfer, and hands each one over when it is
+ * full by its number, offset and length, down a SOCK_SEQPACKET socket
+ * pair.  The writer pwrite()s it, starts it on its way to the disk, and
+ * sends the message back to say the buffer is free again.  Only when
+ * every buffer is queued does the receiver wait for one, so the disk
+ * holds up the transfer only once it has fallen that far behind.
+ *
+ * Before the final ACK, the receiver asks the writer to sync the file
+ * and waits for the answer, so a client which is told its upload
+ * succeeded has it on disk.  Once a write fails, the writer does no
+ * more and says so in every answer, and the receiver gives up on the
+ * transfer at the next buffer.
+ */
+
+#include "tftpd.h"
+#include "wbehind.h"
+#include "../common/xfer.h"
+
+#include <syslog.h>
+#include <sys/wait.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define WB_SYNC         -1      /* Message index: sync the file */
+
+struct wb_msg {
+    int index;                  /* Buffer, or WB_SYNC */
+    int err;                    /* Back from the writer: errno, or 0 */
+    off_t pos;
+    size_t len;
+};
+
+static char *bufs;              /* The buffers, shared with the writer */
+static int freelist[MAX_WRITE_BEHIND];
+static int nfree;
+static int sock = -1;           /* Our end of the socket pair */
+static pid_t writer_pid;
+static int failed;              /* errno of the first failure, or 0 */
+
+/* The writer process; never returns */
+static void writer(int fd, int s)
+{
+    struct wb_msg m;
+    ssize_t n;
+    off_t end = 0;              /* Of the data so far */
+    int err = 0;
+
+    for (;;) {
+        n = recv(s, &m, sizeof m, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n != sizeof m)
+            _exit(0);           /* The receiver is done */
+
+        if (err) {
+            /* Nothing more once a write has failed */
+        } else if (m.index >= 0) {
+            if (write_at(fd, bufs + (size_t)m.index * XFER_WBUF_SIZE,
+                         m.len, m.pos))
+                err = errno;
+            if (end < m.pos + (off_t)m.len)
+                end = m.pos + m.len;
+#ifdef HAVE_SYNC_FILE_RANGE
+            /* Under way to the disk now, so the sync has less to do */
+            if (!err)
+                sync_file_range(fd, m.pos, m.len, SYNC_FILE_RANGE_WRITE);
+#endif
+        } else if (sparse_writes && extend_to(fd, end)) {
+            err = errno;        /* It ended in a hole */
+        } else {
+#ifdef HAVE_FDATASYNC
+            if (fdatasync(fd) && errno != EINVAL)
+#else
+            if (fsync(fd) && errno != EINVAL)
+#endif
+                err = errno;    /* EINVAL: not a file which syncs */
+        }
+
+        m.err = err;
+        if (send(s, &m, sizeof m, MSG_NOSIGNAL) != sizeof m)
+            _exit(0);
+    }
+}
+
+static void set_failed(int err)
+{
+    if (!failed)
+        syslog(LOG_WARNING, "write-behind: %s", strerror(err));
+    failed = err;
+}
+
+/* Wait for the writer's next answer; returns its index, or -2 (with
+   failed set) if the writer has gone */
+static int collect(void)
+{
+    struct wb_msg m;
+    ssize_t n;
+
+    do {
+        n = recv(sock, &m, sizeof m, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n != sizeof m) {
+        set_failed(n < 0 ? errno : EPIPE);
+        return -2;
+    }
+
+    if (m.index >= 0)
+        freelist[nfree++] = m.index;
+    if (m.err)
+        set_failed(m.err);
+    return m.index;
+}
+
+static char *wb_get(void)
+{
+    while (!failed && !nfree)
+        collect();
+    if (failed)
+        return NULL;
+    return bufs + (size_t)freelist[--nfree] * XFER_WBUF_SIZE;
+}
+
+static int wb_put(char *buf, size_t len, off_t pos)
+{
+    struct wb_msg m;
+
+    m.index = (buf - bufs) / XFER_WBUF_SIZE;
+    m.err = 0;
+    m.pos = pos;
+    m.len = len;
+
+    if (!failed && send(sock, &m, sizeof m, MSG_NOSIGNAL) != sizeof m)
+        set_failed(errno);
+    if (failed) {
+        freelist[nfree++] = m.index;
+        return -1;
+    }
+    return 0;
+}
+
+static int wb_sync(void)
+{
+    struct wb_msg m;
+
+    memset(&m, 0, sizeof m);
+    m.index = WB_SYNC;
+    if (!failed && send(sock, &m, sizeof m, MSG_NOSIGNAL) != sizeof m)
+        set_failed(errno);
+    while (!failed && collect() != WB_SYNC)
+        ;
+    return failed ? -1 : 0;
+}
+
+static const struct xfer_writer wb_writer = {
+    wb_get,
+    wb_put,
+    wb_sync,
+};
+
+int wbehind_start(int fd, int nbufs)
+{
+    int sv[2];
+    pid_t pid;
+    int i;
+
+    /* Kept from one transfer to the next by a --prefork worker */
+    if (!bufs) {
+        bufs = shm_alloc((size_t)nbufs * XFER_WBUF_SIZE);
+        if (!bufs) {
+            syslog(LOG_WARNING, "write-behind: %m");
+            return -1;
+        }
+    }
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        syslog(LOG_WARNING, "write-behind: socketpair: %m");
+        return -1;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        syslog(LOG_WARNING, "write-behind: fork: %m");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    } else if (pid == 0) {
+        close(sv[0]);
+        writer(fd, sv[1]);
+    }
+
+    close(sv[1]);
+    sock = sv[0];
+    writer_pid = pid;
+    failed = 0;
+    for (i = 0; i < nbufs; i++)
+        freelist[i] = nbufs - 1 - i;    /* Buffer 0 first */
+    nfree = nbufs;
+
+    xfer_writer = &wb_writer;
+    return 0;
+}
+
+void wbehind_stop(void)
+{
+    if (sock < 0)
+        return;
+
+    xfer_writer = NULL;
+    close(sock);
+    sock = -1;
+
+    /* It finishes what it has, sees end-of-file and goes */
+    while (waitpid(writer_pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+}
@@ -0,0 +1,37 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * wbehind.h
+ *
+ * Write-behind for --write-behind: a process of its own which writes an
+ * upload to disk while the transfer goes on, so that a slow disk does
+ * not hold up the ACKs.
+ */
+
+#ifndef TFTPD_WBEHIND_H
+#define TFTPD_WBEHIND_H
+
+#include "../common/tftpsubs.h"
+
+#define MAX_WRITE_BEHIND 64     /* Buffers of XFER_WBUF_SIZE bytes */
+
+/* Start a writer for fd, with nbufs buffers, and make the receiver use
+   it.  Returns 0, or -1 if it could not be started, in which case the
+   receiver writes the file itself.  There is one writer per process,
+   for one upload: each is started and stopped around its receiver(),
+   so a failed write is not carried over to the next. */
+int wbehind_start(int fd, int nbufs);
+
+/* Once the receiver is done: wait for the writer to finish what it was
+   given, and stop it */
+void wbehind_stop(void);
+
+#endif                          /* TFTPD_WBEHIND_H */
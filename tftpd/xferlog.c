@@ -0,0 +1,245 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * xferlog.c
+ *
+ * Per-request records for --xfer-log, one JSON object per line, with
+ * what was negotiated and how the transfer went.  Each record goes out
+ * in a single write(), so records from concurrent children do not mix
+ * in a file opened for appending, and each is one datagram on a socket.
+ * A socket is written without blocking; a reader which does not keep
+ * up loses records rather than holding up transfers.
+ */
+
+#include "tftpd.h"
+#include "xferlog.h"
+#include "../common/xfer.h"
+
+#include <stdarg.h>
+#include <sys/un.h>
+
+#define XFERLOG_MAX     4096    /* Longest record */
+#define JSTRING_MAX     256     /* Longest string field, as written */
+
+const char *const xfer_stage_names[NSTAGES] = {
+    "received", "session", "access", "privdrop", "remap", "open",
+    "oack", "ack", "data"
+};
+
+static int log_fd = -1;
+static int log_socket;          /* log_fd is a datagram socket */
+static int log_connected;
+static struct sockaddr_un log_addr;
+
+int xferlog_open(const char *dest)
+{
+    if (!strncmp(dest, "unix:", 5)) {
+        const char *path = dest + 5;
+
+        if (strlen(path) >= sizeof log_addr.sun_path) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memset(&log_addr, 0, sizeof log_addr);
+        log_addr.sun_family = AF_UNIX;
+        strcpy(log_addr.sun_path, path);
+
+        log_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (log_fd < 0)
+            return -1;
+        log_socket = 1;
+
+        /* Connect while the path can still be reached, before any
+           chroot; if nobody is listening yet, try again by name for
+           each record */
+        log_connected = !connect(log_fd, (struct sockaddr *)&log_addr,
+                                 sizeof log_addr);
+    } else {
+        log_fd = open(dest, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (log_fd < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+struct jbuf {
+    char *p;
+    size_t left;
+    int truncated;              /* A string field was cut short */
+};
+
+static void jprintf(struct jbuf *b, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(b->p, b->left, fmt, ap);
+    va_end(ap);
+
+    if (n < 0)
+        n = 0;
+    if ((size_t)n >= b->left)
+        n = b->left ? b->left - 1 : 0;
+    b->p += n;
+    b->left -= n;
+}
+
+/* Length of the valid UTF-8 sequence for a non-ASCII character at p,
+   or 0 if it is not one (overlong, a surrogate, or beyond U+10FFFF) */
+static int utf8_len(const unsigned char *p)
+{
+    unsigned int c;
+    int n, i;
+
+    if (p[0] >= 0xc2 && p[0] <= 0xdf)
+        n = 2, c = p[0] & 0x1f;
+    else if (p[0] >= 0xe0 && p[0] <= 0xef)
+        n = 3, c = p[0] & 0x0f;
+    else if (p[0] >= 0xf0 && p[0] <= 0xf4)
+        n = 4, c = p[0] & 0x07;
+    else
+        return 0;
+
+    for (i = 1; i < n; i++) {
+        if ((p[i] & 0xc0) != 0x80)
+            return 0;           /* Including the NUL at the end */
+        c = (c << 6) | (p[i] & 0x3f);
+    }
+
+    if ((n == 3 && c < 0x800) || (c >= 0xd800 && c <= 0xdfff) ||
+        (n == 4 && (c < 0x10000 || c > 0x10ffff)))
+        return 0;
+    return n;
+}
+
+/* A string field, null if empty; UTF-8 goes through as it is, control
+   characters are escaped, and bytes which are not UTF-8 become U+FFFD.
+   A field is cut at JSTRING_MAX bytes, between characters, so that a
+   record always fits in XFERLOG_MAX and is whole JSON */
+static void jstring(struct jbuf *b, const char *name, const char *s)
+{
+    const unsigned char *p;
+    char c[8];
+    size_t len = 0;
+    int n;
+
+    if (!s || !*s) {
+        jprintf(b, ",\"%s\":null", name);
+        return;
+    }
+
+    jprintf(b, ",\"%s\":\"", name);
+    for (p = (const unsigned char *)s; *p; p += n) {
+        n = 1;
+        if (*p == '"' || *p == '\\')
+            sprintf(c, "\\%c", *p);
+        else if (*p < 0x20 || *p == 0x7f)
+            sprintf(c, "\\u%04x", *p);
+        else if (*p < 0x80)
+            sprintf(c, "%c", *p);
+        else if (!(n = utf8_len(p))) {
+            strcpy(c, "\\ufffd");
+            n = 1;
+        } else
+            sprintf(c, "%.*s", n, (const char *)p);
+
+        len += strlen(c);
+        if (len > JSTRING_MAX) {
+            b->truncated = 1;
+            break;
+        }
+        jprintf(b, "%s", c);
+    }
+    jprintf(b, "\"");
+}
+
+/* How long the request took to reach each stage from the one before */
+static void stages(struct jbuf *b, const struct xferlog_rec *r)
+{
+    long prev = r->stage[STAGE_RECEIVED];
+    const char *sep = "";
+    int i;
+
+    if (!prev)
+        return;
+
+    jprintf(b, ",\"stages_us\":{");
+    for (i = STAGE_RECEIVED + 1; i < NSTAGES; i++) {
+        if (!r->stage[i])
+            continue;
+        jprintf(b, "%s\"%s\":%ld", sep, xfer_stage_names[i],
+                r->stage[i] - prev);
+        prev = r->stage[i];
+        sep = ",";
+    }
+    jprintf(b, "}");
+}
+
+void xferlog_write(const struct xferlog_rec *r, const union sock_addr *client)
+{
+    char buf[XFERLOG_MAX];
+    char addr[INET6_ADDRSTRLEN];
+    struct jbuf b;
+    struct timeval tv;
+    long end;
+
+    if (log_fd < 0 || !r->op)
+        return;
+
+    if (!inet_ntop(client->sa.sa_family, SOCKADDR_P(client),
+                   addr, sizeof addr))
+        strcpy(addr, "???");
+    gettimeofday(&tv, NULL);
+    end = r->st.end ? r->st.end : xfer_now();
+
+    b.p = buf;
+    b.left = sizeof buf - 1;    /* Room for the newline */
+    b.truncated = 0;
+
+    jprintf(&b, "{\"time\":%ld.%03ld", (long)tv.tv_sec,
+            (long)tv.tv_usec / 1000);
+    jstring(&b, "client", addr);
+    jprintf(&b, ",\"port\":%u", ntohs(SOCKPORT(client)));
+    jstring(&b, "op", r->op);
+    jstring(&b, "file", r->filename);
+    jstring(&b, "mode", r->mode);
+    jprintf(&b, ",\"blksize\":%u,\"windowsize\":%u,\"timeout_ms\":%u",
+            r->blksize, r->windowsize, r->timeout);
+    jprintf(&b, ",\"bytes\":%lu,\"blocks\":%lu", r->st.bytes, r->st.blocks);
+    jprintf(&b, ",\"retransmits\":%lu,\"out_of_order\":%lu,\"timeouts\":%lu",
+            r->st.retransmits, r->st.out_of_order, r->st.timeouts);
+    if (r->st.first)
+        jprintf(&b, ",\"ttfb_ms\":%ld", r->st.first - r->request);
+    else
+        jprintf(&b, ",\"ttfb_ms\":null");
+    jprintf(&b, ",\"duration_ms\":%ld", end - r->request);
+    stages(&b, r);
+    jstring(&b, "result", r->result ? r->result : "error");
+    jstring(&b, "error", r->error);
+    if (b.truncated)
+        jprintf(&b, ",\"truncated\":true");
+    jprintf(&b, "}");
+
+    *b.p++ = '\n';
+
+    if (!log_socket) {
+        if (write(log_fd, buf, b.p - buf) < 0) {
+            /* Nothing sensible to do about it */
+        }
+    } else if (log_connected) {
+        send(log_fd, buf, b.p - buf, MSG_DONTWAIT);
+    } else {
+        sendto(log_fd, buf, b.p - buf, MSG_DONTWAIT,
+               (struct sockaddr *)&log_addr, sizeof log_addr);
+    }
+}
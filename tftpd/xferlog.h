@@ -0,0 +1,71 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 tftp-hpa contributors - All Rights Reserved
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * xferlog.h
+ *
+ * One JSON record per request for --xfer-log, written to a file or a
+ * UNIX datagram socket.
+ */
+
+#ifndef TFTPD_XFERLOG_H
+#define TFTPD_XFERLOG_H
+
+#include "../common/tftpsubs.h"
+#include "../common/common.h"
+
+#define XFERLOG_STRMAX  512     /* Longest string field, before escaping */
+
+/*
+ * Points a request passes on its way to the first data, for the time
+ * to first byte broken down by stage.  Each is timed by xfer_now_us(),
+ * or left 0 if the request did not pass there.
+ */
+enum xfer_stage {
+    STAGE_RECEIVED,             /* Read from the listening socket */
+    STAGE_SESSION,              /* Taken up by a child or worker */
+    STAGE_ACCESS,               /* Allowed by hosts_access() */
+    STAGE_PRIVDROP,             /* Groups, root directory and user set */
+    STAGE_REMAP,                /* Parsed, and the file name remapped */
+    STAGE_OPEN,                 /* File opened */
+    STAGE_OACK,                 /* OACK sent */
+    STAGE_ACK,                  /* Answered: ACK 0 to an RRQ's OACK, or
+                                   the first DATA of a WRQ */
+    STAGE_DATA,                 /* RRQ: first DATA sent */
+    NSTAGES
+};
+
+extern const char *const xfer_stage_names[NSTAGES];
+
+/* Strings are copied in, as the request buffer is reused for a NAK */
+struct xferlog_rec {
+    const char *op;             /* "RRQ" or "WRQ"; NULL if not a request */
+    char filename[XFERLOG_STRMAX + 1];  /* After remapping */
+    char reqname[XFERLOG_STRMAX + 1];   /* As the client asked for it */
+    const char *mode;
+    unsigned int blksize;
+    unsigned int windowsize;
+    unsigned int timeout;       /* ms */
+    long request;               /* xfer_now() when the request came in */
+    long stage[NSTAGES];        /* xfer_now_us() */
+    struct xfer_stats st;       /* All zero if no data was transferred */
+    const char *result;         /* "ok", "refused", "timeout",
+                                   "declined" or "error" */
+    char error[XFERLOG_STRMAX + 1];     /* Error message, or empty */
+};
+
+/* Open the destination: a file name, or "unix:" and a socket path.
+   Returns 0, or -1 with errno set. */
+int xferlog_open(const char *dest);
+
+/* Write the record for a request, if --xfer-log is in effect */
+void xferlog_write(const struct xferlog_rec *, const union sock_addr *client);
+
+#endif                          /* TFTPD_XFERLOG_H */
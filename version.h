@@ -0,0 +1 @@
+#define VERSION "tftp-hpa 5.2"